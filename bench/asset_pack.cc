@@ -0,0 +1,187 @@
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "asset_pack.hh"
+#include "lz4.hh"
+#include "thread_pool.hh"
+
+static const unsigned asset_count = 1024;
+static const size_t asset_size = 4096;
+
+static std::string temp_dir()
+{
+    const char* dir = std::getenv("TMPDIR");
+    return std::string(dir ? dir : "/tmp") + "/";
+}
+
+static std::string asset_name(unsigned i)
+{
+    return "asset" + std::to_string(i);
+}
+
+// The same assets, both as loose files and as one pack.
+static std::string make_assets()
+{
+    std::string dir = temp_dir();
+    std::vector<uint8_t> data(asset_size, 42);
+    asset_pack_writer writer;
+    for(unsigned i = 0; i < asset_count; ++i)
+    {
+        std::ofstream file(dir + "bench_" + asset_name(i), std::ios::binary);
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        writer.add(asset_name(i), data);
+    }
+    writer.write(dir + "bench.pack");
+    return dir;
+}
+
+static void remove_assets(const std::string& dir)
+{
+    for(unsigned i = 0; i < asset_count; ++i)
+    {
+        std::remove((dir + "bench_" + asset_name(i)).c_str());
+    }
+    std::remove((dir + "bench.pack").c_str());
+}
+
+// What reading a loose file costs: open, seek, allocate and copy.
+static void BM_asset_read_file(benchmark::State& state)
+{
+    std::string dir = make_assets();
+    std::vector<std::string> paths;
+    for(unsigned i = 0; i < asset_count; ++i)
+    {
+        paths.push_back(dir + "bench_" + asset_name(i));
+    }
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        std::ifstream file(
+            paths[i++ % paths.size()],
+            std::ios::binary | std::ios::ate
+        );
+        size_t length = file.tellg();
+        file.seekg(0, std::ios::beg);
+        std::unique_ptr<char[]> data(new char[length]);
+        file.read(data.get(), length);
+        benchmark::DoNotOptimize(data[0]);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * asset_size);
+    remove_assets(dir);
+}
+BENCHMARK(BM_asset_read_file);
+
+static void BM_asset_pack_get(benchmark::State& state)
+{
+    std::string dir = make_assets();
+    asset_pack pack(dir + "bench.pack");
+    std::vector<std::string> names;
+    for(unsigned i = 0; i < asset_count; ++i) names.push_back(asset_name(i));
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        asset_view view = pack.get(names[i++ % names.size()]);
+        benchmark::DoNotOptimize(view.data[0]);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * asset_size);
+    remove_assets(dir);
+}
+BENCHMARK(BM_asset_pack_get);
+
+// Startup cost of a pack, which is paid once instead of per asset.
+static void BM_asset_pack_open(benchmark::State& state)
+{
+    std::string dir = make_assets();
+    for(auto _: state)
+    {
+        asset_pack pack(dir + "bench.pack");
+        benchmark::DoNotOptimize(pack.size());
+    }
+    state.SetItemsProcessed(state.iterations());
+    remove_assets(dir);
+}
+BENCHMARK(BM_asset_pack_open);
+
+static const size_t large_asset_size = 64 << 20;
+
+// Shader-like text: a small vocabulary in random order, which compresses
+// about as well as real assets do.
+static std::vector<uint8_t> text_data(size_t size)
+{
+    static const char* const words[] = {
+        "vec4 ", "float ", "uniform ", "layout(location = ", ") in ",
+        "return ", "texture(", "normalize(", "dot(", " * ", " + ", ";\n",
+        "gl_Position", "sampler2D ", "mix(", "0.5", "1.0", "    "
+    };
+    const size_t word_count = sizeof(words)/sizeof(*words);
+    std::mt19937 rng(1);
+    std::vector<uint8_t> data;
+    data.reserve(size);
+    while(data.size() < size)
+    {
+        const char* word = words[rng() % word_count];
+        while(*word && data.size() < size) data.push_back(*word++);
+    }
+    return data;
+}
+
+static void BM_lz4_decompress(benchmark::State& state)
+{
+    std::vector<uint8_t> data = text_data(1 << 20);
+    std::vector<uint8_t> compressed(lz4_compress_bound(data.size()));
+    compressed.resize(lz4_compress(
+        data.data(), data.size(), compressed.data(), compressed.size()
+    ));
+    std::vector<uint8_t> out(data.size());
+    for(auto _: state)
+    {
+        lz4_decompress(
+            compressed.data(), compressed.size(), out.data(), out.size()
+        );
+        benchmark::DoNotOptimize(out[0]);
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+    state.counters["ratio"] = double(data.size())/compressed.size();
+}
+BENCHMARK(BM_lz4_decompress);
+
+// Reads one large asset out of a pack, raw or compressed, with the given
+// number of decoding threads (0 decodes on the calling thread).
+static void BM_asset_pack_read(benchmark::State& state)
+{
+    bool compress = state.range(0);
+    unsigned threads = state.range(1);
+    std::string path = temp_dir() + "bench_large.pack";
+    {
+        asset_pack_writer writer;
+        writer.add("large", text_data(large_asset_size), compress);
+        writer.write(path);
+    }
+    std::unique_ptr<thread_pool> pool;
+    if(threads) pool.reset(new thread_pool(threads));
+
+    asset_pack pack(path);
+    std::vector<uint8_t> out(pack.size_of("large"));
+    for(auto _: state)
+    {
+        pack.read("large", out.data(), pool.get());
+        benchmark::DoNotOptimize(out[0]);
+    }
+    state.SetBytesProcessed(state.iterations() * out.size());
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_asset_pack_read)
+    ->Args({0, 0})
+    ->Args({1, 0})->Args({1, 1})->Args({1, 2})->Args({1, 4})->Args({1, 8})
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,125 @@
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "async_io.hh"
+
+static const unsigned small_count = 10000;
+static const size_t small_size = 1024;
+static const unsigned large_count = 4;
+static const size_t large_size = 16 << 20;
+
+// Written once, on first use, and removed at exit.
+struct bench_files
+{
+    bench_files()
+    {
+        const char* dir = std::getenv("TMPDIR");
+        std::string prefix = std::string(dir ? dir : "/tmp") + "/async_io_";
+        for(unsigned i = 0; i < small_count; ++i)
+        {
+            small.push_back(prefix + "small" + std::to_string(i));
+            write(small.back(), small_size);
+        }
+        for(unsigned i = 0; i < large_count; ++i)
+        {
+            large.push_back(prefix + "large" + std::to_string(i));
+            write(large.back(), large_size);
+        }
+    }
+
+    ~bench_files()
+    {
+        for(const std::string& path: small) std::remove(path.c_str());
+        for(const std::string& path: large) std::remove(path.c_str());
+    }
+
+    static void write(const std::string& path, size_t size)
+    {
+        std::vector<char> data(size, 42);
+        std::ofstream(path, std::ios::binary).write(data.data(), size);
+    }
+
+    static const bench_files& get()
+    {
+        static bench_files files;
+        return files;
+    }
+
+    std::vector<std::string> small, large;
+};
+
+static size_t read_blocking(const std::vector<std::string>& paths)
+{
+    size_t total = 0;
+    for(const std::string& path: paths)
+    {
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        size_t length = file.tellg();
+        file.seekg(0, std::ios::beg);
+        std::unique_ptr<char[]> data(new char[length]);
+        file.read(data.get(), length);
+        total += file.gcount();
+    }
+    return total;
+}
+
+static size_t read_async(
+    async_io& io,
+    const std::vector<std::string>& paths
+){
+    std::vector<async_io::read_request> requests(paths.begin(), paths.end());
+    size_t total = 0;
+    for(async_io::read_result& r: io.read(requests)) total += r.get().size();
+    return total;
+}
+
+// One ifstream at a time, like read_file() in helpers.cc.
+static void BM_io_blocking(benchmark::State& state)
+{
+    const bench_files& files = bench_files::get();
+    const std::vector<std::string>& paths =
+        state.range(0) ? files.large : files.small;
+    for(auto _: state)
+    {
+        state.SetBytesProcessed(
+            state.bytes_processed() + read_blocking(paths)
+        );
+    }
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_io_blocking)
+    ->ArgName("large")->Arg(0)->Arg(1)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// All files in one batch, with io_uring (1) or the I/O threads (0).
+static void BM_io_async(benchmark::State& state)
+{
+    const bench_files& files = bench_files::get();
+    const std::vector<std::string>& paths =
+        state.range(1) ? files.large : files.small;
+    thread_pool pool(1);
+    async_io io(pool, state.range(0), 4);
+    if(state.range(0) && io.get_backend() != async_io::BACKEND_IO_URING)
+    {
+        state.SkipWithError("io_uring is not available");
+        return;
+    }
+
+    for(auto _: state)
+    {
+        state.SetBytesProcessed(
+            state.bytes_processed() + read_async(io, paths)
+        );
+    }
+    state.SetItemsProcessed(state.iterations() * paths.size());
+}
+BENCHMARK(BM_io_async)
+    ->ArgNames({"io_uring", "large"})
+    ->Args({0, 0})->Args({1, 0})->Args({0, 1})->Args({1, 1})
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,361 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include "thread_pool.hh"
+#include "resource_manager.hh"
+
+struct bench_system_data
+{
+    void load() { loads++; }
+    void unload() {}
+    size_t memory_usage() const { return 4096; }
+
+    std::atomic_uint loads{0};
+};
+
+struct bench_device_data
+{
+    bench_device_data(device_id, bench_system_data&) {}
+    void load() {}
+    void unload() {}
+};
+
+struct bench_resource
+{
+    using system_data_type = bench_system_data;
+    using device_data_type = bench_device_data;
+};
+
+using bench_container = resource_container<
+    bench_system_data,
+    bench_device_data
+>;
+
+static const unsigned resource_count = 1024;
+
+static std::vector<std::string> resource_names()
+{
+    std::vector<std::string> names;
+    for(unsigned i = 0; i < resource_count; ++i)
+    {
+        names.push_back("resource" + std::to_string(i));
+    }
+    return names;
+}
+
+static void BM_resource_get(benchmark::State& state)
+{
+    thread_pool pool(1);
+    resource_manager manager(pool);
+    std::vector<std::string> names = resource_names();
+    for(const std::string& name: names) manager.create<bench_resource>(name);
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        benchmark::DoNotOptimize(&manager.get<
+            bench_system_data, bench_device_data
+        >(names[i++ % names.size()]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_resource_get);
+
+// Handles are resolved once, after which lookups take no lock. Every thread
+// resolves handles from the same manager.
+static resource_manager* shared_manager = nullptr;
+static thread_pool* shared_pool = nullptr;
+static std::vector<resource_handle<bench_system_data, bench_device_data>>
+    shared_handles;
+
+static void BM_resource_get_handle(benchmark::State& state)
+{
+    if(state.thread_index() == 0)
+    {
+        shared_pool = new thread_pool(1);
+        shared_manager = new resource_manager(*shared_pool);
+        for(const std::string& name: resource_names())
+        {
+            shared_handles.push_back(
+                shared_manager->create<bench_resource>(name)
+            );
+        }
+    }
+
+    size_t i = state.thread_index() * 97;
+    for(auto _: state)
+    {
+        benchmark::DoNotOptimize(&shared_manager->get(
+            shared_handles[i++ % resource_count]
+        ));
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if(state.thread_index() == 0)
+    {
+        delete shared_manager;
+        delete shared_pool;
+        shared_handles.clear();
+    }
+}
+BENCHMARK(BM_resource_get_handle)
+    ->ThreadRange(1, std::max(std::thread::hardware_concurrency(), 1u))
+    ->UseRealTime();
+
+// Pinning an already pinned resource only bumps its reference count.
+static void BM_resource_pin_held(benchmark::State& state)
+{
+    thread_pool pool(1);
+    resource_manager manager(pool);
+    std::vector<std::string> names = resource_names();
+    for(const std::string& name: names)
+    {
+        manager.create<bench_resource>(name);
+        manager.pin(name);
+    }
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        const std::string& name = names[i++ % names.size()];
+        manager.pin(name);
+        manager.unpin(name);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    for(const std::string& name: names) manager.unpin(name);
+    pool.finish();
+}
+BENCHMARK(BM_resource_pin_held);
+
+static void BM_resource_pin_held_handle(benchmark::State& state)
+{
+    thread_pool pool(1);
+    resource_manager manager(pool);
+    std::vector<resource_handle<bench_system_data, bench_device_data>> handles;
+    for(const std::string& name: resource_names())
+    {
+        handles.push_back(manager.create<bench_resource>(name));
+        manager.pin(handles.back());
+    }
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        auto handle = handles[i++ % handles.size()];
+        manager.pin(handle);
+        manager.unpin(handle);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    for(auto handle: handles) manager.unpin(handle);
+    pool.finish();
+}
+BENCHMARK(BM_resource_pin_held_handle);
+
+// Pinning and unpinning an unpinned resource starts a load and then takes it
+// back.
+static void BM_resource_pin_flapping(benchmark::State& state)
+{
+    thread_pool pool(1);
+    resource_manager manager(pool);
+    std::vector<std::string> names = resource_names();
+    for(const std::string& name: names) manager.create<bench_resource>(name);
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        const std::string& name = names[i++ % names.size()];
+        manager.pin(name);
+        manager.unpin(name);
+    }
+    pool.finish();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_resource_pin_flapping);
+
+// Every thread pins and unpins resources on a device of its own. When held,
+// they're kept pinned on every device meanwhile, so only the reference counts
+// change. Otherwise each pin starts a load and each unpin takes it back.
+static int bench_devices[basic_resource_container::MAX_DEVICES];
+
+static void BM_resource_pin_device(benchmark::State& state)
+{
+    bool held = state.range(0);
+    if(state.thread_index() == 0)
+    {
+        shared_pool = new thread_pool(1);
+        shared_manager = new resource_manager(*shared_pool);
+        for(const std::string& name: resource_names())
+        {
+            shared_handles.push_back(
+                shared_manager->create<bench_resource>(name)
+            );
+            if(!held) continue;
+            for(int t = 0; t < state.threads(); ++t)
+            {
+                shared_manager->get(shared_handles.back()).pin(
+                    &bench_devices[t]
+                );
+            }
+        }
+    }
+
+    device_id id = &bench_devices[state.thread_index()];
+    size_t i = state.thread_index() * 97;
+    for(auto _: state)
+    {
+        const bench_container& container = shared_manager->get(
+            shared_handles[i++ % resource_count]
+        );
+        container.pin(id);
+        container.unpin(id);
+    }
+    state.SetItemsProcessed(state.iterations());
+
+    if(state.thread_index() == 0)
+    {
+        for(auto handle: shared_handles)
+        {
+            if(!held) break;
+            for(int t = 0; t < state.threads(); ++t)
+            {
+                shared_manager->get(handle).unpin(&bench_devices[t]);
+            }
+        }
+        shared_pool->finish();
+        delete shared_manager;
+        delete shared_pool;
+        shared_handles.clear();
+    }
+}
+BENCHMARK(BM_resource_pin_device)
+    ->Arg(0)->Arg(1)
+    ->ThreadRange(1, std::min(
+        std::max(std::thread::hardware_concurrency(), 1u),
+        basic_resource_container::MAX_DEVICES
+    ))
+    ->UseRealTime();
+
+// Using resources one after another, waiting for each to load. With a budget
+// that fits them all, only the first round loads anything.
+static void BM_resource_reuse(benchmark::State& state)
+{
+    thread_pool pool(1);
+    resource_manager manager(pool);
+    manager.set_system_budget(state.range(0));
+    std::vector<resource_handle<bench_system_data, bench_device_data>> handles;
+    for(const std::string& name: resource_names())
+    {
+        handles.push_back(manager.create<bench_resource>(name));
+    }
+
+    size_t i = 0;
+    for(auto _: state)
+    {
+        auto handle = handles[i++ % handles.size()];
+        manager.pin(handle);
+        benchmark::DoNotOptimize(&manager.get(handle).system());
+        manager.unpin(handle);
+    }
+    pool.finish();
+    state.SetItemsProcessed(state.iterations());
+    resource_manager::residency_stats stats = manager.get_system_stats();
+    state.counters["hit_rate"] = stats.hits /
+        std::max((double)(stats.hits + stats.misses), 1.0);
+}
+BENCHMARK(BM_resource_reuse)->Arg(0)->Arg(resource_count * 4096);
+
+struct pack_system_data
+{
+    pack_system_data(const std::string& asset, asset_view view)
+    : asset(asset), view(view), sum(0) {}
+    void load()
+    {
+        for(size_t i = 0; i < view.size; ++i) sum += view.data[i];
+    }
+    void unload() { sum = 0; }
+    std::string asset_name() const { return asset; }
+
+    std::string asset;
+    asset_view view;
+    unsigned sum;
+};
+
+struct pack_device_data
+{
+    pack_device_data(device_id, pack_system_data&) {}
+    void load() {}
+    void unload() {}
+};
+
+struct pack_resource
+{
+    using system_data_type = pack_system_data;
+    using device_data_type = pack_device_data;
+};
+
+// Loading a level's worth of assets from a pack, named in no particular
+// order. Either each is pinned and waited for, or they're all prefetched and
+// the group is waited for. The pack stays in the page cache between runs, so
+// this shows the cost of the bookkeeping more than the disk reads prefetching
+// saves.
+static void BM_resource_startup(benchmark::State& state)
+{
+    bool prefetch = state.range(0);
+    const unsigned asset_count = 256;
+    std::string path = "resource_bench_startup.pack";
+    asset_pack_writer writer;
+    std::vector<std::string> names;
+    for(unsigned i = 0; i < asset_count; ++i)
+    {
+        names.push_back("asset" + std::to_string(i));
+        writer.add(names.back(), std::vector<uint8_t>(64 * 1024, i));
+    }
+    writer.write(path);
+    std::shuffle(names.begin(), names.end(), std::mt19937(1));
+
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 1u));
+    for(auto _: state)
+    {
+        state.PauseTiming();
+        {
+            resource_manager manager(pool);
+            manager.mount(path);
+            std::vector<resource_handle<pack_system_data, pack_device_data>>
+                handles;
+            for(const std::string& name: names)
+            {
+                handles.push_back(manager.create<pack_resource>(
+                    name, name, manager.find_asset(name)
+                ));
+            }
+            state.ResumeTiming();
+
+            if(prefetch) manager.prefetch(names).result.wait();
+            else
+            {
+                for(auto handle: handles) manager.pin(handle);
+                for(auto handle: handles)
+                {
+                    benchmark::DoNotOptimize(manager.get(handle).system().sum);
+                }
+            }
+
+            state.PauseTiming();
+            for(auto handle: handles) manager.unpin(handle);
+            pool.finish();
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * asset_count);
+    std::remove(path.c_str());
+}
+BENCHMARK(BM_resource_startup)->Arg(0)->Arg(1)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,556 @@
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include "thread_pool.hh"
+#include "task_graph.hh"
+
+// Every benchmark is run against both schedulers, with 1 to N threads.
+static void pool_args(benchmark::internal::Benchmark* b)
+{
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 2u);
+    for(int mode: {
+        thread_pool::SCHEDULE_SHARED,
+        thread_pool::SCHEDULE_WORK_STEALING
+    }){
+        for(unsigned threads = 1; threads <= max_threads; threads *= 2)
+        {
+            b->Args({mode, (int)threads});
+        }
+    }
+    b->ArgNames({"mode", "threads"});
+    b->UseRealTime();
+}
+
+// Small tasks posted from outside of the pool.
+static void BM_post_external(benchmark::State& state)
+{
+    thread_pool pool(
+        state.range(1),
+        (thread_pool::scheduling)state.range(0)
+    );
+    const unsigned task_count = 4096;
+    std::atomic_uint counter(0);
+
+    for(auto _: state)
+    {
+        for(unsigned i = 0; i < task_count; ++i)
+        {
+            pool.post([&counter](){ counter++; });
+        }
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * task_count);
+}
+BENCHMARK(BM_post_external)->Apply(pool_args);
+
+// Same as above, but without results.
+static void BM_postf_external(benchmark::State& state)
+{
+    thread_pool pool(
+        state.range(1),
+        (thread_pool::scheduling)state.range(0)
+    );
+    const unsigned task_count = 4096;
+    std::atomic_uint counter(0);
+
+    for(auto _: state)
+    {
+        for(unsigned i = 0; i < task_count; ++i)
+        {
+            pool.postf({}, PRIORITY_LOW, [&counter](){ counter++; });
+        }
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * task_count);
+}
+BENCHMARK(BM_postf_external)->Apply(pool_args);
+
+// Round trip of a single task, from posting until the result is back.
+static void BM_post_latency(benchmark::State& state)
+{
+    thread_pool pool(
+        state.range(1),
+        (thread_pool::scheduling)state.range(0)
+    );
+
+    for(auto _: state)
+    {
+        benchmark::DoNotOptimize(pool.post([](){ return 1; }).get());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_post_latency)->Apply(pool_args);
+
+// Several threads posting into the same pool at once.
+static thread_pool* contended_pool = nullptr;
+
+static void BM_post_contended(benchmark::State& state)
+{
+    if(state.thread_index() == 0)
+    {
+        contended_pool = new thread_pool(
+            std::max(std::thread::hardware_concurrency(), 2u)
+        );
+    }
+    const unsigned task_count = 256;
+    std::atomic_uint counter(0);
+
+    for(auto _: state)
+    {
+        for(unsigned i = 0; i < task_count; ++i)
+        {
+            contended_pool->postf({}, PRIORITY_LOW, [&counter](){
+                counter++;
+            });
+        }
+        while(counter != task_count) std::this_thread::yield();
+        counter = 0;
+    }
+    state.SetItemsProcessed(state.iterations() * task_count);
+
+    if(state.thread_index() == 0)
+    {
+        delete contended_pool;
+        contended_pool = nullptr;
+    }
+}
+BENCHMARK(BM_post_contended)->ThreadRange(1, 8)->UseRealTime();
+
+// finish() with nothing to wait for, and right after posting one task.
+static void BM_finish_idle(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+
+    for(auto _: state)
+    {
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_finish_idle);
+
+static void BM_finish_one(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+
+    for(auto _: state)
+    {
+        pool.postf({}, PRIORITY_LOW, [](){});
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_finish_one)->UseRealTime();
+
+// Time from posting a task to an idle pool until it starts, with the given
+// spin budget in microseconds and pause between tasks. -1 parks the workers
+// right away.
+static void BM_wake_latency(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    if(state.range(0) < 0) pool.set_idle_park(true);
+    else
+    {
+        std::chrono::microseconds spin(state.range(0));
+        pool.set_idle_spin(spin, spin);
+    }
+    std::chrono::microseconds pause(state.range(1));
+
+    for(auto _: state)
+    {
+        std::this_thread::sleep_for(pause);
+        auto posted = std::chrono::steady_clock::now();
+        auto started = pool.post([](){
+            return std::chrono::steady_clock::now();
+        }).get();
+        state.SetIterationTime(
+            std::chrono::duration<double>(started - posted).count()
+        );
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_wake_latency)
+    ->ArgNames({"spin_us", "pause_us"})
+    ->ArgsProduct({{-1, 0, 50, 1000}, {0, 100}})
+    // Manual time only counts the latency, so the pauses would otherwise
+    // make this run for minutes.
+    ->Iterations(5000)
+    ->UseManualTime();
+
+// Schedules 100k timers spread over 100ms and waits for all of them. Lateness
+// is how long after its deadline each one started running.
+static void BM_timers(benchmark::State& state)
+{
+    const unsigned count = 100000;
+    thread_pool pool(state.range(0));
+    std::vector<thread_pool::post_result<int64_t>> results;
+    results.reserve(count);
+
+    double schedule_time = 0, mean_late = 0, max_late = 0;
+    for(auto _: state)
+    {
+        auto start = thread_pool::clock::now();
+        for(unsigned i = 0; i < count; ++i)
+        {
+            auto deadline = start + std::chrono::nanoseconds(i * 1000);
+            results.push_back(pool.post_at(deadline, PRIORITY_LOW, [deadline](){
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    thread_pool::clock::now() - deadline
+                ).count();
+            }));
+        }
+        schedule_time += std::chrono::duration<double>(
+            thread_pool::clock::now() - start
+        ).count();
+
+        for(auto& r: results)
+        {
+            double late = r.get() / 1000.0;
+            mean_late += late;
+            max_late = std::max(max_late, late);
+        }
+        results.clear();
+    }
+    state.counters["schedule_ns"] =
+        schedule_time * 1e9 / (count * state.iterations());
+    state.counters["mean_late_us"] = mean_late / (count * state.iterations());
+    state.counters["max_late_us"] = max_late;
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_timers)
+    ->ArgName("threads")
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(std::max(std::thread::hardware_concurrency(), 2u))
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Growing the pool by the given number of threads and shrinking it back.
+static void BM_resize(benchmark::State& state)
+{
+    thread_pool pool(1);
+    unsigned added = state.range(0);
+
+    for(auto _: state)
+    {
+        pool.resize(1 + added);
+        pool.resize(1);
+    }
+    state.SetItemsProcessed(state.iterations() * added);
+}
+BENCHMARK(BM_resize)->RangeMultiplier(2)->Range(1, 16)->UseRealTime();
+
+// Small tasks posted by other tasks, the case that work stealing is for.
+static void spawn(thread_pool& pool, std::atomic_uint& counter, unsigned depth)
+{
+    counter++;
+    if(depth == 0) return;
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        pool.post([&pool, &counter, depth](){
+            spawn(pool, counter, depth - 1);
+        });
+    }
+}
+
+static void BM_post_nested(benchmark::State& state)
+{
+    thread_pool pool(
+        state.range(1),
+        (thread_pool::scheduling)state.range(0)
+    );
+    const unsigned depth = 6;
+    std::atomic_uint counter(0);
+
+    for(auto _: state)
+    {
+        counter = 0;
+        pool.post([&pool, &counter, depth](){ spawn(pool, counter, depth); });
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * counter);
+}
+BENCHMARK(BM_post_nested)->Apply(pool_args);
+
+// Dependency graphs, with the graph size as the argument.
+static void graph_args(benchmark::internal::Benchmark* b)
+{
+    b->RangeMultiplier(4)->Range(64, 16384);
+    b->UseRealTime();
+}
+
+static void BM_dependency_chain(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    unsigned length = state.range(0);
+
+    for(auto _: state)
+    {
+        thread_pool::task_id prev = 0;
+        for(unsigned i = 0; i < length; ++i)
+        {
+            prev = pool.postd({prev}, PRIORITY_LOW, [](){}).get_id();
+        }
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * length);
+}
+BENCHMARK(BM_dependency_chain)->Apply(graph_args);
+
+static void BM_dependency_fan_out(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    unsigned width = state.range(0);
+
+    for(auto _: state)
+    {
+        // Keep the root from finishing before all children have been added.
+        std::atomic_bool release(false);
+        thread_pool::task_id root = pool.post(
+            [&release](){ while(!release) std::this_thread::yield(); }
+        ).get_id();
+        for(unsigned i = 0; i < width; ++i)
+        {
+            pool.postd({root}, PRIORITY_LOW, [](){});
+        }
+        release = true;
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * width);
+}
+BENCHMARK(BM_dependency_fan_out)->Apply(graph_args);
+
+// Layers of diamonds: one task fans out to four, which join back into one.
+static void BM_dependency_diamond(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    unsigned diamonds = state.range(0) / 5;
+
+    for(auto _: state)
+    {
+        thread_pool::task_id top = 0;
+        for(unsigned i = 0; i < diamonds; ++i)
+        {
+            top = pool.postd({top}, PRIORITY_LOW, [](){}).get_id();
+            std::array<thread_pool::task_id, 4> sides;
+            for(thread_pool::task_id& side: sides)
+            {
+                side = pool.postd({top}, PRIORITY_LOW, [](){}).get_id();
+            }
+            top = pool.postd(sides, PRIORITY_LOW, [](){}).get_id();
+        }
+        pool.finish();
+    }
+    state.SetItemsProcessed(state.iterations() * diamonds * 6);
+}
+BENCHMARK(BM_dependency_diamond)->Apply(graph_args);
+
+// A frame of 500 nodes in 10 layers, each node depending on two of the layer
+// before it. Recorded once into a task_graph, or posted again with postd()
+// every frame.
+static constexpr unsigned FRAME_LAYERS = 10;
+static constexpr unsigned FRAME_WIDTH = 50;
+
+static void BM_frame_postd(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    std::atomic_uint counter(0);
+    std::vector<thread_pool::post_result<void>> prev(FRAME_WIDTH), layer;
+
+    for(auto _: state)
+    {
+        for(unsigned l = 0; l < FRAME_LAYERS; ++l)
+        {
+            layer.clear();
+            for(unsigned i = 0; i < FRAME_WIDTH; ++i)
+            {
+                layer.push_back(pool.postd(
+                    {prev[i].get_id(), prev[(i + 1) % FRAME_WIDTH].get_id()},
+                    PRIORITY_LOW,
+                    [&counter](){ counter++; }
+                ));
+            }
+            std::swap(prev, layer);
+        }
+        for(auto& r: prev) r.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * FRAME_LAYERS * FRAME_WIDTH);
+}
+BENCHMARK(BM_frame_postd)->UseRealTime();
+
+static void BM_frame_task_graph(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    std::atomic_uint counter(0);
+    task_graph<unsigned> graph;
+    for(unsigned l = 0; l < FRAME_LAYERS; ++l)
+    {
+        for(unsigned i = 0; i < FRAME_WIDTH; ++i)
+        {
+            graph.add_node([&counter](unsigned){ counter++; });
+            if(l == 0) continue;
+            size_t base = (l - 1) * FRAME_WIDTH;
+            graph.add_edge(base + i, graph.size() - 1);
+            graph.add_edge(base + (i + 1) % FRAME_WIDTH, graph.size() - 1);
+        }
+    }
+
+    unsigned frame = 0;
+    for(auto _: state)
+    {
+        graph.run(pool, frame++);
+        graph.wait();
+    }
+    state.SetItemsProcessed(state.iterations() * graph.size());
+}
+BENCHMARK(BM_frame_task_graph)->UseRealTime();
+
+// Data-parallel loops against plain serial ones, with the element count and
+// the cost of each element as the arguments.
+static void loop_args(benchmark::internal::Benchmark* b)
+{
+    for(int count: {1 << 10, 1 << 14, 1 << 18})
+    {
+        for(int cost: {1, 16, 256})
+        {
+            b->Args({count, cost});
+        }
+    }
+    b->ArgNames({"count", "cost"});
+    b->UseRealTime();
+}
+
+static uint64_t element_work(uint64_t x, int cost)
+{
+    for(int i = 0; i < cost; ++i)
+    {
+        x = x * 6364136223846793005ull + 1442695040888963407ull;
+    }
+    return x;
+}
+
+static void BM_serial_for(benchmark::State& state)
+{
+    std::vector<uint64_t> data(state.range(0));
+    int cost = state.range(1);
+
+    for(auto _: state)
+    {
+        for(size_t i = 0; i < data.size(); ++i)
+        {
+            data[i] = element_work(data[i] + i, cost);
+        }
+        benchmark::DoNotOptimize(data.data());
+    }
+    state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_serial_for)->Apply(loop_args);
+
+static void BM_parallel_for(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    std::vector<uint64_t> data(state.range(0));
+    int cost = state.range(1);
+
+    for(auto _: state)
+    {
+        pool.parallel_for(size_t(0), data.size(), [&](size_t i){
+            data[i] = element_work(data[i] + i, cost);
+        });
+        benchmark::DoNotOptimize(data.data());
+    }
+    state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_parallel_for)->Apply(loop_args);
+
+static void BM_serial_reduce(benchmark::State& state)
+{
+    size_t count = state.range(0);
+    int cost = state.range(1);
+
+    for(auto _: state)
+    {
+        uint64_t sum = 0;
+        for(size_t i = 0; i < count; ++i)
+        {
+            sum += element_work(i, cost);
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_serial_reduce)->Apply(loop_args);
+
+static void BM_parallel_reduce(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    size_t count = state.range(0);
+    int cost = state.range(1);
+
+    for(auto _: state)
+    {
+        uint64_t sum = pool.parallel_reduce(
+            size_t(0),
+            count,
+            uint64_t(0),
+            [cost](size_t i){ return element_work(i, cost); },
+            [](uint64_t a, uint64_t b){ return a + b; }
+        );
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_parallel_reduce)->Apply(loop_args);
+
+static void sort_args(benchmark::internal::Benchmark* b)
+{
+    b->RangeMultiplier(8)->Range(1 << 10, 1 << 22);
+    b->UseRealTime();
+}
+
+static std::vector<uint64_t> sort_input(size_t count)
+{
+    std::vector<uint64_t> data(count);
+    for(size_t i = 0; i < count; ++i) data[i] = element_work(i, 1);
+    return data;
+}
+
+static void BM_serial_sort(benchmark::State& state)
+{
+    std::vector<uint64_t> input = sort_input(state.range(0));
+    std::vector<uint64_t> data;
+
+    for(auto _: state)
+    {
+        state.PauseTiming();
+        data = input;
+        state.ResumeTiming();
+        std::sort(data.begin(), data.end());
+    }
+    state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_serial_sort)->Apply(sort_args);
+
+static void BM_parallel_sort(benchmark::State& state)
+{
+    thread_pool pool(std::max(std::thread::hardware_concurrency(), 2u));
+    std::vector<uint64_t> input = sort_input(state.range(0));
+    std::vector<uint64_t> data;
+
+    for(auto _: state)
+    {
+        state.PauseTiming();
+        data = input;
+        state.ResumeTiming();
+        pool.parallel_sort(data.begin(), data.end());
+    }
+    state.SetItemsProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_parallel_sort)->Apply(sort_args);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""Compares Google Benchmark JSON results against a stored baseline.
+
+Medians are compared when the results have aggregates, single runs otherwise.
+Exits with 1 if any benchmark got slower than the threshold allows.
+"""
+import argparse
+import json
+import sys
+
+TIME_UNITS = {'ns': 1e-9, 'us': 1e-6, 'ms': 1e-3, 's': 1.0}
+
+
+def load_times(path):
+    with open(path) as f:
+        benchmarks = json.load(f)['benchmarks']
+
+    has_aggregates = any(b.get('run_type') == 'aggregate' for b in benchmarks)
+    times = {}
+    for b in benchmarks:
+        if has_aggregates:
+            if b.get('aggregate_name') != 'median':
+                continue
+            name = b['run_name']
+        else:
+            name = b['name']
+        times[name] = b['real_time'] * TIME_UNITS[b.get('time_unit', 'ns')]
+    return times
+
+
+def format_time(seconds):
+    for unit in ('s', 'ms', 'us', 'ns'):
+        if seconds >= TIME_UNITS[unit] or unit == 'ns':
+            return '{:.3g} {}'.format(seconds / TIME_UNITS[unit], unit)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('baseline', help='JSON results to compare against')
+    parser.add_argument('current', help='JSON results of this run')
+    parser.add_argument(
+        '--threshold', type=float, default=0.1,
+        help='allowed slowdown as a fraction, 0.1 by default'
+    )
+    args = parser.parse_args()
+
+    baseline = load_times(args.baseline)
+    current = load_times(args.current)
+
+    regressions = 0
+    width = max((len(name) for name in current), default=0)
+    for name, time in current.items():
+        if name not in baseline:
+            print('{:<{}}  {:>10}  new'.format(name, width, format_time(time)))
+            continue
+
+        change = time / baseline[name] - 1
+        flag = ''
+        if change > args.threshold:
+            flag = '  REGRESSION'
+            regressions += 1
+        print('{:<{}}  {:>10}  {:+7.1%}{}'.format(
+            name, width, format_time(time), change, flag
+        ))
+
+    for name in baseline:
+        if name not in current:
+            print('{:<{}}  {:>10}  missing'.format(name, width, ''))
+
+    if regressions:
+        print('{} benchmark(s) slower than the baseline by more than {:.0%}'
+              .format(regressions, args.threshold))
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,29 @@
+#!/bin/sh
+
+# Runs the given benchmark executables with a few repetitions each, and writes
+# their results as JSON to bench/results in the build directory. Results with
+# a matching file in bench/baseline of the source directory are compared
+# against it, and the script fails if anything got slower. Extra arguments
+# for the benchmarks can be given in BENCH_ARGS, like
+# BENCH_ARGS=--benchmark_filter=BM_post ninja -C build bench
+
+out="${MESON_BUILD_ROOT}/bench/results"
+baseline="${MESON_SOURCE_ROOT}/bench/baseline"
+mkdir -p "$out" || exit 1
+
+status=0
+for exe in "$@"; do
+    name=$(basename "$exe")
+    "$exe" \
+        --benchmark_repetitions=5 \
+        --benchmark_report_aggregates_only=true \
+        --benchmark_out="$out/$name.json" \
+        --benchmark_out_format=json \
+        ${BENCH_ARGS} || exit 1
+
+    if [ -f "$baseline/$name.json" ]; then
+        python3 "${MESON_SOURCE_ROOT}/scripts/bench_compare.py" \
+            "$baseline/$name.json" "$out/$name.json" || status=1
+    fi
+done
+exit $status
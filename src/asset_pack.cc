@@ -0,0 +1,589 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "asset_pack.hh"
+#include "lz4.hh"
+#include "thread_pool.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#ifdef __unix__
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+constexpr uint32_t asset_pack::VERSION;
+constexpr size_t asset_pack::ALIGNMENT;
+constexpr size_t asset_pack::HEADER_SIZE;
+constexpr size_t asset_pack::ENTRY_SIZE;
+constexpr size_t asset_pack::CHUNK_ENTRY_SIZE;
+constexpr uint32_t asset_pack::CHUNK_LZ4;
+constexpr size_t asset_pack_writer::DEFAULT_CHUNK_SIZE;
+
+static const char PACK_MAGIC[8] = {'P', 'O', 'N', 'G', 'P', 'A', 'C', 'K'};
+
+static uint64_t read_le(const uint8_t* p, unsigned bytes)
+{
+    uint64_t value = 0;
+    for(unsigned i = 0; i < bytes; ++i) value |= (uint64_t)p[i] << (8 * i);
+    return value;
+}
+
+static void write_le(std::vector<uint8_t>& out, uint64_t value, unsigned bytes)
+{
+    for(unsigned i = 0; i < bytes; ++i) out.push_back(value >> (8 * i));
+}
+
+static size_t align_up(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+static int compare_name(
+    const char* a,
+    size_t a_size,
+    const char* b,
+    size_t b_size
+){
+    int c = memcmp(a, b, std::min(a_size, b_size));
+    if(c != 0 || a_size == b_size) return c;
+    return a_size < b_size ? -1 : 1;
+}
+
+asset_pack::asset_pack(const std::string& path)
+: data(nullptr), length(0), count(0), chunk_size(0), entries(nullptr),
+  names(nullptr)
+{
+#ifdef __unix__
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0)
+    {
+        if(fd >= 0) close(fd);
+        throw std::runtime_error(
+            "asset_pack: Unable to open \"" + path + "\""
+        );
+    }
+    length = st.st_size;
+    if(length != 0)
+    {
+        void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mapping == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error(
+                "asset_pack: Unable to map \"" + path + "\""
+            );
+        }
+        data = static_cast<const uint8_t*>(mapping);
+    }
+    // The mapping keeps the file alive.
+    close(fd);
+#else
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file)
+    {
+        throw std::runtime_error(
+            "asset_pack: Unable to open \"" + path + "\""
+        );
+    }
+    length = file.tellg();
+    file.seekg(0, std::ios::beg);
+    // new[] doesn't align this much, so the data is placed by hand.
+    buffer.reset(new uint8_t[length + ALIGNMENT]);
+    uint8_t* start = buffer.get() + (
+        ALIGNMENT - reinterpret_cast<uintptr_t>(buffer.get()) % ALIGNMENT
+    ) % ALIGNMENT;
+    if(!file.read(reinterpret_cast<char*>(start), length))
+    {
+        throw std::runtime_error(
+            "asset_pack: Unable to read \"" + path + "\""
+        );
+    }
+    data = start;
+#endif
+
+    try
+    {
+        validate(path);
+    }
+    catch(...)
+    {
+#ifdef __unix__
+        if(data) munmap(const_cast<uint8_t*>(data), length);
+#endif
+        throw;
+    }
+}
+
+asset_pack::~asset_pack()
+{
+#ifdef __unix__
+    if(data) munmap(const_cast<uint8_t*>(data), length);
+#endif
+}
+
+bool asset_pack::find(const std::string& name, asset_view& view) const
+{
+    size_t index;
+    if(!find_index(name, index)) return false;
+
+    const uint8_t* entry = entry_at(index);
+    if(read_le(entry + 24, 4) != 0)
+    {
+        throw std::runtime_error(
+            "asset_pack: \"" + name + "\" is compressed, it has to be read"
+        );
+    }
+    view.data = data + read_le(entry, 8);
+    view.size = read_le(entry + 8, 8);
+    return true;
+}
+
+asset_view asset_pack::get(const std::string& name) const
+{
+    asset_view view;
+    if(!find(name, view))
+    {
+        throw std::out_of_range(
+            "asset_pack: No asset named \"" + name + "\""
+        );
+    }
+    return view;
+}
+
+bool asset_pack::contains(const std::string& name) const
+{
+    size_t index;
+    return find_index(name, index);
+}
+
+bool asset_pack::is_compressed(const std::string& name) const
+{
+    return read_le(entry_at(index_of(name)) + 24, 4) != 0;
+}
+
+size_t asset_pack::size_of(const std::string& name) const
+{
+    return read_le(entry_at(index_of(name)) + 8, 8);
+}
+
+void asset_pack::read(
+    const std::string& name,
+    uint8_t* dest,
+    thread_pool* pool
+) const
+{
+    const uint8_t* entry = entry_at(index_of(name));
+    size_t chunks = read_le(entry + 24, 4);
+    if(chunks == 0)
+    {
+        size_t size = read_le(entry + 8, 8);
+        if(size != 0) memcpy(dest, data + read_le(entry, 8), size);
+        return;
+    }
+
+    auto decode = [&](size_t chunk){
+        read_chunk(entry, chunk, dest + chunk * chunk_size);
+    };
+    if(pool && chunks > 1) pool->parallel_for(size_t(0), chunks, decode, 1);
+    else for(size_t i = 0; i < chunks; ++i) decode(i);
+}
+
+void asset_pack::extent_of(
+    const std::string& name,
+    size_t& offset,
+    size_t& size
+) const
+{
+    const uint8_t* entry = entry_at(index_of(name));
+    size_t chunks = read_le(entry + 24, 4);
+    offset = read_le(entry, 8);
+    if(chunks == 0)
+    {
+        size = read_le(entry + 8, 8);
+        return;
+    }
+
+    size_t end = offset + chunks * CHUNK_ENTRY_SIZE;
+    for(size_t i = 0; i < chunks; ++i)
+    {
+        const uint8_t* table = data + offset + i * CHUNK_ENTRY_SIZE;
+        end = std::max<size_t>(end, read_le(table, 8) + read_le(table + 8, 4));
+    }
+    size = end - offset;
+}
+
+void asset_pack::prefetch(size_t offset, size_t size) const
+{
+#ifdef __unix__
+    if(!data || offset >= length) return;
+    size = std::min(size, length - offset);
+    // madvise() only takes whole pages.
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = reinterpret_cast<uintptr_t>(data + offset);
+    uintptr_t start = begin / page * page;
+    // Only a hint, so failing is fine.
+    madvise(
+        reinterpret_cast<void*>(start),
+        begin + size - start,
+        MADV_WILLNEED
+    );
+#else
+    (void)offset;
+    (void)size;
+#endif
+}
+
+size_t asset_pack::size() const
+{
+    return count;
+}
+
+std::string asset_pack::name(size_t index) const
+{
+    const uint8_t* entry = entry_at(index);
+    return std::string(
+        reinterpret_cast<const char*>(names + read_le(entry + 16, 4)),
+        read_le(entry + 20, 4)
+    );
+}
+
+void asset_pack::validate(const std::string& path)
+{
+    auto fail = [&](const char* reason){
+        throw std::runtime_error(
+            "asset_pack: \"" + path + "\" " + reason
+        );
+    };
+    // Whether [offset, offset + size) lies within [0, limit).
+    auto in_bounds = [](uint64_t offset, uint64_t size, uint64_t limit){
+        return offset <= limit && size <= limit - offset;
+    };
+
+    if(length < HEADER_SIZE || memcmp(data, PACK_MAGIC, 8) != 0)
+    {
+        fail("is not an asset pack");
+    }
+    if(read_le(data + 8, 4) != VERSION) fail("has an unsupported version");
+    chunk_size = read_le(data + 16, 4);
+    if(chunk_size == 0) fail("has no chunk size");
+
+    count = read_le(data + 12, 4);
+    if(count > (length - HEADER_SIZE) / ENTRY_SIZE) fail("is truncated");
+    entries = data + HEADER_SIZE;
+    names = entries + count * ENTRY_SIZE;
+    size_t names_size = length - (names - data);
+
+    // Checked once here, so that lookups and reads don't have to.
+    for(size_t i = 0; i < count; ++i)
+    {
+        const uint8_t* entry = entry_at(i);
+        uint64_t offset = read_le(entry, 8);
+        uint64_t size = read_le(entry + 8, 8);
+        uint64_t name_offset = read_le(entry + 16, 4);
+        uint64_t name_size = read_le(entry + 20, 4);
+        uint64_t chunks = read_le(entry + 24, 4);
+        if(!in_bounds(name_offset, name_size, names_size)) fail("is truncated");
+
+        if(chunks == 0)
+        {
+            if(!in_bounds(offset, size, length)) fail("is truncated");
+        }
+        else
+        {
+            if(chunks != (size + chunk_size - 1) / chunk_size)
+            {
+                fail("has a wrong number of chunks");
+            }
+            if(!in_bounds(offset, chunks * CHUNK_ENTRY_SIZE, length))
+            {
+                fail("is truncated");
+            }
+            for(size_t c = 0; c < chunks; ++c)
+            {
+                const uint8_t* chunk = data + offset + c * CHUNK_ENTRY_SIZE;
+                uint64_t stored = read_le(chunk + 8, 4);
+                if(!in_bounds(read_le(chunk, 8), stored, length))
+                {
+                    fail("is truncated");
+                }
+                bool compressed = read_le(chunk + 12, 4) & CHUNK_LZ4;
+                uint64_t expected = std::min<uint64_t>(
+                    chunk_size, size - c * chunk_size
+                );
+                if(!compressed && stored != expected)
+                {
+                    fail("has a chunk of the wrong size");
+                }
+            }
+        }
+
+        if(i != 0)
+        {
+            const uint8_t* previous = entry - ENTRY_SIZE;
+            if(compare_name(
+                reinterpret_cast<const char*>(
+                    names + read_le(previous + 16, 4)
+                ),
+                read_le(previous + 20, 4),
+                reinterpret_cast<const char*>(names + name_offset),
+                name_size
+            ) >= 0) fail("has an unsorted table of contents");
+        }
+    }
+}
+
+bool asset_pack::find_index(const std::string& name, size_t& index) const
+{
+    size_t low = 0, high = count;
+    while(low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        const uint8_t* entry = entry_at(middle);
+        int c = compare_name(
+            name.data(),
+            name.size(),
+            reinterpret_cast<const char*>(names + read_le(entry + 16, 4)),
+            read_le(entry + 20, 4)
+        );
+        if(c == 0)
+        {
+            index = middle;
+            return true;
+        }
+        if(c < 0) high = middle;
+        else low = middle + 1;
+    }
+    return false;
+}
+
+size_t asset_pack::index_of(const std::string& name) const
+{
+    size_t index;
+    if(!find_index(name, index))
+    {
+        throw std::out_of_range(
+            "asset_pack: No asset named \"" + name + "\""
+        );
+    }
+    return index;
+}
+
+const uint8_t* asset_pack::entry_at(size_t index) const
+{
+    return entries + index * ENTRY_SIZE;
+}
+
+void asset_pack::read_chunk(
+    const uint8_t* entry,
+    size_t chunk,
+    uint8_t* dest
+) const
+{
+    const uint8_t* table = data + read_le(entry, 8) + chunk * CHUNK_ENTRY_SIZE;
+    const uint8_t* stored = data + read_le(table, 8);
+    size_t stored_size = read_le(table + 8, 4);
+    size_t size = std::min<size_t>(
+        chunk_size,
+        read_le(entry + 8, 8) - chunk * chunk_size
+    );
+
+    if(!(read_le(table + 12, 4) & CHUNK_LZ4)) memcpy(dest, stored, size);
+    else if(!lz4_decompress(stored, stored_size, dest, size))
+    {
+        throw std::runtime_error("asset_pack: Corrupt chunk");
+    }
+}
+
+asset_pack_writer::asset_pack_writer(size_t chunk_size)
+: chunk_size(chunk_size)
+{
+    if(chunk_size == 0 || chunk_size > UINT32_MAX)
+    {
+        throw std::invalid_argument("asset_pack_writer: Bad chunk size");
+    }
+}
+
+void asset_pack_writer::add(
+    const std::string& name,
+    std::vector<uint8_t> data,
+    bool compress
+){
+    asset a;
+    a.size = data.size();
+    if(compress)
+    {
+        bool any_compressed = false;
+        std::vector<uint8_t> buffer(lz4_compress_bound(chunk_size));
+        for(size_t offset = 0; offset < data.size(); offset += chunk_size)
+        {
+            size_t size = std::min(chunk_size, data.size() - offset);
+            // Only worth decompressing if it saves an eighth.
+            size_t compressed_size = lz4_compress(
+                data.data() + offset, size, buffer.data(), size - size / 8
+            );
+
+            chunk c;
+            c.compressed = compressed_size != 0;
+            if(c.compressed)
+            {
+                c.data.assign(buffer.begin(), buffer.begin() + compressed_size);
+                any_compressed = true;
+            }
+            else
+            {
+                c.data.assign(
+                    data.begin() + offset,
+                    data.begin() + offset + size
+                );
+            }
+            a.chunks.push_back(std::move(c));
+        }
+        if(!any_compressed) a.chunks.clear();
+    }
+    if(a.chunks.empty()) a.data = std::move(data);
+    assets[name] = std::move(a);
+}
+
+void asset_pack_writer::add_file(
+    const std::string& name,
+    const std::string& path,
+    bool compress
+){
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file)
+    {
+        throw std::runtime_error(
+            "asset_pack_writer: Unable to open \"" + path + "\""
+        );
+    }
+    std::vector<uint8_t> data((size_t)file.tellg());
+    file.seekg(0, std::ios::beg);
+    if(!file.read(reinterpret_cast<char*>(data.data()), data.size()))
+    {
+        throw std::runtime_error(
+            "asset_pack_writer: Unable to read \"" + path + "\""
+        );
+    }
+    add(name, std::move(data), compress);
+}
+
+void asset_pack_writer::write(const std::string& path) const
+{
+    // std::map keeps the names in the same order as compare_name().
+    std::vector<uint8_t> head(PACK_MAGIC, PACK_MAGIC + 8);
+    write_le(head, asset_pack::VERSION, 4);
+    write_le(head, assets.size(), 4);
+    write_le(head, chunk_size, 4);
+    write_le(head, 0, 4);
+
+    size_t names_size = 0;
+    for(auto& pair: assets) names_size += pair.first.size();
+    size_t offset = align_up(
+        head.size() + assets.size() * asset_pack::ENTRY_SIZE + names_size,
+        asset_pack::ALIGNMENT
+    );
+
+    // Each asset's bytes, as they go in the data section.
+    std::vector<std::vector<uint8_t>> blocks;
+    size_t name_offset = 0;
+    for(auto& pair: assets)
+    {
+        const asset& a = pair.second;
+        if(pair.first.size() > UINT32_MAX || name_offset > UINT32_MAX)
+        {
+            throw std::runtime_error(
+                "asset_pack_writer: Names too long for \"" + path + "\""
+            );
+        }
+        write_le(head, offset, 8);
+        write_le(head, a.size, 8);
+        write_le(head, name_offset, 4);
+        write_le(head, pair.first.size(), 4);
+        write_le(head, a.chunks.size(), 4);
+        write_le(head, 0, 4);
+        name_offset += pair.first.size();
+
+        if(a.chunks.empty())
+        {
+            offset = align_up(offset + a.data.size(), asset_pack::ALIGNMENT);
+            continue;
+        }
+
+        // The chunk table, followed by the chunks.
+        std::vector<uint8_t> block;
+        size_t chunk_offset =
+            offset + a.chunks.size() * asset_pack::CHUNK_ENTRY_SIZE;
+        for(const chunk& c: a.chunks)
+        {
+            write_le(block, chunk_offset, 8);
+            write_le(block, c.data.size(), 4);
+            write_le(block, c.compressed ? asset_pack::CHUNK_LZ4 : 0, 4);
+            chunk_offset += c.data.size();
+        }
+        for(const chunk& c: a.chunks)
+        {
+            block.insert(block.end(), c.data.begin(), c.data.end());
+        }
+        offset = align_up(offset + block.size(), asset_pack::ALIGNMENT);
+        blocks.push_back(std::move(block));
+    }
+    for(auto& pair: assets)
+    {
+        head.insert(head.end(), pair.first.begin(), pair.first.end());
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    static const char padding[asset_pack::ALIGNMENT] = {};
+    auto write_padded = [&](const void* bytes, size_t size){
+        file.write(static_cast<const char*>(bytes), size);
+        file.write(
+            padding,
+            align_up(size, asset_pack::ALIGNMENT) - size
+        );
+    };
+    write_padded(head.data(), head.size());
+    auto block = blocks.begin();
+    for(auto& pair: assets)
+    {
+        if(pair.second.chunks.empty())
+        {
+            write_padded(pair.second.data.data(), pair.second.data.size());
+        }
+        else
+        {
+            write_padded(block->data(), block->size());
+            ++block;
+        }
+    }
+    if(!file.flush())
+    {
+        throw std::runtime_error(
+            "asset_pack_writer: Unable to write \"" + path + "\""
+        );
+    }
+}
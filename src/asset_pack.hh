@@ -0,0 +1,178 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_ASSET_PACK_HH
+#define PONG_ASSET_PACK_HH
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+class thread_pool;
+
+// The bytes of one asset in a pack. They stay valid as long as the pack is
+// open.
+struct asset_view
+{
+    const uint8_t* data;
+    size_t size;
+};
+
+// A read-only archive of named assets, made by asset_pack_writer or the
+// asset_packer tool. The file is mapped into memory once, and uncompressed
+// assets are handed out as views into it without copying. Compressed assets
+// are split into chunks of chunk_size bytes that decompress independently,
+// so read() can decode them in parallel.
+//
+// Layout, with integers in little-endian:
+//   header:   "PONGPACK", uint32 version, uint32 entry count, uint32 chunk
+//             size, uint32 reserved
+//   entries:  uint64 offset, uint64 size, uint32 name offset, uint32 name
+//             size, uint32 chunk count, uint32 reserved; sorted by name
+//   names:    the entry names back to back, without terminators
+//   data:     each asset starting at a multiple of ALIGNMENT
+//
+// An asset with no chunks is stored as is. Otherwise its offset points to
+// its chunk table, with a uint64 offset, uint32 stored size and uint32
+// flags for each chunk. Chunks with the CHUNK_LZ4 flag are LZ4 blocks, the
+// rest are stored as is.
+class asset_pack
+{
+friend class asset_pack_writer;
+public:
+    static constexpr uint32_t VERSION = 2;
+    static constexpr size_t ALIGNMENT = 64;
+
+    // Throws std::runtime_error if the file can't be read or isn't a valid
+    // pack.
+    explicit asset_pack(const std::string& path);
+    asset_pack(const asset_pack& other) = delete;
+    ~asset_pack();
+
+    // Returns false if there's no asset with that name. Compressed assets
+    // have no view, these throw std::runtime_error for them.
+    bool find(const std::string& name, asset_view& view) const;
+    // Throws std::out_of_range if there's no asset with that name.
+    asset_view get(const std::string& name) const;
+
+    // These throw std::out_of_range if there's no asset with that name.
+    bool contains(const std::string& name) const;
+    bool is_compressed(const std::string& name) const;
+    // The size of the asset once decompressed.
+    size_t size_of(const std::string& name) const;
+    // Copies the asset to dest, which needs room for size_of(name) bytes.
+    // With a pool, chunks are decompressed in parallel. Throws
+    // std::runtime_error if a chunk is corrupt.
+    void read(
+        const std::string& name,
+        uint8_t* dest,
+        thread_pool* pool = nullptr
+    ) const;
+
+    // Where the asset is stored in the file, with its chunks if it's
+    // compressed. Throws std::out_of_range if there's no asset with that
+    // name.
+    void extent_of(
+        const std::string& name,
+        size_t& offset,
+        size_t& size
+    ) const;
+    // Asks the OS to start reading that part of the file in the background,
+    // so that loads from it later don't fault it in a page at a time. Does
+    // nothing where the file isn't mapped.
+    void prefetch(size_t offset, size_t size) const;
+
+    size_t size() const;
+    std::string name(size_t index) const;
+
+private:
+    static constexpr size_t HEADER_SIZE = 24;
+    static constexpr size_t ENTRY_SIZE = 32;
+    static constexpr size_t CHUNK_ENTRY_SIZE = 16;
+    static constexpr uint32_t CHUNK_LZ4 = 1;
+
+    void validate(const std::string& path);
+    bool find_index(const std::string& name, size_t& index) const;
+    size_t index_of(const std::string& name) const;
+    const uint8_t* entry_at(size_t index) const;
+    void read_chunk(const uint8_t* entry, size_t chunk, uint8_t* dest) const;
+
+    const uint8_t* data;
+    size_t length;
+    // Only used where the file can't be mapped.
+    std::unique_ptr<uint8_t[]> buffer;
+
+    uint32_t count;
+    size_t chunk_size;
+    const uint8_t* entries;
+    const uint8_t* names;
+};
+
+// Builds asset packs. Assets are kept in memory until write().
+class asset_pack_writer
+{
+public:
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+    explicit asset_pack_writer(size_t chunk_size = DEFAULT_CHUNK_SIZE);
+
+    // Replaces any asset with the same name. Compressed assets keep only
+    // the chunks that shrink by at least an eighth, and are stored as is if
+    // none do.
+    void add(
+        const std::string& name,
+        std::vector<uint8_t> data,
+        bool compress = false
+    );
+    // Throws std::runtime_error if the file can't be read.
+    void add_file(
+        const std::string& name,
+        const std::string& path,
+        bool compress = false
+    );
+
+    // Throws std::runtime_error if the pack can't be written.
+    void write(const std::string& path) const;
+
+private:
+    struct chunk
+    {
+        std::vector<uint8_t> data;
+        bool compressed;
+    };
+
+    struct asset
+    {
+        size_t size;
+        // Only kept if the asset is stored as is, otherwise it's in chunks.
+        std::vector<uint8_t> data;
+        std::vector<chunk> chunks;
+    };
+
+    size_t chunk_size;
+    std::map<std::string, asset> assets;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "asset_pack.hh"
+
+// Packs files into an asset pack at build time. Assets are named after the
+// file name, unless given as name=path. Files after -c are compressed.
+static void usage(const char* program)
+{
+    std::cerr<<"Usage: "<<program<<" -o <output> [-c] [name=]<file>..."
+        <<std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    std::string output;
+    std::vector<std::pair<std::string, bool>> inputs;
+    bool compress = false;
+    for(int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if(arg == "-o" && i + 1 < argc) output = argv[++i];
+        else if(arg == "-c") compress = true;
+        else if(arg.size() > 0 && arg[0] != '-')
+        {
+            inputs.emplace_back(arg, compress);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(output.empty())
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try
+    {
+        asset_pack_writer writer;
+        for(auto& pair: inputs)
+        {
+            const std::string& input = pair.first;
+            size_t equals = input.find('=');
+            if(equals != std::string::npos)
+            {
+                writer.add_file(
+                    input.substr(0, equals),
+                    input.substr(equals + 1),
+                    pair.second
+                );
+            }
+            else
+            {
+                size_t slash = input.find_last_of('/');
+                writer.add_file(
+                    slash == std::string::npos ?
+                        input : input.substr(slash + 1),
+                    input,
+                    pair.second
+                );
+            }
+        }
+        writer.write(output);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr<<e.what()<<std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,500 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "async_io.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#ifdef __unix__
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+constexpr size_t async_io::WHOLE_FILE;
+constexpr size_t async_io::LARGE_READ;
+
+async_io::read_request::read_request(
+    const std::string& path,
+    uint64_t offset,
+    size_t size
+): path(path), offset(offset), size(size) {}
+
+async_io::pending_read::pending_read(const read_request& request)
+: path(request.path), fd(-1), opened(false), offset(request.offset),
+  size(request.size), done(0) {}
+
+#ifdef __linux__
+// The rings shared with the kernel, see io_uring_setup(2).
+struct async_io::uring
+{
+    uring();
+    ~uring();
+
+    int fd;
+    void* sq_ptr;
+    void* cq_ptr;
+    size_t sq_size, cq_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+};
+
+async_io::uring::uring()
+: fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sq_size(0), cq_size(0),
+  sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size(0)
+{
+}
+
+async_io::uring::~uring()
+{
+    if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if(fd >= 0) close(fd);
+}
+#else
+struct async_io::uring {};
+#endif
+
+async_io::async_io(
+    thread_pool& pool,
+    bool use_io_uring,
+    unsigned io_threads,
+    unsigned queue_depth
+): pool(pool), used_backend(BACKEND_THREADS), stopping(false), in_flight(0),
+  queue_depth_limit(0)
+{
+    if(use_io_uring && setup_uring(std::max(queue_depth, 1u)))
+    {
+        used_backend = BACKEND_IO_URING;
+        completion_thread = std::thread([this](){ uring_loop(); });
+        return;
+    }
+
+    for(unsigned i = 0; i < std::max(io_threads, 1u); ++i)
+    {
+        this->io_threads.emplace_back([this](){ io_thread_loop(); });
+    }
+}
+
+async_io::~async_io()
+{
+    stopping = true;
+    if(used_backend == BACKEND_IO_URING)
+    {
+#ifdef __linux__
+        // A no-op wakes the completion thread up, so that it notices.
+        {
+            std::lock_guard<std::mutex> lock(submit_mutex);
+            unsigned tail = *ring->sq_tail;
+            unsigned index = tail & ring->sq_mask;
+            io_uring_sqe* sqe = &ring->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = 0;
+            ring->sq_array[index] = index;
+            __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            uring_enter(1, 0);
+        }
+#endif
+        completion_thread.join();
+    }
+    else
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue_cv.notify_all();
+        }
+        for(std::thread& t: io_threads) t.join();
+    }
+}
+
+async_io::backend async_io::get_backend() const
+{
+    return used_backend;
+}
+
+async_io::read_result async_io::read(
+    const read_request& request,
+    unsigned priority
+){
+    return std::move(read(std::vector<read_request>{request}, priority)[0]);
+}
+
+std::vector<async_io::read_result> async_io::read(
+    const std::vector<read_request>& requests,
+    unsigned priority
+){
+    std::vector<read_result> results;
+    std::vector<pending_read*> reads;
+    results.reserve(requests.size());
+    reads.reserve(requests.size());
+    for(const read_request& request: requests)
+    {
+        pending_read* r = new pending_read(request);
+        r->promise = pool.make_promise<buffer>(priority);
+        results.push_back(r->promise.get_result());
+        reads.push_back(r);
+    }
+
+    if(used_backend == BACKEND_IO_URING) uring_submit(reads);
+    else
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        queue.insert(queue.end(), reads.begin(), reads.end());
+        queue_cv.notify_all();
+    }
+    return results;
+}
+
+bool async_io::open_read(pending_read& r)
+{
+#ifdef __unix__
+    r.fd = open(r.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(r.fd < 0)
+    {
+        fail(&r, strerror(errno));
+        return false;
+    }
+    return size_read(r);
+#else
+    (void)r;
+    return true;
+#endif
+}
+
+bool async_io::size_read(pending_read& r)
+{
+#ifdef __unix__
+    struct stat st;
+    if(fstat(r.fd, &st) != 0)
+    {
+        fail(&r, strerror(errno));
+        return false;
+    }
+
+    uint64_t available = (uint64_t)st.st_size > r.offset ?
+        st.st_size - r.offset : 0;
+    r.size = std::min<uint64_t>(r.size, available);
+    if(r.size == 0)
+    {
+        finish(&r);
+        return false;
+    }
+    r.data.resize(r.size);
+    return true;
+#else
+    (void)r;
+    return true;
+#endif
+}
+
+void async_io::read_blocking(pending_read& r)
+{
+#ifdef __unix__
+    if(!open_read(r)) return;
+    while(r.done < r.size)
+    {
+        ssize_t res = pread(
+            r.fd,
+            r.data.data() + r.done,
+            r.size - r.done,
+            r.offset + r.done
+        );
+        if(res < 0 && errno == EINTR) continue;
+        if(res < 0) return fail(&r, strerror(errno));
+        // The file shrank since it was opened.
+        if(res == 0) break;
+        r.done += res;
+    }
+    finish(&r);
+#else
+    std::ifstream file(r.path, std::ios::binary | std::ios::ate);
+    if(!file) return fail(&r, "Unable to open");
+    uint64_t length = file.tellg();
+    uint64_t available = length > r.offset ? length - r.offset : 0;
+    r.size = std::min<uint64_t>(r.size, available);
+    r.data.resize(r.size);
+    file.seekg(r.offset, std::ios::beg);
+    file.read(reinterpret_cast<char*>(r.data.data()), r.size);
+    r.done = file.gcount();
+    finish(&r);
+#endif
+}
+
+void async_io::finish(pending_read* r)
+{
+#ifdef __unix__
+    if(r->fd >= 0) close(r->fd);
+#endif
+    r->data.resize(r->done);
+    r->promise.set_value(std::move(r->data));
+    delete r;
+}
+
+void async_io::fail(pending_read* r, const std::string& reason)
+{
+#ifdef __unix__
+    if(r->fd >= 0) close(r->fd);
+#endif
+    r->promise.set_exception(std::make_exception_ptr(std::runtime_error(
+        "async_io: Unable to read \"" + r->path + "\": " + reason
+    )));
+    delete r;
+}
+
+void async_io::io_thread_loop()
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    for(;;)
+    {
+        queue_cv.wait(lock, [&](){ return stopping || !queue.empty(); });
+        if(queue.empty()) return;
+
+        pending_read* r = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        read_blocking(*r);
+        lock.lock();
+    }
+}
+
+#ifdef __linux__
+bool async_io::setup_uring(unsigned queue_depth)
+{
+    std::unique_ptr<uring> u(new uring());
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    u->fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+    // Plain reads need Linux 5.6, which brought this feature too.
+    if(u->fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) return false;
+
+    u->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap) u->sq_size = u->cq_size = std::max(u->sq_size, u->cq_size);
+
+    u->sq_ptr = mmap(
+        nullptr, u->sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING
+    );
+    if(u->sq_ptr == MAP_FAILED) return false;
+    u->cq_ptr = single_mmap ? u->sq_ptr : mmap(
+        nullptr, u->cq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING
+    );
+    if(u->cq_ptr == MAP_FAILED) return false;
+    u->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    u->sqes = static_cast<io_uring_sqe*>(mmap(
+        nullptr, u->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES
+    ));
+    if(u->sqes == MAP_FAILED) return false;
+
+    char* sq = static_cast<char*>(u->sq_ptr);
+    char* cq = static_cast<char*>(u->cq_ptr);
+    u->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    u->sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    u->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    u->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    u->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    u->cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    u->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    // The completion queue is at least as big, so it can't overflow.
+    queue_depth_limit = params.sq_entries;
+    ring = std::move(u);
+    return true;
+}
+
+void async_io::uring_submit(const std::vector<pending_read*>& reads)
+{
+    std::lock_guard<std::mutex> lock(submit_mutex);
+    waiting.insert(waiting.end(), reads.begin(), reads.end());
+    uring_fill();
+}
+
+void async_io::uring_fill()
+{
+    // The rest go in as the completion thread makes room.
+    unsigned queued = 0;
+    while(!waiting.empty() && in_flight < queue_depth_limit)
+    {
+        uring_push(waiting.front());
+        waiting.pop_front();
+        in_flight++;
+        queued++;
+    }
+    uring_enter(queued, 0);
+}
+
+void async_io::uring_push(pending_read* r)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = reinterpret_cast<uint64_t>(r);
+    ring->sq_array[index] = index;
+    if(!r->opened)
+    {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(r->path.c_str());
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        // Opening a cached file would otherwise happen right in
+        // io_uring_enter(), on the thread calling read().
+        sqe->flags |= IOSQE_ASYNC;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->off = r->offset + r->done;
+    sqe->addr = reinterpret_cast<uint64_t>(r->data.data() + r->done);
+    // Anything longer is finished by the resubmissions of short reads.
+    sqe->len = std::min<size_t>(r->size - r->done, 1u << 30);
+    // Cached data would otherwise be copied right in io_uring_enter(), on
+    // the submitting thread. Worth avoiding for large reads.
+    if(sqe->len > LARGE_READ) sqe->flags |= IOSQE_ASYNC;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void async_io::uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    while(to_submit != 0 || min_complete != 0)
+    {
+        int res = syscall(
+            __NR_io_uring_enter, ring->fd, to_submit, min_complete, flags,
+            nullptr, 0
+        );
+        if(res < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            throw std::runtime_error(
+                std::string("async_io: io_uring_enter failed: ") +
+                strerror(errno)
+            );
+        }
+        to_submit -= std::min<unsigned>(res, to_submit);
+        min_complete = 0;
+    }
+}
+
+void async_io::uring_complete(pending_read* r, int res)
+{
+    bool retry = res == -EINTR || res == -EAGAIN;
+    bool more = false;
+    if(!r->opened && !retry)
+    {
+        if(res < 0) fail(r, strerror(-res));
+        else
+        {
+            r->fd = res;
+            r->opened = true;
+            // The open brought the inode in, so this doesn't wait for the
+            // disk.
+            more = size_read(*r);
+        }
+    }
+    else if(!retry)
+    {
+        if(res > 0) r->done += res;
+        more = res > 0 && r->done < r->size;
+        // Zero means the file shrank since it was opened.
+        if(res < 0) fail(r, strerror(-res));
+        else if(!more) finish(r);
+    }
+
+    std::lock_guard<std::mutex> lock(submit_mutex);
+    if(retry || more)
+    {
+        uring_push(r);
+        uring_enter(1, 0);
+        return;
+    }
+    in_flight--;
+    uring_fill();
+}
+
+void async_io::uring_loop()
+{
+    for(;;)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+        {
+            {
+                std::lock_guard<std::mutex> lock(submit_mutex);
+                if(stopping && in_flight == 0 && waiting.empty()) return;
+            }
+            uring_enter(0, 1);
+            continue;
+        }
+        // The kernel already orders the submissions before their
+        // completions, but sanitizers can't see that. Locking once per
+        // batch spells it out for them.
+        {
+            std::lock_guard<std::mutex> lock(submit_mutex);
+        }
+
+        for(; head != tail; ++head)
+        {
+            io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+            // Released before handling, since handling may submit more.
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            if(cqe.user_data == 0) continue;
+            uring_complete(
+                reinterpret_cast<pending_read*>(cqe.user_data),
+                cqe.res
+            );
+        }
+    }
+}
+#else
+bool async_io::setup_uring(unsigned) { return false; }
+void async_io::uring_submit(const std::vector<pending_read*>&) {}
+void async_io::uring_fill() {}
+void async_io::uring_push(pending_read*) {}
+void async_io::uring_enter(unsigned, unsigned) {}
+void async_io::uring_complete(pending_read*, int) {}
+void async_io::uring_loop() {}
+#endif
@@ -0,0 +1,185 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_ASYNC_IO_HH
+#define PONG_ASYNC_IO_HH
+#include "thread_pool.hh"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <limits>
+#include <cstdint>
+
+// Leaves new elements uninitialized, since reads overwrite them anyway.
+// Zeroing a large buffer first costs about as much as reading into it.
+template<typename T>
+struct uninitialized_allocator: public std::allocator<T>
+{
+    template<typename U>
+    struct rebind
+    {
+        using other = uninitialized_allocator<U>;
+    };
+
+    uninitialized_allocator() = default;
+    template<typename U>
+    uninitialized_allocator(const uninitialized_allocator<U>&) {}
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args)
+    {
+        ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+
+    template<typename U>
+    void construct(U* p)
+    {
+        ::new(static_cast<void*>(p)) U;
+    }
+};
+
+// Reads files without tying pool workers up on disk latency. The results are
+// ordinary post_results, so tasks can depend on them or continue with then().
+// On Linux, files are opened and read through io_uring, with a whole batch
+// submitted in one system call. Elsewhere, or if io_uring can't be set up, a
+// few dedicated threads do blocking reads instead. Either way, read() only
+// queues the work and never waits for the disk.
+class async_io
+{
+public:
+    static constexpr size_t WHOLE_FILE = std::numeric_limits<size_t>::max();
+
+    enum backend
+    {
+        BACKEND_IO_URING,
+        BACKEND_THREADS
+    };
+
+    struct read_request
+    {
+        read_request(
+            const std::string& path,
+            uint64_t offset = 0,
+            size_t size = WHOLE_FILE
+        );
+
+        std::string path;
+        uint64_t offset;
+        // Reads stop early at the end of the file.
+        size_t size;
+    };
+
+    using buffer = std::vector<uint8_t, uninitialized_allocator<uint8_t>>;
+    using read_result = thread_pool::post_result<buffer>;
+
+    // queue_depth is how many reads io_uring gets to have in flight, the
+    // rest are queued until there's room.
+    async_io(
+        thread_pool& pool,
+        bool use_io_uring = true,
+        unsigned io_threads = 2,
+        unsigned queue_depth = 256
+    );
+    async_io(const async_io& other) = delete;
+    // Waits for the reads in flight.
+    ~async_io();
+
+    backend get_backend() const;
+
+    // Failed reads throw std::runtime_error from the result. Coroutines
+    // awaiting it resume at the given priority.
+    read_result read(
+        const read_request& request,
+        unsigned priority = PRIORITY_LOW
+    );
+    // Submitted all at once.
+    std::vector<read_result> read(
+        const std::vector<read_request>& requests,
+        unsigned priority = PRIORITY_LOW
+    );
+
+private:
+    static constexpr size_t LARGE_READ = 64 * 1024;
+
+    struct pending_read
+    {
+        pending_read(const read_request& request);
+
+        std::string path;
+        int fd;
+        // Whether io_uring has opened the file yet.
+        bool opened;
+        uint64_t offset;
+        size_t size, done;
+        buffer data;
+        thread_pool::promise<buffer> promise;
+    };
+
+    // Opens the file and sizes the buffer. Returns false if the read is
+    // already finished, successfully or not.
+    static bool open_read(pending_read& r);
+    // Like open_read(), for a file io_uring has opened.
+    static bool size_read(pending_read& r);
+    static void read_blocking(pending_read& r);
+    static void finish(pending_read* r);
+    static void fail(pending_read* r, const std::string& reason);
+
+    void io_thread_loop();
+
+    struct uring;
+    bool setup_uring(unsigned queue_depth);
+    void uring_submit(const std::vector<pending_read*>& reads);
+    // These need submit_mutex. uring_fill() moves waiting reads into the
+    // ring while there's room. uring_push() queues the next step of a read,
+    // which opens the file first.
+    void uring_fill();
+    void uring_push(pending_read* r);
+    void uring_enter(unsigned to_submit, unsigned min_complete);
+    void uring_complete(pending_read* r, int res);
+    void uring_loop();
+
+    thread_pool& pool;
+    backend used_backend;
+    std::atomic_bool stopping;
+
+    // BACKEND_THREADS
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::deque<pending_read*> queue;
+    std::vector<std::thread> io_threads;
+
+    // BACKEND_IO_URING
+    std::unique_ptr<uring> ring;
+    std::mutex submit_mutex;
+    // Reads that didn't fit in the ring yet.
+    std::deque<pending_read*> waiting;
+    unsigned in_flight, queue_depth_limit;
+    std::thread completion_thread;
+};
+
+#endif
@@ -0,0 +1,247 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "lz4.hh"
+#include <algorithm>
+#include <cstring>
+
+// Block format limits: the last match has to start at least 12 bytes before
+// the end, and the last 5 bytes are always literals.
+static const size_t MIN_MATCH = 4;
+static const size_t MF_LIMIT = 12;
+static const size_t LAST_LITERALS = 5;
+static const size_t MAX_OFFSET = 65535;
+static const unsigned HASH_BITS = 14;
+// Fast paths copy in words of this size and may write up to one word past
+// the end of a copy, so they need that much room left in both buffers.
+static const size_t WILD_COPY = 8;
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Writes the extra bytes of a length that didn't fit in its 4 bits.
+static bool write_length(uint8_t*& op, uint8_t* end, size_t length)
+{
+    for(; length >= 255; length -= 255)
+    {
+        if(op == end) return false;
+        *op++ = 255;
+    }
+    if(op == end) return false;
+    *op++ = length;
+    return true;
+}
+
+static bool write_sequence(
+    uint8_t*& op,
+    uint8_t* end,
+    const uint8_t* literals,
+    size_t literal_length,
+    size_t offset,
+    size_t match_length
+){
+    if(op == end) return false;
+    uint8_t* token = op++;
+    *token = std::min<size_t>(literal_length, 15) << 4;
+    if(literal_length >= 15 && !write_length(op, end, literal_length - 15))
+    {
+        return false;
+    }
+    if((size_t)(end - op) < literal_length) return false;
+    if(literal_length != 0) memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    // The last sequence has only literals.
+    if(match_length == 0) return true;
+
+    if(end - op < 2) return false;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    match_length -= MIN_MATCH;
+    *token |= std::min<size_t>(match_length, 15);
+    return match_length < 15 || write_length(op, end, match_length - 15);
+}
+
+size_t lz4_compress_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz4_compress(
+    const uint8_t* src,
+    size_t size,
+    uint8_t* dst,
+    size_t capacity
+){
+    uint8_t* op = dst;
+    uint8_t* end = dst + capacity;
+    size_t anchor = 0;
+
+    if(size > MF_LIMIT)
+    {
+        // Positions plus one, so that zero means empty.
+        uint32_t table[1 << HASH_BITS] = {};
+        size_t match_limit = size - LAST_LITERALS;
+        size_t pos = 0;
+        while(pos < size - MF_LIMIT)
+        {
+            uint32_t sequence = read32(src + pos);
+            uint32_t& slot = table[hash32(sequence)];
+            size_t candidate = slot;
+            slot = pos + 1;
+
+            if(
+                candidate == 0 || pos - (candidate - 1) > MAX_OFFSET ||
+                read32(src + candidate - 1) != sequence
+            ){
+                // Skips ahead faster the longer nothing matches.
+                pos += 1 + ((pos - anchor) >> 6);
+                continue;
+            }
+
+            size_t match = candidate - 1;
+            size_t length = MIN_MATCH;
+            while(
+                pos + length < match_limit &&
+                src[match + length] == src[pos + length]
+            ) length++;
+
+            if(!write_sequence(
+                op, end, src + anchor, pos - anchor, pos - match, length
+            )) return 0;
+            pos += length;
+            anchor = pos;
+        }
+    }
+
+    if(!write_sequence(op, end, src + anchor, size - anchor, 0, 0)) return 0;
+    return op - dst;
+}
+
+// Copies [src, src + length) in whole words. Later words may read what
+// earlier ones wrote, so this is also right for overlapping matches as long
+// as they're at least a word behind.
+static void wild_copy(uint8_t* dst, const uint8_t* src, size_t length)
+{
+    uint8_t* end = dst + length;
+    do
+    {
+        memcpy(dst, src, WILD_COPY);
+        dst += WILD_COPY;
+        src += WILD_COPY;
+    }
+    while(dst < end);
+}
+
+// Reads the extra bytes of a length, false if the input ends first.
+static bool read_length(const uint8_t*& ip, const uint8_t* end, size_t& length)
+{
+    uint8_t byte;
+    do
+    {
+        if(ip == end) return false;
+        byte = *ip++;
+        length += byte;
+    }
+    while(byte == 255);
+    return true;
+}
+
+bool lz4_decompress(
+    const uint8_t* src,
+    size_t size,
+    uint8_t* dst,
+    size_t dst_size
+){
+    const uint8_t* ip = src;
+    const uint8_t* in_end = src + size;
+    uint8_t* op = dst;
+    uint8_t* out_end = dst + dst_size;
+
+    while(ip < in_end)
+    {
+        uint8_t token = *ip++;
+
+        size_t literal_length = token >> 4;
+        if(literal_length == 15 && !read_length(ip, in_end, literal_length))
+        {
+            return false;
+        }
+        if(
+            literal_length + WILD_COPY <= (size_t)(in_end - ip) &&
+            literal_length + WILD_COPY <= (size_t)(out_end - op)
+        ) wild_copy(op, ip, literal_length);
+        else if(
+            literal_length > (size_t)(in_end - ip) ||
+            literal_length > (size_t)(out_end - op)
+        ) return false;
+        else if(literal_length != 0) memcpy(op, ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+
+        if(ip == in_end) break;
+
+        if(in_end - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(offset == 0 || offset > (size_t)(op - dst)) return false;
+
+        size_t match_length = token & 15;
+        if(match_length == 15 && !read_length(ip, in_end, match_length))
+        {
+            return false;
+        }
+        match_length += MIN_MATCH;
+        if(match_length > (size_t)(out_end - op)) return false;
+
+        const uint8_t* match = op - offset;
+        if(
+            offset >= WILD_COPY &&
+            match_length + WILD_COPY <= (size_t)(out_end - op)
+        ){
+            wild_copy(op, match, match_length);
+            op += match_length;
+            continue;
+        }
+
+        // Matches may overlap what they produce. The copied span doubles
+        // every round, since the data repeats with the offset as period.
+        while(match_length > 0)
+        {
+            size_t n = std::min<size_t>(op - match, match_length);
+            memcpy(op, match, n);
+            op += n;
+            match_length -= n;
+        }
+    }
+    return op == out_end;
+}
@@ -0,0 +1,54 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_LZ4_HH
+#define PONG_LZ4_HH
+#include <cstddef>
+#include <cstdint>
+
+// A small implementation of the LZ4 block format, for asset packs. The
+// compressor is the simple greedy one, so the ratio is a bit worse than the
+// reference implementation's, but anything it writes decodes with any LZ4
+// block decoder and the other way around.
+
+// Largest possible compressed size of size bytes.
+size_t lz4_compress_bound(size_t size);
+
+// Returns the compressed size, or 0 if it wouldn't fit in capacity.
+size_t lz4_compress(
+    const uint8_t* src,
+    size_t size,
+    uint8_t* dst,
+    size_t capacity
+);
+
+// Returns false if the data is corrupt or doesn't decompress to exactly
+// dst_size bytes. Never reads or writes out of bounds, even then.
+bool lz4_decompress(
+    const uint8_t* src,
+    size_t size,
+    uint8_t* dst,
+    size_t dst_size
+);
+
+#endif
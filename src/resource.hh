@@ -25,6 +25,7 @@ SOFTWARE.
 #define PONG_RESOURCE_HH
 #include <string>
 #include "resource_container.hh"
+#include "resource_manager.hh"
 
 class context;
 
@@ -43,6 +44,10 @@ public:
         resource_manager& manager,
         const std::string& resource_name
     );
+    resource(
+        resource_manager& manager,
+        resource_handle<S, D> handle
+    );
     resource(const resource<S, D>& other);
     ~resource();
 
@@ -40,6 +40,15 @@ resource<S, D>::resource(
     data_container.pin();
 }
 
+template<typename S, typename D>
+resource<S, D>::resource(
+    resource_manager& manager,
+    resource_handle<S, D> handle
+): data_container(manager.get(handle))
+{
+    data_container.pin();
+}
+
 template<typename S, typename D>
 resource<S, D>::resource(const resource<S, D>& other)
 : data_container(other.data_container)
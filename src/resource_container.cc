@@ -23,135 +23,480 @@ SOFTWARE.
 */
 #include "resource_container.hh"
 #include "resource_manager.hh"
+#include <iostream>
+#include <stdexcept>
 
-basic_resource_container::basic_resource_container(resource_manager& manager)
-: manager(manager), system_references(0)
+constexpr unsigned basic_resource_container::MAX_DEVICES;
+
+// Device tasks have no result to keep an exception in, so it's printed like
+// thread_pool does.
+static void print_exception(const char* what)
+{
+    try { throw; }
+    catch(std::exception& ex)
+    {
+        std::cerr << "resource_container: " << what << ": " << ex.what()
+            << std::endl;
+    }
+    catch(...)
+    {
+        std::cerr << "resource_container: " << what << std::endl;
+    }
+}
+
+basic_resource_container::basic_resource_container(
+    resource_manager& manager,
+    const void* type
+): manager(manager), type(type), system_references(0), reload_id(0),
+   load_system_id(0)
 {
 }
 
 basic_resource_container::~basic_resource_container()
 {
+    manager.forget_cached(this);
+}
+
+const void* basic_resource_container::get_type() const
+{
+    return type;
 }
 
 void basic_resource_container::pin() const
 {
     if(++system_references == 1)
     {
+        manager.take_cached(manager.system_residency, this);
         start_load_system();
     }
 }
 
+thread_pool::task_id basic_resource_container::prefetch(
+    unsigned priority
+) const
+{
+    if(++system_references == 1)
+    {
+        manager.take_cached(manager.system_residency, this);
+        start_load_system(priority);
+    }
+    return load_system_id;
+}
+
 void basic_resource_container::unpin() const
 {
     if(--system_references == 0)
     {
-        start_unload_system();
+        // Kept loaded if there's room in the budget.
+        if(!manager.add_cached(manager.system_residency, this))
+        {
+            evict_system();
+        }
     }
 }
 
 void basic_resource_container::pin(device_id id) const
 {
+    // Before pinning the system data, since it throws if there's no room.
+    unsigned index = device_index(id);
     pin();
-    if(++device_results[id].references == 1)
+    if(++devices[index].references == 1)
     {
-        start_load_device(id);
+        manager.take_cached(manager.get_device_residency(id), this);
+        start_load_device(index);
     }
 }
 
 void basic_resource_container::unpin(device_id id) const
 {
-    if(--device_results[id].references == 0)
+    unsigned index = device_index(id);
+    if(--devices[index].references == 0)
     {
-        start_unload_device(id);
+        if(!manager.add_cached(manager.get_device_residency(id), this))
+        {
+            start_unload_device(index, true);
+        }
     }
     unpin();
 }
 
+bool basic_resource_container::evict_system() const
+{
+    for(unsigned i = 0; i < MAX_DEVICES; ++i)
+    {
+        device_slot& d = devices[i];
+        device_id id = d.id;
+        if(!id) break;
+        if(d.references == 0 && d.state != DEVICE_UNLOADED)
+        {
+            manager.forget_cached(manager.get_device_residency(id), this);
+            start_unload_device(i, true);
+        }
+    }
+    return start_unload_system(true);
+}
+
+bool basic_resource_container::evict_device(device_id id) const
+{
+    return start_unload_device(device_index(id), true);
+}
+
+thread_pool::post_result<bool> basic_resource_container::reload() const
+{
+    std::lock_guard<std::mutex> lock(start_load_mutex);
+    if(
+        !reloadable() || !load_system_result.valid() ||
+        unload_system_result.valid()
+    ) return thread_pool::post_result<bool>();
+
+    thread_pool::post_result<bool> result = manager.pool.postd(
+        { load_system_result.get_id(), reload_id },
+        PRIORITY_LOW,
+        [&](){ return reload_data(); }
+    );
+    reload_id = result.get_id();
+    return result;
+}
+
 void basic_resource_container::wait_load_system() const
 {
-    if(!load_system_result.valid())
+    if(!load_system_result.valid() || unload_system_result.valid())
     {
         start_load_system();
     }
     load_system_result.wait();
+    rethrow_system_error();
+}
+
+std::exception_ptr basic_resource_container::system_load_error() const
+{
+    std::lock_guard<std::mutex> lock(system_error_mutex);
+    return system_error;
 }
 
 void basic_resource_container::wait_load_device(device_id id) const
 {
-    device_load_results& d = device_results[id];
-    if(!d.load.valid())
+    unsigned index = device_index(id);
+    device_slot& d = devices[index];
+    while(d.state != DEVICE_RESIDENT)
     {
-        start_load_device(id);
+        start_load_device(index);
+        // The task doing the transition seen above, or a later one, since
+        // they're posted under the lock that makes them.
+        std::shared_ptr<thread_pool::post_result<>> transition;
+        {
+            std::lock_guard<std::recursive_mutex> lock(d.post_mutex);
+            transition = d.result;
+        }
+        if(transition) transition->wait();
+        // Loading again would fail the same way.
+        if(d.state != DEVICE_RESIDENT) rethrow_system_error();
     }
-    d.load.wait();
 }
 
-void basic_resource_container::start_load_system() const
+void basic_resource_container::start_load_system(unsigned priority) const
 {
     std::lock_guard<std::mutex> lock(start_load_mutex);
-    if(!load_system_result.valid())
+    if(unload_system_result.valid())
     {
-        load_system_result = manager.pool.postd(
-            { unload_system_result.get_id() },
-            PRIORITY_PRONTO,
-            [&](){ load_system(); }
-        );
+        // If the unload hadn't started yet, the system is still loaded.
+        if(!unload_system_result.cancel())
+        {
+            clear_system_error();
+            load_system_result = manager.pool.postd(
+                { unload_system_result.get_id() },
+                priority,
+                [&](){ run_system_load(); }
+            );
+            load_system_id = load_system_result.get_id();
+        }
         unload_system_result.clear();
     }
+    else if(!load_system_result.valid())
+    {
+        clear_system_error();
+        load_system_result = manager.pool.postp(
+            priority,
+            [&](){ run_system_load(); }
+        );
+        load_system_id = load_system_result.get_id();
+    }
 }
 
-void basic_resource_container::start_unload_system() const
+bool basic_resource_container::start_unload_system(bool if_unpinned) const
 {
     std::lock_guard<std::mutex> lock(start_load_mutex);
-    if(!unload_system_result.valid())
+    // Pinning only takes the lock after counting the reference, so this
+    // can't miss one.
+    if(if_unpinned && system_references != 0) return false;
+    if(unload_system_result.valid()) return false;
+
+    std::vector<thread_pool::task_id> dependencies = {
+        load_system_result.get_id(), reload_id
+    };
+    bool devices_loading = false;
+    for(unsigned i = 0; i < MAX_DEVICES && devices[i].id; ++i)
     {
-        std::set<thread_pool::task_id> dependencies = {
-            load_system_result.get_id() 
-        };
-        for(auto& pair: device_results)
+        dependencies.push_back(devices[i].task);
+        if((devices[i].state & ~DEVICE_REVERT) == DEVICE_LOADING)
         {
-            dependencies.insert(pair.second.unload.get_id());
+            devices_loading = true;
         }
-        unload_system_result = manager.pool.postd(
-            dependencies,
-            PRIORITY_PRONTO,
-            [&](){ unload_system(); }
-        );
+    }
+
+    // If the load hadn't started yet, there's nothing to unload. Cancelling
+    // it would drop device loads waiting for it too, which then could never
+    // finish their transitions.
+    if(!devices_loading && load_system_result.cancel())
+    {
         load_system_result.clear();
+        load_system_id = 0;
+        return false;
     }
+
+    unload_system_result = manager.pool.postd(
+        dependencies,
+        PRIORITY_PRONTO,
+        [&](){ unload_system(); }
+    );
+    return true;
 }
 
-void basic_resource_container::start_load_device(device_id id) const
+void basic_resource_container::start_load_device(unsigned index) const
 {
-    std::lock_guard<std::mutex> lock(start_load_mutex);
-    device_load_results& d = device_results[id];
-    if(!d.load.valid())
+    device_slot& d = devices[index];
+    unsigned state = d.state;
+    for(;;)
     {
-        d.load = manager.pool.postd(
-            { load_system_result.get_id(), d.unload.get_id() },
-            PRIORITY_PRONTO,
-            [&](){ load_device(id); }
-        );
-        d.unload.clear();
+        switch(state)
+        {
+        case DEVICE_UNLOADED:
+        {
+            std::lock_guard<std::recursive_mutex> lock(d.post_mutex);
+            if(d.state.compare_exchange_strong(state, DEVICE_LOADING))
+            {
+                post_device_task(index, true);
+                return;
+            }
+            break;
+        }
+        case DEVICE_LOADING | DEVICE_REVERT:
+            if(d.state.compare_exchange_weak(state, DEVICE_LOADING)) return;
+            break;
+        case DEVICE_UNLOADING:
+            // The unload task loads the data again once it's done.
+            if(d.state.compare_exchange_weak(
+                state,
+                DEVICE_UNLOADING | DEVICE_REVERT
+            )) return;
+            break;
+        default:
+            // Loading, loaded or about to load again.
+            return;
+        }
     }
 }
 
-void basic_resource_container::start_unload_device(device_id id) const
+bool basic_resource_container::start_unload_device(
+    unsigned index,
+    bool if_unpinned
+) const
 {
-    std::lock_guard<std::mutex> lock(start_load_mutex);
-    device_load_results& d = device_results[id];
-    if(!d.unload.valid())
+    device_slot& d = devices[index];
+    if(if_unpinned && d.references != 0) return false;
+
+    unsigned state = d.state;
+    for(;;)
     {
-        d.unload = manager.pool.postd(
-            { d.load.get_id() },
+        switch(state)
+        {
+        case DEVICE_RESIDENT:
+        {
+            std::unique_lock<std::recursive_mutex> lock(d.post_mutex);
+            if(d.state.compare_exchange_strong(state, DEVICE_UNLOADING))
+            {
+                post_device_task(index, false);
+                lock.unlock();
+                // A pin that came in after the check above may have seen the
+                // data still loaded and done nothing.
+                if(if_unpinned && d.references != 0) start_load_device(index);
+                return true;
+            }
+            break;
+        }
+        case DEVICE_LOADING:
+            if(d.state.compare_exchange_weak(
+                state,
+                DEVICE_LOADING | DEVICE_REVERT
+            )){
+                if(if_unpinned && d.references != 0) start_load_device(index);
+                return true;
+            }
+            break;
+        case DEVICE_UNLOADING | DEVICE_REVERT:
+            // The unload is already under way.
+            if(d.state.compare_exchange_weak(state, DEVICE_UNLOADING))
+            {
+                if(if_unpinned && d.references != 0) start_load_device(index);
+                return false;
+            }
+            break;
+        default:
+            // Unloaded or about to be.
+            return false;
+        }
+    }
+}
+
+unsigned basic_resource_container::device_index(device_id id) const
+{
+    for(unsigned i = 0; i < MAX_DEVICES; ++i)
+    {
+        device_id current = devices[i].id;
+        if(current == id) return i;
+        // Slots are taken in order and never given back, so the first free
+        // one ends the search. If another device takes it first, the search
+        // goes on.
+        if(!current && (
+            devices[i].id.compare_exchange_strong(current, id) ||
+            current == id
+        )) return i;
+    }
+    throw std::runtime_error("basic_resource_container: Too many devices");
+}
+
+void basic_resource_container::post_device_task(
+    unsigned index,
+    bool load
+) const
+{
+    device_slot& d = devices[index];
+    std::lock_guard<std::recursive_mutex> lock(d.post_mutex);
+    unsigned post = ++d.posts;
+    thread_pool::post_result<> result;
+    if(load)
+    {
+        result = manager.pool.postd(
+            { load_system_id.load() },
+            PRIORITY_PRONTO,
+            [this, index](){ run_device_load(index); }
+        );
+    }
+    else
+    {
+        result = manager.pool.postp(
             PRIORITY_PRONTO,
-            [&](){ unload_device(id); }
+            [this, index](){ run_device_unload(index); }
         );
-        d.load.clear();
     }
+    // Pools without threads may have run the task already, and it may have
+    // posted the next one.
+    if(post != d.posts) return;
+    d.task = result.get_id();
+    d.result = std::make_shared<thread_pool::post_result<>>(
+        std::move(result)
+    );
+}
+
+void basic_resource_container::run_system_load() const
+{
+    try { load_system(); }
+    catch(...)
+    {
+        std::lock_guard<std::mutex> lock(system_error_mutex);
+        system_error = std::current_exception();
+    }
+}
+
+void basic_resource_container::clear_system_error() const
+{
+    std::lock_guard<std::mutex> lock(system_error_mutex);
+    system_error = nullptr;
+}
+
+void basic_resource_container::rethrow_system_error() const
+{
+    std::exception_ptr error = system_load_error();
+    if(error) std::rethrow_exception(error);
+}
+
+void basic_resource_container::run_device_load(unsigned index) const
+{
+    device_slot& d = devices[index];
+    // Unpinned before it got to run, so there's nothing to do.
+    unsigned state = DEVICE_LOADING | DEVICE_REVERT;
+    if(d.state.compare_exchange_strong(state, DEVICE_UNLOADED)) return;
+
+    // Nothing to load from. Only this task moves the state out of LOADING,
+    // so it can be set outright, and the next pin tries again.
+    if(system_load_error())
+    {
+        d.state = DEVICE_UNLOADED;
+        return;
+    }
+
+    // A failed load still counts as loaded, so that whatever it did get to
+    // load is unloaded as usual.
+    try { load_device(index, d.id); }
+    catch(...) { print_exception("Device load failed"); }
+
+    state = d.state;
+    for(;;)
+    {
+        if(state == DEVICE_LOADING)
+        {
+            if(d.state.compare_exchange_weak(state, DEVICE_RESIDENT)) return;
+        }
+        else if(d.state.compare_exchange_weak(state, DEVICE_UNLOADING))
+        {
+            run_device_unload(index);
+            return;
+        }
+    }
+}
+
+void basic_resource_container::run_device_unload(unsigned index) const
+{
+    device_slot& d = devices[index];
+    try { unload_device(index, d.id); }
+    catch(...) { print_exception("Device unload failed"); }
+
+    unsigned state = d.state;
+    for(;;)
+    {
+        if(state == DEVICE_UNLOADING)
+        {
+            if(d.state.compare_exchange_weak(state, DEVICE_UNLOADED)) return;
+        }
+        else if(d.state.compare_exchange_weak(state, DEVICE_LOADING))
+        {
+            post_device_task(index, true);
+            return;
+        }
+    }
+}
+
+void basic_resource_container::system_loaded(size_t size) const
+{
+    manager.loaded(manager.system_residency, this, size);
+}
+
+void basic_resource_container::system_unloaded() const
+{
+    manager.unloaded(manager.system_residency, this);
+}
+
+void basic_resource_container::device_loaded(device_id id, size_t size) const
+{
+    manager.loaded(manager.get_device_residency(id), this, size);
+}
+
+void basic_resource_container::device_unloaded(device_id id) const
+{
+    manager.unloaded(manager.get_device_residency(id), this);
 }
 
-basic_resource_container::device_load_results::device_load_results()
-: references(0) {}
+basic_resource_container::device_slot::device_slot()
+: id(nullptr), references(0), state(DEVICE_UNLOADED), task(0), posts(0) {}
 
 resource_data::~resource_data(){}
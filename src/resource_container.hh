@@ -23,63 +23,170 @@ SOFTWARE.
 */
 #ifndef PONG_RESOURCE_CONTAINER_HH
 #define PONG_RESOURCE_CONTAINER_HH
-#include <unordered_map>
+#include <memory>
+#include <string>
+#include <exception>
+#include <vector>
+#include <mutex>
+#include <shared_mutex>
 #include "thread_pool.hh"
 
 class resource_manager;
 
-//Make sure this is an integral type (pointers are fine)
+//Make sure this is an integral type (pointers are fine), and never null
 using device_id = void*;
 
 class basic_resource_container
 {
 public:
-    basic_resource_container(resource_manager& manager);
+    // Devices each resource can be on. A device gets a slot of its own the
+    // first time it's used, and keeps it for the life of the container.
+    static constexpr unsigned MAX_DEVICES = 8;
+
+    // type tells the resource types apart without RTTI, see
+    // resource_container::type_tag.
+    basic_resource_container(resource_manager& manager, const void* type);
     basic_resource_container(const basic_resource_container& other) = delete;
     virtual ~basic_resource_container();
 
+    const void* get_type() const;
+
     void pin() const;
     void unpin() const;
 
+    // Pins like pin(), but a load it starts runs at the given priority.
+    // Returns the id of the load task, which may have finished already, for
+    // tasks to depend on.
+    thread_pool::task_id prefetch(unsigned priority) const;
+
+    // The asset the system data loads from, if its type says with
+    // asset_name(), see resource_container.tcc. Empty otherwise.
+    virtual std::string asset_name() const = 0;
+
+    // Once a device is pinned, pinning it again or unpinning it while it's
+    // still pinned elsewhere takes no lock. Throws std::runtime_error if the
+    // device would need more than MAX_DEVICES slots.
     void pin(device_id id) const;
     void unpin(device_id id) const;
 
+    // These throw what the system load threw, if it failed.
     void wait_load_system() const;
     void wait_load_device(device_id id) const;
+    // What the last system load threw, null if it didn't fail or is still
+    // running.
+    std::exception_ptr system_load_error() const;
+
+    // Unload the data unless it has been pinned again meanwhile. Cached
+    // device data goes first, since it's made from the system data. These
+    // return false if there was nothing to unload.
+    bool evict_system() const;
+    bool evict_device(device_id id) const;
+
+    // Rebuilds the loaded data from scratch in the background and swaps it
+    // in once all of it has loaded, so readers never see it half done.
+    // References to the old data stay valid until the next reload, or until
+    // the data is unloaded, whichever comes first. The result is false if
+    // rebuilding threw, which keeps the old data. It's invalid if nothing is
+    // loaded, since the next load starts from scratch anyway, or if the data
+    // type can't be copied, see resource_container.
+    thread_pool::post_result<bool> reload() const;
 
 protected:
-    void start_load_system() const;
-    void start_unload_system() const;
+    void start_load_system(unsigned priority = PRIORITY_PRONTO) const;
+    // With if_unpinned, does nothing if the data is pinned. These return
+    // whether an unload task was posted.
+    bool start_unload_system(bool if_unpinned = false) const;
 
-    void start_load_device(device_id id) const;
-    void start_unload_device(device_id id) const;
+    void start_load_device(unsigned index) const;
+    bool start_unload_device(unsigned index, bool if_unpinned = false) const;
+
+    // The slot of the device, which is taken if the device doesn't have one
+    // yet. Lock-free.
+    unsigned device_index(device_id id) const;
+
+    // Called by the load and unload tasks, for the residency budgets.
+    void system_loaded(size_t size) const;
+    void system_unloaded() const;
+    void device_loaded(device_id id, size_t size) const;
+    void device_unloaded(device_id id) const;
 
     virtual void load_system() const = 0;
     virtual void unload_system() const = 0;
 
-    virtual void load_device(device_id) const = 0;
-    virtual void unload_device(device_id) const = 0;
+    virtual void load_device(unsigned index, device_id id) const = 0;
+    virtual void unload_device(unsigned index, device_id id) const = 0;
+
+    virtual bool reloadable() const = 0;
+    virtual bool reload_data() const = 0;
 
     resource_manager& manager;
 
 private:
+    const void* type;
+
     //System data
     mutable std::atomic_uint system_references;
 
     mutable std::mutex start_load_mutex;
 
     mutable thread_pool::post_result<> load_system_result, unload_system_result;
-    
+    // The last reload posted. Reloads and unloads wait for it.
+    mutable thread_pool::task_id reload_id;
+
+    // For device loads to wait for, without taking start_load_mutex.
+    mutable std::atomic<thread_pool::task_id> load_system_id;
+    // What the last system load threw. The load task keeps it here instead
+    // of failing, since that would drop the device loads waiting for it and
+    // leave their devices loading forever. Cleared when the next load is
+    // posted. Its own lock, since tasks may run inside start_load_system().
+    mutable std::mutex system_error_mutex;
+    mutable std::exception_ptr system_error;
+
+    void run_system_load() const;
+    void clear_system_error() const;
+    void rethrow_system_error() const;
+
     //Device data
-    struct device_load_results
+    enum device_state
+    {
+        DEVICE_UNLOADED = 0,
+        DEVICE_LOADING,
+        DEVICE_RESIDENT,
+        DEVICE_UNLOADING,
+        // Added to LOADING or UNLOADING when the opposite has been asked for
+        // meanwhile, which the task then does once it's done.
+        DEVICE_REVERT = 4
+    };
+
+    // Transitions are made by compare-and-swap on state, and the one that
+    // makes the state LOADING or UNLOADING posts the task to do it. Only one
+    // task is ever in flight per device, and devices don't wait for each
+    // other.
+    struct device_slot
     {
-        device_load_results();
+        device_slot();
 
+        // Null while the slot is free.
+        std::atomic<device_id> id;
         std::atomic_uint references;
-        thread_pool::post_result<> load;
-        thread_pool::post_result<> unload;
+        std::atomic_uint state;
+        // The last task posted, for the system unload to wait for.
+        std::atomic<thread_pool::task_id> task;
+        // Transitions that post a task make it and post the task under
+        // post_mutex, and tasks post the next one before they finish, so
+        // waiters that saw a transition can always wait for its task here.
+        // Recursive, since pools without threads run the task right away.
+        std::recursive_mutex post_mutex;
+        std::shared_ptr<thread_pool::post_result<>> result;
+        // Tasks posted so far, so that one run right away can't have its
+        // result overwritten by the one it was posted from.
+        unsigned posts;
     };
-    mutable std::unordered_map<device_id, device_load_results> device_results;
+    mutable device_slot devices[MAX_DEVICES];
+
+    void post_device_task(unsigned index, bool load) const;
+    void run_device_load(unsigned index) const;
+    void run_device_unload(unsigned index) const;
 };
 
 template<typename S, typename D>
@@ -94,16 +201,47 @@ public:
     const S& system() const;
     const D& device(device_id id) const;
 
+    std::string asset_name() const override final;
+
+    // Only its address matters, which is unique to each type of container.
+    static const char type_tag;
+
 protected:
     void load_system() const override final;
     void unload_system() const override final;
 
-    void load_device(device_id id) const override final;
-    void unload_device(device_id id) const override final;
+    void load_device(unsigned index, device_id id) const override final;
+    void unload_device(unsigned index, device_id id) const override final;
+
+    bool reloadable() const override final;
+    bool reload_data() const override final;
 
 private:
-    mutable S system_data;
-    mutable std::unordered_map<device_id, D> device_data;
+    struct device_entry
+    {
+        device_entry();
+
+        std::atomic<D*> data;
+        bool loaded;
+        device_id id;
+        // What the last reload replaced, freed by the next one or when the
+        // device data is unloaded.
+        std::unique_ptr<D> retired;
+    };
+
+    // Reloads start over from a copy of the system data made before it was
+    // first loaded. Null if S can't be copied.
+    std::unique_ptr<S> prototype;
+    // Pointers, so that reloads can swap them.
+    mutable std::atomic<S*> system_data;
+    // By the index of the device.
+    mutable device_entry device_data[MAX_DEVICES];
+    // What the last reload replaced, freed by the next one or when the
+    // system data is unloaded.
+    mutable std::unique_ptr<S> retired_system;
+    // Keeps device data from being loaded or unloaded during a reload.
+    // Devices share it otherwise.
+    mutable std::shared_timed_mutex reload_mutex;
 };
 
 class resource_data
@@ -22,69 +22,248 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "resource_container.hh"
+#include <tuple>
+#include <iostream>
+#include <type_traits>
+
+// Data types can report how much memory they hold with memory_usage(), which
+// the residency budgets go by. Types without it count as empty.
+template<typename T>
+auto resource_memory_usage(const T& data, int)
+-> decltype((size_t)data.memory_usage())
+{
+    return data.memory_usage();
+}
+
+template<typename T>
+size_t resource_memory_usage(const T&, long)
+{
+    return 0;
+}
+
+// Data types can name the asset they load from with asset_name(), which
+// lets resource_manager::prefetch() read assets in the order they're stored.
+// It's called while the data may be loading, so it shouldn't touch anything
+// load() changes.
+template<typename T>
+auto resource_asset_name(const T& data, int)
+-> decltype(std::string(data.asset_name()))
+{
+    return data.asset_name();
+}
+
+template<typename T>
+std::string resource_asset_name(const T&, long)
+{
+    return std::string();
+}
+
+// Only data types that can be copied can be reloaded. Null for others.
+template<typename T>
+std::unique_ptr<T> resource_prototype(const T& data, std::true_type)
+{
+    return std::unique_ptr<T>(new T(data));
+}
+
+template<typename T>
+std::unique_ptr<T> resource_prototype(const T&, std::false_type)
+{
+    return nullptr;
+}
+
+template<typename S, typename D>
+const char resource_container<S, D>::type_tag = 0;
 
 template<typename S, typename D>
 template<typename... Args>
 resource_container<S, D>::resource_container(
     resource_manager& manager,
     Args&&... args
-): basic_resource_container(manager), system_data(std::forward<Args>(args)...)
-{}
+): basic_resource_container(manager, &type_tag),
+   system_data(new S(std::forward<Args>(args)...))
+{
+    prototype = resource_prototype(
+        *system_data.load(),
+        std::is_copy_constructible<S>()
+    );
+}
 
 template<typename S, typename D>
 resource_container<S, D>::~resource_container()
 {
-    for(auto pair: device_data)
+    for(unsigned i = 0; i < MAX_DEVICES; ++i)
     {
-        start_unload_device(pair.first);
+        if(device_data[i].loaded) unload_device(i, device_data[i].id);
     }
+    // Frees what reloads replaced, too.
     unload_system();
+
+    for(device_entry& entry: device_data) delete entry.data.load();
+    delete system_data.load();
 }
 
 template<typename S, typename D>
 const S& resource_container<S, D>::system() const
 {
     wait_load_system();
-    return system_data;
+    return *system_data.load();
 }
 
 template<typename S, typename D>
 const D& resource_container<S, D>::device(device_id id) const
 {
     wait_load_device(id);
-    return device_data(id);
+    return *device_data[device_index(id)].data.load();
+}
+
+template<typename S, typename D>
+std::string resource_container<S, D>::asset_name() const
+{
+    // The prototype never changes, unlike the data reloads swap out.
+    if(prototype) return resource_asset_name(*prototype, 0);
+    return resource_asset_name(*system_data.load(), 0);
 }
 
 template<typename S, typename D>
 void resource_container<S, D>::load_system() const
 {
-    system_data.load();
+    S* data = system_data;
+    data->load();
+    system_loaded(resource_memory_usage(*data, 0));
 }
 
 template<typename S, typename D>
 void resource_container<S, D>::unload_system() const
 {
-    system_data.unload();
+    system_data.load()->unload();
+    {
+        // Device data the last reload replaced was made from the replaced
+        // system data, so it goes first, even if its device is still
+        // loaded.
+        std::unique_lock<std::shared_timed_mutex> lock(reload_mutex);
+        for(device_entry& entry: device_data)
+        {
+            if(entry.retired) entry.retired->unload();
+            entry.retired.reset();
+        }
+        if(retired_system) retired_system->unload();
+        retired_system.reset();
+    }
+    system_unloaded();
 }
 
 template<typename S, typename D>
-void resource_container<S, D>::load_device(device_id id) const
+void resource_container<S, D>::load_device(unsigned index, device_id id) const
 {
-    auto it = device_data.find(id);
-    if(!it)
+    std::shared_lock<std::shared_timed_mutex> lock(reload_mutex);
+    device_entry& entry = device_data[index];
+    D* data = entry.data;
+    if(!data)
     {
-        it = device_data.emplace(id, {id, system_data})->first;
+        data = new D(id, *system_data.load());
+        entry.data = data;
+        entry.id = id;
     }
-    it->second->load();
+    data->load();
+    entry.loaded = true;
+    device_loaded(id, resource_memory_usage(*data, 0));
+}
+
+template<typename S, typename D>
+void resource_container<S, D>::unload_device(
+    unsigned index,
+    device_id id
+) const
+{
+    std::shared_lock<std::shared_timed_mutex> lock(reload_mutex);
+    device_entry& entry = device_data[index];
+    if(entry.loaded)
+    {
+        entry.data.load()->unload();
+        entry.loaded = false;
+        device_unloaded(id);
+    }
+    // Only this device's own task touches it, so the shared lock is enough.
+    if(entry.retired) entry.retired->unload();
+    entry.retired.reset();
+}
+
+template<typename S, typename D>
+bool resource_container<S, D>::reloadable() const
+{
+    return prototype != nullptr;
 }
 
 template<typename S, typename D>
-void resource_container<S, D>::unload_device(device_id id) const
+bool resource_container<S, D>::reload_data() const
 {
-    auto it = device_data.find(id);
-    if(it)
+    std::unique_lock<std::shared_timed_mutex> lock(reload_mutex);
+
+    // Everything is loaded before anything is swapped, so a failure leaves
+    // the old data as it was.
+    std::unique_ptr<S> fresh_system = resource_prototype(
+        *prototype,
+        std::is_copy_constructible<S>()
+    );
+    if(!fresh_system) return false;
+    std::vector<std::pair<unsigned, std::unique_ptr<D>>> fresh_devices;
+    bool system_done = false;
+    try
+    {
+        fresh_system->load();
+        system_done = true;
+        for(unsigned i = 0; i < MAX_DEVICES; ++i)
+        {
+            if(!device_data[i].loaded) continue;
+            std::unique_ptr<D> data(new D(device_data[i].id, *fresh_system));
+            data->load();
+            fresh_devices.emplace_back(i, std::move(data));
+        }
+    }
+    catch(...)
     {
-        it->second->unload();
+        for(auto& pair: fresh_devices) pair.second->unload();
+        if(system_done) fresh_system->unload();
+        // Throwing would drop the unloads waiting for this, so the error is
+        // only printed.
+        try { throw; }
+        catch(std::exception& ex)
+        {
+            std::cerr << "resource_container: Reload failed: " << ex.what()
+                << std::endl;
+        }
+        catch(...)
+        {
+            std::cerr << "resource_container: Reload failed" << std::endl;
+        }
+        return false;
     }
+
+    for(device_entry& entry: device_data)
+    {
+        if(entry.retired) entry.retired->unload();
+        entry.retired.reset();
+    }
+    if(retired_system) retired_system->unload();
+
+    system_loaded(resource_memory_usage(*fresh_system, 0));
+    retired_system.reset(system_data.exchange(fresh_system.release()));
+    for(auto& pair: fresh_devices)
+    {
+        device_entry& entry = device_data[pair.first];
+        device_loaded(entry.id, resource_memory_usage(*pair.second, 0));
+        entry.retired.reset(entry.data.exchange(pair.second.release()));
+    }
+    // Unloaded device data was made from the old system data, so it's
+    // remade on its next load.
+    for(device_entry& entry: device_data)
+    {
+        if(!entry.loaded) delete entry.data.exchange(nullptr);
+    }
+    return true;
 }
 
+template<typename S, typename D>
+resource_container<S, D>::device_entry::device_entry()
+: data(nullptr), loaded(false), id(nullptr) {}
+
@@ -22,21 +22,549 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "resource_manager.hh"
-#include "context.hh"
-#include "resource.hh"
+#include <algorithm>
+#include <limits>
 
-resource_manager::resource_manager(thread_pool& pool): pool(pool) { }
+constexpr unsigned resource_manager::SLOT_BLOCK_BITS;
+constexpr unsigned resource_manager::SLOT_BLOCK_SIZE;
+constexpr unsigned resource_manager::MAX_SLOT_BLOCKS;
+constexpr size_t resource_manager::PREFETCH_GAP;
 
-resource_manager::~resource_manager() { }
+basic_resource_handle::basic_resource_handle()
+: index(std::numeric_limits<uint32_t>::max()) {}
+
+basic_resource_handle::basic_resource_handle(uint32_t index)
+: index(index) {}
+
+bool basic_resource_handle::valid() const
+{
+    return index != std::numeric_limits<uint32_t>::max();
+}
+
+bool basic_resource_handle::operator==(
+    const basic_resource_handle& other
+) const
+{
+    return index == other.index;
+}
+
+bool basic_resource_handle::operator!=(
+    const basic_resource_handle& other
+) const
+{
+    return index != other.index;
+}
+
+resource_manager::resource_manager(thread_pool& pool)
+: slot_blocks(new std::atomic<slot*>[MAX_SLOT_BLOCKS]), resource_count(0),
+  pool(pool)
+{
+    for(unsigned i = 0; i < MAX_SLOT_BLOCKS; ++i)
+    {
+        slot_blocks[i] = nullptr;
+    }
+}
+
+resource_manager::~resource_manager()
+{
+    {
+        // Nothing's left to evict, and the containers forget themselves
+        // faster this way.
+        std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+        system_residency = residency();
+        device_residency.clear();
+    }
+    for(uint32_t i = 0; i < resource_count; ++i)
+    {
+        delete container_at(i);
+    }
+    for(unsigned i = 0; i < MAX_SLOT_BLOCKS; ++i)
+    {
+        delete [] slot_blocks[i].load();
+    }
+}
+
+void resource_manager::mount(const std::string& pack_path)
+{
+    // Opened before locking, since mapping it touches the disk.
+    std::unique_ptr<asset_pack> pack(new asset_pack(pack_path));
+    std::unique_lock<std::shared_timed_mutex> lk(resources_mutex);
+    packs.push_back(std::move(pack));
+}
+
+asset_view resource_manager::find_asset(const std::string& name) const
+{
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+    return find_pack(name).get(name);
+}
+
+size_t resource_manager::asset_size(const std::string& name) const
+{
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+    return find_pack(name).size_of(name);
+}
+
+void resource_manager::read_asset(const std::string& name, uint8_t* dest) const
+{
+    const asset_pack* pack = nullptr;
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+        pack = &find_pack(name);
+    }
+    // Packs are never unmounted, so this doesn't need the lock.
+    pack->read(name, dest, &pool);
+}
+
+void resource_manager::set_system_budget(size_t bytes)
+{
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+        system_residency.budget = bytes;
+        victims = pick_evictions(system_residency);
+    }
+    post_evictions(system_residency, victims);
+}
+
+void resource_manager::set_device_budget(device_id id, size_t bytes)
+{
+    residency& r = get_device_residency(id);
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+        r.budget = bytes;
+        victims = pick_evictions(r);
+    }
+    post_evictions(r, victims);
+}
+
+static resource_manager::residency_stats make_stats(
+    uint64_t hits,
+    uint64_t misses,
+    uint64_t evictions,
+    size_t budget,
+    size_t usage,
+    size_t cached
+){
+    resource_manager::residency_stats stats;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.evictions = evictions;
+    stats.budget = budget;
+    stats.usage = usage;
+    stats.cached = cached;
+    return stats;
+}
+
+resource_manager::residency_stats resource_manager::get_system_stats() const
+{
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    const residency& r = system_residency;
+    return make_stats(
+        r.hits, r.misses, r.evictions, r.budget, r.usage, r.lru.size()
+    );
+}
+
+resource_manager::residency_stats resource_manager::get_device_stats(
+    device_id id
+) const
+{
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    auto it = device_residency.find(id);
+    if(it == device_residency.end()) return residency_stats();
+    const residency& r = it->second;
+    return make_stats(
+        r.hits, r.misses, r.evictions, r.budget, r.usage, r.lru.size()
+    );
+}
+
+thread_pool::post_result<bool> resource_manager::reload(
+    const std::string& name
+){
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+    return container_at(find_index(name))->reload();
+}
+
+thread_pool::post_result<bool> resource_manager::reload(
+    basic_resource_handle handle
+){
+    return container_at(handle.index)->reload();
+}
 
 void resource_manager::pin(const std::string& name)
 {
     std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
-    resources.at(name)->pin();
+    container_at(find_index(name))->pin();
 }
 
 void resource_manager::unpin(const std::string& name)
 {
     std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
-    resources.at(name)->unpin();
+    container_at(find_index(name))->unpin();
+}
+
+void resource_manager::pin(basic_resource_handle handle)
+{
+    container_at(handle.index)->pin();
+}
+
+void resource_manager::unpin(basic_resource_handle handle)
+{
+    container_at(handle.index)->unpin();
+}
+
+void resource_manager::pin(const std::string& name, device_id id)
+{
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+    container_at(find_index(name))->pin(id);
+}
+
+void resource_manager::unpin(const std::string& name, device_id id)
+{
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+    container_at(find_index(name))->unpin(id);
+}
+
+resource_manager::prefetch_group resource_manager::prefetch(
+    const std::vector<std::string>& resource_names,
+    unsigned priority
+){
+    std::vector<basic_resource_container*> containers;
+    containers.reserve(resource_names.size());
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+        for(const std::string& name: resource_names)
+        {
+            containers.push_back(container_at(find_index(name)));
+        }
+    }
+    return prefetch_containers(containers, priority);
+}
+
+resource_manager::prefetch_group resource_manager::prefetch(
+    const std::vector<basic_resource_handle>& handles,
+    unsigned priority
+){
+    std::vector<basic_resource_container*> containers;
+    containers.reserve(handles.size());
+    for(basic_resource_handle handle: handles)
+    {
+        containers.push_back(container_at(handle.index));
+    }
+    return prefetch_containers(containers, priority);
+}
+
+resource_manager::prefetch_group::prefetch_group()
+: total(0), loaded_count(std::make_shared<std::atomic_size_t>(0)) {}
+
+size_t resource_manager::prefetch_group::size() const
+{
+    return total;
+}
+
+size_t resource_manager::prefetch_group::loaded() const
+{
+    return *loaded_count;
+}
+
+float resource_manager::prefetch_group::progress() const
+{
+    return total == 0 ? 1.0f : (float)loaded() / total;
+}
+
+resource_manager::prefetch_group resource_manager::prefetch_containers(
+    const std::vector<basic_resource_container*>& containers,
+    unsigned priority
+){
+    std::vector<prefetch_entry> entries;
+    entries.reserve(containers.size());
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+        for(basic_resource_container* c: containers)
+        {
+            prefetch_entry e = { c, nullptr, packs.size(), 0, 0 };
+            std::string asset = c->asset_name();
+            // Newest first, like find_pack().
+            for(size_t i = packs.size(); !asset.empty() && i-- > 0;)
+            {
+                if(!packs[i]->contains(asset)) continue;
+                e.pack = packs[i].get();
+                e.pack_index = i;
+                e.pack->extent_of(asset, e.offset, e.size);
+                break;
+            }
+            entries.push_back(e);
+        }
+    }
+
+    // Stable, so that the rest keep the order they were given in.
+    std::stable_sort(
+        entries.begin(),
+        entries.end(),
+        [](const prefetch_entry& a, const prefetch_entry& b){
+            if(a.pack_index != b.pack_index)
+            {
+                return a.pack_index < b.pack_index;
+            }
+            return a.offset < b.offset;
+        }
+    );
+
+    // One read-ahead per run of neighbouring assets. Packs are never
+    // unmounted, so this doesn't need the lock.
+    for(size_t i = 0; i < entries.size() && entries[i].pack;)
+    {
+        size_t begin = entries[i].offset;
+        size_t end = begin + entries[i].size;
+        size_t j = i + 1;
+        while(
+            j < entries.size() && entries[j].pack == entries[i].pack &&
+            entries[j].offset <= end + PREFETCH_GAP
+        ){
+            end = std::max(end, entries[j].offset + entries[j].size);
+            ++j;
+        }
+        entries[i].pack->prefetch(begin, end - begin);
+        i = j;
+    }
+
+    prefetch_group group;
+    group.total = entries.size();
+    std::vector<thread_pool::task_id> counters;
+    counters.reserve(entries.size());
+    // The pool runs tasks of equal priority in the order they were posted,
+    // so the loads start in this order.
+    for(const prefetch_entry& e: entries)
+    {
+        thread_pool::task_id load = e.container->prefetch(priority);
+        std::shared_ptr<std::atomic_size_t> loaded = group.loaded_count;
+        const basic_resource_container* c = e.container;
+        // Load tasks keep what they threw instead of failing, see
+        // basic_resource_container::system_load_error().
+        counters.push_back(pool.postf({ load }, priority, [loaded, c](){
+            if(!c->system_load_error()) ++*loaded;
+        }));
+    }
+    group.result = pool.postd(counters, priority, [containers](){
+        for(const basic_resource_container* c: containers)
+        {
+            std::exception_ptr error = c->system_load_error();
+            if(error) std::rethrow_exception(error);
+        }
+    });
+    return group;
+}
+
+uint32_t resource_manager::find_index(const std::string& name) const
+{
+    auto it = names.find(name);
+    if(it == names.end())
+    {
+        throw std::out_of_range(
+            "resource_manager: No resource named \"" + name + "\""
+        );
+    }
+    return it->second;
+}
+
+const asset_pack& resource_manager::find_pack(
+    const std::string& asset_name
+) const
+{
+    for(auto it = packs.rbegin(); it != packs.rend(); ++it)
+    {
+        if((*it)->contains(asset_name)) return **it;
+    }
+    throw std::out_of_range(
+        "resource_manager: No asset named \"" + asset_name + "\""
+    );
+}
+
+basic_resource_container* resource_manager::container_at(uint32_t index) const
+{
+    if(index >= resource_count)
+    {
+        throw std::out_of_range("resource_manager: No such resource");
+    }
+    return slot_blocks[index >> SLOT_BLOCK_BITS][index & (SLOT_BLOCK_SIZE - 1)];
+}
+
+resource_manager::residency_stats::residency_stats()
+: hits(0), misses(0), evictions(0), budget(0), usage(0), cached(0) {}
+
+resource_manager::residency::residency()
+: device(false), id(0), budget(0), usage(0), evicting(0), hits(0), misses(0),
+  evictions(0) {}
+
+resource_manager::residency& resource_manager::get_device_residency(
+    device_id id
+){
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    // Elements of unordered_map don't move, so the reference stays valid.
+    residency& r = device_residency[id];
+    r.device = true;
+    r.id = id;
+    return r;
+}
+
+void resource_manager::take_cached(
+    residency& r,
+    const basic_resource_container* c
+){
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    auto it = r.lru_index.find(c);
+    if(it != r.lru_index.end())
+    {
+        r.lru.erase(it->second);
+        r.lru_index.erase(it);
+        r.hits++;
+    }
+    // The eviction task sees this and leaves the data alone.
+    else if(r.evicting_containers.count(c)) r.hits++;
+    else r.misses++;
+    stop_evicting(r, c);
+}
+
+bool resource_manager::add_cached(
+    residency& r,
+    const basic_resource_container* c
+){
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+        if(r.budget == 0) return false;
+        if(r.lru_index.count(c) == 0)
+        {
+            r.lru_index[c] = r.lru.insert(r.lru.end(), c);
+        }
+        victims = pick_evictions(r);
+    }
+    post_evictions(r, victims);
+    return true;
+}
+
+void resource_manager::forget_cached(
+    residency& r,
+    const basic_resource_container* c
+){
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    auto it = r.lru_index.find(c);
+    if(it != r.lru_index.end())
+    {
+        r.lru.erase(it->second);
+        r.lru_index.erase(it);
+    }
+    stop_evicting(r, c);
+}
+
+void resource_manager::forget_cached(const basic_resource_container* c)
+{
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    forget_cached(system_residency, c);
+    unloaded(system_residency, c);
+    for(auto& pair: device_residency)
+    {
+        forget_cached(pair.second, c);
+        unloaded(pair.second, c);
+    }
+}
+
+void resource_manager::loaded(
+    residency& r,
+    const basic_resource_container* c,
+    size_t size
+){
+    std::vector<eviction> victims;
+    {
+        std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+        size_t& old_size = r.sizes[c];
+        r.usage += size - old_size;
+        old_size = size;
+        victims = pick_evictions(r);
+    }
+    post_evictions(r, victims);
+}
+
+void resource_manager::unloaded(
+    residency& r,
+    const basic_resource_container* c
+){
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    auto it = r.unloading.find(c);
+    if(it != r.unloading.end())
+    {
+        r.evicting -= it->second;
+        r.unloading.erase(it);
+    }
+
+    it = r.sizes.find(c);
+    if(it == r.sizes.end()) return;
+    r.usage -= it->second;
+    r.sizes.erase(it);
+}
+
+std::vector<resource_manager::eviction> resource_manager::pick_evictions(
+    residency& r
+){
+    std::vector<eviction> victims;
+    while(!r.lru.empty() && (r.budget == 0 || r.usage > r.budget + r.evicting))
+    {
+        const basic_resource_container* c = r.lru.front();
+        r.lru.pop_front();
+        r.lru_index.erase(c);
+
+        auto it = r.sizes.find(c);
+        size_t size = it == r.sizes.end() ? 0 : it->second;
+        r.evicting += size;
+        r.evicting_containers[c] = size;
+        victims.push_back({c, size});
+    }
+    return victims;
+}
+
+void resource_manager::post_evictions(
+    residency& r,
+    const std::vector<eviction>& victims
+){
+    // Posted without holding residency_mutex, since the pool may run these
+    // right away.
+    for(const eviction& victim: victims)
+    {
+        pool.postf({}, PRIORITY_LOW, [this, &r, victim](){
+            evict(r, victim);
+        });
+    }
+}
+
+void resource_manager::evict(residency& r, eviction victim)
+{
+    // Held throughout, so that the container can't be destroyed while
+    // it's being evicted.
+    std::lock_guard<std::recursive_mutex> lock(residency_mutex);
+    // Pinned again or destroyed meanwhile.
+    if(!r.evicting_containers.erase(victim.container)) return;
+
+    bool unloading = r.device ?
+        victim.container->evict_device(r.id) :
+        victim.container->evict_system();
+    // The memory stays counted as evicting until the unload task is done.
+    if(unloading && r.sizes.count(victim.container))
+    {
+        r.unloading[victim.container] = victim.size;
+        r.evictions++;
+    }
+    else r.evicting -= victim.size;
+}
+
+void resource_manager::stop_evicting(
+    residency& r,
+    const basic_resource_container* c
+){
+    for(residency::size_map* map: {&r.evicting_containers, &r.unloading})
+    {
+        auto it = map->find(c);
+        if(it == map->end()) continue;
+        r.evicting -= it->second;
+        map->erase(it);
+    }
 }
@@ -32,11 +32,45 @@ SOFTWARE.
 #include <functional>
 #include <memory>
 #include <future>
+#include <cstdint>
+#include <list>
+#include <vector>
 #include "resource_container.hh"
+#include "asset_pack.hh"
 
 class shader;
 class thread_pool;
 
+// A resource interned by resource_manager. Resolving one is just an array
+// lookup, so hot paths should keep these instead of names.
+class basic_resource_handle
+{
+friend class resource_manager;
+public:
+    basic_resource_handle();
+
+    bool valid() const;
+    bool operator==(const basic_resource_handle& other) const;
+    bool operator!=(const basic_resource_handle& other) const;
+
+protected:
+    explicit basic_resource_handle(uint32_t index);
+
+    uint32_t index;
+};
+
+// The types are checked once when the handle is made, not on every lookup.
+template<typename S, typename D>
+class resource_handle: public basic_resource_handle
+{
+friend class resource_manager;
+public:
+    resource_handle();
+
+private:
+    explicit resource_handle(uint32_t index);
+};
+
 class resource_manager
 {
 template<typename S, typename D>
@@ -48,26 +82,216 @@ public:
     resource_manager(resource_manager&& other) = delete;
     ~resource_manager();
 
+    template<typename T>
+    using handle_type = resource_handle<
+        typename T::system_data_type,
+        typename T::device_data_type
+    >;
+
+    // Creating a resource with a name that's already taken replaces the old
+    // one, and handles to the old one then refer to the new one.
     template<typename T, typename... Args>
-    void create(const std::string& name, Args&&... args);
+    handle_type<T> create(const std::string& name, Args&&... args);
 
+    // Name lookups take a lock and hash the name, so they're meant for
+    // tooling and for getting a handle once.
     template<typename S, typename D>
     resource_container<S, D>& get(const std::string& name);
+    template<typename S, typename D>
+    resource_handle<S, D> find(const std::string& name);
+
+    // Lock-free, so any thread can call this as often as it likes. Throws if
+    // the resource has since been replaced with one of another type.
+    template<typename S, typename D>
+    resource_container<S, D>& get(resource_handle<S, D> handle) const;
+
+    // Maps an asset pack for find_asset(). Assets in later packs hide ones
+    // with the same name in earlier packs. Throws std::runtime_error if the
+    // pack can't be opened.
+    void mount(const std::string& pack_path);
+    // Resource data can keep the view and load straight from it, since
+    // packs stay mapped until the manager is destroyed. Throws
+    // std::out_of_range if no mounted pack has the asset, and
+    // std::runtime_error if it's compressed.
+    asset_view find_asset(const std::string& name) const;
+    // These work for compressed assets too, which read_asset() decompresses
+    // on the pool. dest needs room for asset_size(name) bytes.
+    size_t asset_size(const std::string& name) const;
+    void read_asset(const std::string& name, uint8_t* dest) const;
+
+    // Rebuilds the resource in the background if it's loaded, see
+    // basic_resource_container::reload(). resource_watcher calls this when
+    // files change.
+    thread_pool::post_result<bool> reload(const std::string& name);
+    thread_pool::post_result<bool> reload(basic_resource_handle handle);
 
     //These pin/unpin on all devices
     void pin(const std::string& name);
     void unpin(const std::string& name);
+    void pin(basic_resource_handle handle);
+    void unpin(basic_resource_handle handle);
 
     //These pin/unpin on specific devices
     void pin(const std::string& name, device_id id);
     void unpin(const std::string& name, device_id id);
 
+    // The loads started by prefetch().
+    class prefetch_group
+    {
+    friend class resource_manager;
+    public:
+        prefetch_group();
+
+        size_t size() const;
+        // Resources loaded so far, for loading screens to show. Failed loads
+        // aren't counted.
+        size_t loaded() const;
+        // From 0 to 1.
+        float progress() const;
+
+        // Ready once all of the loads are done. If any of them threw, the
+        // first exception in the order given is passed on. Tasks can depend
+        // on it and coroutines can co_await it.
+        thread_pool::post_result<> result;
+
+    private:
+        size_t total;
+        std::shared_ptr<std::atomic_size_t> loaded_count;
+    };
+
+    // Pins the system data of all the resources, like pin() does for each,
+    // so they have to be unpinned the same way. Rather than loading in the
+    // order given at PRIORITY_PRONTO, the loads start at the given priority
+    // in the order their assets are stored, and neighbouring assets are
+    // read ahead from the disk in one go. With several workers, the next
+    // loads start while earlier ones are still running. Only data types
+    // with asset_name() are ordered, see resource_container.tcc; the rest
+    // load last.
+    prefetch_group prefetch(
+        const std::vector<std::string>& resource_names,
+        unsigned priority = PRIORITY_LOW
+    );
+    prefetch_group prefetch(
+        const std::vector<basic_resource_handle>& handles,
+        unsigned priority = PRIORITY_LOW
+    );
+
+    // With a budget of 0, which is the default, resources are unloaded as
+    // soon as they're unpinned. Otherwise they stay loaded while everything
+    // loaded fits in the budget, and once it doesn't, the least recently
+    // unpinned ones are unloaded by background pool tasks. Sizes come from
+    // memory_usage() of the data types, see resource_container.tcc.
+    void set_system_budget(size_t bytes);
+    void set_device_budget(device_id id, size_t bytes);
+
+    struct residency_stats
+    {
+        residency_stats();
+
+        // Pins that found the data still loaded, and ones that didn't.
+        uint64_t hits, misses;
+        uint64_t evictions;
+        size_t budget;
+        // Bytes of everything loaded, pinned or not.
+        size_t usage;
+        // Number of unpinned resources still loaded.
+        size_t cached;
+    };
+    residency_stats get_system_stats() const;
+    residency_stats get_device_stats(device_id id) const;
+
 private:
-    std::shared_timed_mutex resources_mutex;
-    std::unordered_map<
-        std::string /*name*/,
-        std::unique_ptr<basic_resource_container> /*container*/
-    > resources;
+    // Needs resources_mutex.
+    uint32_t find_index(const std::string& name) const;
+    const asset_pack& find_pack(const std::string& asset_name) const;
+    basic_resource_container* container_at(uint32_t index) const;
+
+    struct prefetch_entry
+    {
+        basic_resource_container* container;
+        // Null if the asset isn't in any pack, these are sorted last.
+        const asset_pack* pack;
+        size_t pack_index;
+        size_t offset, size;
+    };
+    prefetch_group prefetch_containers(
+        const std::vector<basic_resource_container*>& containers,
+        unsigned priority
+    );
+    // Assets closer than this to each other are read ahead together, since
+    // reading the gap costs less than another seek.
+    static constexpr size_t PREFETCH_GAP = 256 * 1024;
+
+    // Containers live in blocks that never move, so that they can be looked
+    // up without a lock while more are being added.
+    using slot = std::atomic<basic_resource_container*>;
+    static constexpr unsigned SLOT_BLOCK_BITS = 10;
+    static constexpr unsigned SLOT_BLOCK_SIZE = 1u << SLOT_BLOCK_BITS;
+    static constexpr unsigned MAX_SLOT_BLOCKS = 1u << 12;
+
+    // Unpinned but loaded resources of either the system or one device.
+    struct residency
+    {
+        residency();
+
+        bool device;
+        device_id id;
+        size_t budget, usage;
+        // Picked for eviction, but not unloaded yet. Those in unloading
+        // already have their unload task posted.
+        size_t evicting;
+        using size_map = std::unordered_map<
+            const basic_resource_container*, size_t
+        >;
+        size_map evicting_containers, unloading;
+        // Least recently unpinned first.
+        using lru_list = std::list<const basic_resource_container*>;
+        lru_list lru;
+        std::unordered_map<const basic_resource_container*, lru_list::iterator>
+            lru_index;
+        // Memory used by each loaded resource.
+        size_map sizes;
+        uint64_t hits, misses, evictions;
+    };
+
+    struct eviction
+    {
+        const basic_resource_container* container;
+        size_t size;
+    };
+
+    residency& get_device_residency(device_id id);
+    // These are called by the containers. add_cached() returns false if the
+    // resource should be unloaded right away.
+    void take_cached(residency& r, const basic_resource_container* c);
+    bool add_cached(residency& r, const basic_resource_container* c);
+    void forget_cached(residency& r, const basic_resource_container* c);
+    void forget_cached(const basic_resource_container* c);
+    void loaded(
+        residency& r,
+        const basic_resource_container* c,
+        size_t size
+    );
+    void unloaded(residency& r, const basic_resource_container* c);
+    // Needs residency_mutex. Picks the resources to unload until the rest
+    // fits in the budget.
+    std::vector<eviction> pick_evictions(residency& r);
+    void post_evictions(residency& r, const std::vector<eviction>& victims);
+    void evict(residency& r, eviction victim);
+
+    void stop_evicting(residency& r, const basic_resource_container* c);
+
+    // Recursive, since evicting system data evicts device data too.
+    mutable std::recursive_mutex residency_mutex;
+    residency system_residency;
+    std::unordered_map<device_id, residency> device_residency;
+
+    // Protects names, packs and adding containers.
+    mutable std::shared_timed_mutex resources_mutex;
+    std::unordered_map<std::string /*name*/, uint32_t /*index*/> names;
+    std::vector<std::unique_ptr<asset_pack>> packs;
+    std::unique_ptr<std::atomic<slot*>[]> slot_blocks;
+    std::atomic_uint resource_count;
 
     thread_pool& pool;
 };
@@ -25,11 +25,19 @@ SOFTWARE.
 #include "resource_container.hh"
 #include <stdexcept>
 
+template<typename S, typename D>
+resource_handle<S, D>::resource_handle() {}
+
+template<typename S, typename D>
+resource_handle<S, D>::resource_handle(uint32_t index)
+: basic_resource_handle(index) {}
+
 template<typename T, typename... Args>
-void resource_manager::create(const std::string& name, Args&&... args)
-{
-    std::unique_lock<std::shared_timed_mutex> lk(resources_mutex);
-    resources[name].reset(
+resource_manager::handle_type<T> resource_manager::create(
+    const std::string& name,
+    Args&&... args
+){
+    std::unique_ptr<basic_resource_container> container(
         new resource_container<
             typename T::system_data_type,
             typename T::device_data_type
@@ -38,6 +46,36 @@ void resource_manager::create(const std::string& name, Args&&... args)
             std::forward<Args>(args)...
         )
     );
+
+    std::unique_lock<std::shared_timed_mutex> lk(resources_mutex);
+    auto it = names.find(name);
+    if(it != names.end())
+    {
+        uint32_t index = it->second;
+        slot& s = slot_blocks[index >> SLOT_BLOCK_BITS][
+            index & (SLOT_BLOCK_SIZE - 1)
+        ];
+        delete s.exchange(container.release());
+        return handle_type<T>(index);
+    }
+
+    uint32_t index = resource_count;
+    if(index >> SLOT_BLOCK_BITS >= MAX_SLOT_BLOCKS)
+    {
+        throw std::runtime_error("resource_manager: Too many resources");
+    }
+    slot* block = slot_blocks[index >> SLOT_BLOCK_BITS];
+    if(!block)
+    {
+        block = new slot[SLOT_BLOCK_SIZE];
+        for(unsigned i = 0; i < SLOT_BLOCK_SIZE; ++i) block[i] = nullptr;
+        slot_blocks[index >> SLOT_BLOCK_BITS] = block;
+    }
+    names[name] = index;
+    block[index & (SLOT_BLOCK_SIZE - 1)] = container.release();
+    // Published last, so that lock-free readers never see a missing slot.
+    resource_count = index + 1;
+    return handle_type<T>(index);
 }
 
 template<typename S, typename D>
@@ -46,13 +84,39 @@ resource_container<S, D>& resource_manager::get(
 ){
     std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
 
-    basic_resource_container* container = resources.at(name).get();
-    resource_container<S, D>* tcontainer =
-        dynamic_cast<resource_container<S, D>*>(container);
-    if(!tcontainer)
+    basic_resource_container* container = container_at(find_index(name));
+    if(container->get_type() != &resource_container<S, D>::type_tag)
         throw std::runtime_error(
             "resource_manager::get(): Type mismatch for resource \""+name+"\""
         );
 
-    return *tcontainer;
+    return *static_cast<resource_container<S, D>*>(container);
+}
+
+template<typename S, typename D>
+resource_handle<S, D> resource_manager::find(const std::string& name)
+{
+    std::shared_lock<std::shared_timed_mutex> lk(resources_mutex);
+
+    uint32_t index = find_index(name);
+    if(container_at(index)->get_type() != &resource_container<S, D>::type_tag)
+        throw std::runtime_error(
+            "resource_manager::find(): Type mismatch for resource \""+name+"\""
+        );
+
+    return resource_handle<S, D>(index);
+}
+
+template<typename S, typename D>
+resource_container<S, D>& resource_manager::get(
+    resource_handle<S, D> handle
+) const
+{
+    basic_resource_container* container = container_at(handle.index);
+    if(container->get_type() != &resource_container<S, D>::type_tag)
+        throw std::runtime_error(
+            "resource_manager::get(): Type mismatch for resource handle"
+        );
+
+    return *static_cast<resource_container<S, D>*>(container);
 }
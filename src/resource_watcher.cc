@@ -0,0 +1,232 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "resource_watcher.hh"
+#include "resource_manager.hh"
+#include <algorithm>
+#include <stdexcept>
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+// Editors often save by writing a new file and renaming it over the old one,
+// which only shows up as an event of the directory.
+static const uint32_t WATCH_EVENTS =
+    IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO;
+
+resource_watcher::resource_watcher(
+    resource_manager& manager,
+    std::chrono::milliseconds debounce
+): manager(manager), debounce(debounce), inotify_fd(-1), wake_fd(-1),
+   stopping(false), change_count(0)
+{
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(inotify_fd < 0 || wake_fd < 0)
+    {
+        std::string reason = strerror(errno);
+        if(inotify_fd >= 0) close(inotify_fd);
+        if(wake_fd >= 0) close(wake_fd);
+        throw std::runtime_error("resource_watcher: " + reason);
+    }
+    watch_thread = std::thread([this](){ watch_loop(); });
+}
+
+resource_watcher::~resource_watcher()
+{
+    stopping = true;
+    uint64_t one = 1;
+    if(write(wake_fd, &one, sizeof(one)) < 0) {}
+    watch_thread.join();
+    reap_reloads(true);
+    close(inotify_fd);
+    close(wake_fd);
+}
+
+void resource_watcher::watch(
+    const std::string& path,
+    const std::string& resource_name
+){
+    size_t slash = path.find_last_of('/');
+    std::string directory = ".";
+    if(slash == 0) directory = "/";
+    else if(slash != std::string::npos) directory = path.substr(0, slash);
+    std::string name = slash == std::string::npos ?
+        path : path.substr(slash + 1);
+
+    int wd = inotify_add_watch(inotify_fd, directory.c_str(), WATCH_EVENTS);
+    if(wd < 0)
+    {
+        throw std::runtime_error(
+            "resource_watcher: Unable to watch \"" + directory + "\": " +
+            strerror(errno)
+        );
+    }
+
+    std::lock_guard<std::mutex> lock(watch_mutex);
+    // The same directory spelled differently gets the same descriptor, and
+    // events are matched by the spelling it was first watched with.
+    auto it = directories.emplace(wd, directory).first;
+    files[it->second + "/" + name].push_back(resource_name);
+}
+
+uint64_t resource_watcher::get_change_count() const
+{
+    return change_count;
+}
+
+void resource_watcher::watch_loop()
+{
+    while(!stopping)
+    {
+        int timeout = -1;
+        if(!due.empty())
+        {
+            clock::time_point next = clock::time_point::max();
+            for(auto& pair: due) next = std::min(next, pair.second);
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(
+                next - clock::now()
+            ) + std::chrono::milliseconds(1);
+            timeout = std::max<int>(wait.count(), 0);
+        }
+
+        pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        if(poll(fds, 2, timeout) < 0 && errno != EINTR)
+        {
+            std::cerr << "resource_watcher: " << strerror(errno) << std::endl;
+            return;
+        }
+        if(stopping) return;
+
+        if(fds[0].revents & POLLIN) read_events();
+        reload_due();
+        reap_reloads(false);
+    }
+}
+
+void resource_watcher::read_events()
+{
+    alignas(inotify_event) char buffer[4096];
+    clock::time_point time = clock::now() + debounce;
+    for(;;)
+    {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if(length <= 0) return;
+
+        std::lock_guard<std::mutex> lock(watch_mutex);
+        for(char* p = buffer; p < buffer + length;)
+        {
+            inotify_event* event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            if(event->len == 0) continue;
+
+            auto dir = directories.find(event->wd);
+            if(dir == directories.end()) continue;
+            std::string path = dir->second + "/" + event->name;
+            // Every write pushes the reload back.
+            if(files.count(path)) due[path] = time;
+        }
+    }
+}
+
+void resource_watcher::reload_due()
+{
+    clock::time_point now = clock::now();
+    for(auto it = due.begin(); it != due.end();)
+    {
+        if(it->second > now)
+        {
+            ++it;
+            continue;
+        }
+
+        std::vector<std::string> names;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex);
+            names = files[it->first];
+        }
+        for(const std::string& name: names)
+        {
+            try
+            {
+                thread_pool::post_result<bool> result = manager.reload(name);
+                if(result.valid()) reloads.push_back(std::move(result));
+            }
+            catch(std::exception& e)
+            {
+                // The resource hasn't been created yet or has a bad name,
+                // neither of which should stop the watcher.
+                std::cerr << "resource_watcher: " << e.what() << std::endl;
+            }
+        }
+        ++change_count;
+        it = due.erase(it);
+    }
+}
+
+void resource_watcher::reap_reloads(bool wait)
+{
+    for(auto it = reloads.begin(); it != reloads.end();)
+    {
+        if(
+            !wait && it->wait_for(std::chrono::seconds(0)) !=
+            std::future_status::ready
+        ){
+            ++it;
+            continue;
+        }
+        // Failed reloads have already said why, and dropped ones had their
+        // data unloaded before they could run.
+        try { it->get(); }
+        catch(...) {}
+        it = reloads.erase(it);
+    }
+}
+#else
+resource_watcher::resource_watcher(
+    resource_manager& manager,
+    std::chrono::milliseconds debounce
+): manager(manager), debounce(debounce), inotify_fd(-1), wake_fd(-1),
+   stopping(false), change_count(0)
+{
+    throw std::runtime_error(
+        "resource_watcher: Not supported on this platform"
+    );
+}
+
+resource_watcher::~resource_watcher() {}
+
+void resource_watcher::watch(const std::string&, const std::string&) {}
+
+uint64_t resource_watcher::get_change_count() const
+{
+    return change_count;
+}
+#endif
@@ -0,0 +1,93 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_RESOURCE_WATCHER_HH
+#define PONG_RESOURCE_WATCHER_HH
+#include "thread_pool.hh"
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+class resource_manager;
+
+// Reloads resources when the files they're made from change, so that assets
+// can be iterated on without restarting. Changes are picked up with inotify
+// on a thread of its own, and only the resources made from a changed file
+// are rebuilt, on the manager's pool. A file is reloaded once it has been
+// left alone for the debounce time, so that a save made of several writes
+// only reloads once.
+class resource_watcher
+{
+public:
+    // Throws std::runtime_error where inotify isn't available.
+    resource_watcher(
+        resource_manager& manager,
+        std::chrono::milliseconds debounce = std::chrono::milliseconds(100)
+    );
+    resource_watcher(const resource_watcher& other) = delete;
+    // Waits for the reloads in flight, so this has to go before the manager.
+    ~resource_watcher();
+
+    // Several resources can be made from one file, and one resource from
+    // several files. The file doesn't have to exist yet, but its directory
+    // does. Throws std::runtime_error if the directory can't be watched.
+    void watch(const std::string& path, const std::string& resource_name);
+
+    // Changed files acted on so far, after debouncing.
+    uint64_t get_change_count() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    void watch_loop();
+    void read_events();
+    void reload_due();
+    void reap_reloads(bool wait);
+
+    resource_manager& manager;
+    std::chrono::milliseconds debounce;
+    int inotify_fd, wake_fd;
+
+    // Protects directories and files.
+    std::mutex watch_mutex;
+    // Watched directories by watch descriptor.
+    std::unordered_map<int, std::string> directories;
+    // Resource names by path, as given by the directory above plus the name.
+    std::unordered_map<std::string, std::vector<std::string>> files;
+
+    // Only used by the watch thread. Changed files are due for reloading
+    // once their time has come.
+    std::unordered_map<std::string, clock::time_point> due;
+    std::vector<thread_pool::post_result<bool>> reloads;
+
+    std::atomic_bool stopping;
+    std::atomic<uint64_t> change_count;
+    std::thread watch_thread;
+};
+
+#endif
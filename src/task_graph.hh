@@ -0,0 +1,124 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_TASK_GRAPH_HH
+#define PONG_TASK_GRAPH_HH
+#include "thread_pool.hh"
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
+// A fixed set of tasks and the dependencies between them, recorded once and
+// run on a thread_pool every frame. Running a frame only resets a counter per
+// node, ready nodes are posted with postf() and nothing is allocated.
+//
+//     task_graph<frame_info> frame;
+//     auto input = frame.add_node(read_input);
+//     auto sim = frame.add_node(simulate, PRIORITY_HIGH);
+//     frame.add_edge(input, sim);
+//     ...
+//     frame.run(pool, info);
+//     frame.wait();
+//
+// Nodes are called with the parameters given to run(), which are copied into
+// the graph for the duration of the frame.
+template<typename Params>
+class task_graph
+{
+public:
+    using node_id = size_t;
+
+    task_graph();
+    task_graph(const task_graph& other) = delete;
+    // Waits for the running frame, if any.
+    ~task_graph();
+
+    // f is called with const Params&.
+    template<typename F>
+    node_id add_node(F&& f, unsigned priority = PRIORITY_LOW);
+    // Like add_node(), but f returns whether the nodes depending on it get to
+    // run this frame. Skipped nodes skip the nodes depending on them as well.
+    template<typename F>
+    node_id add_condition(F&& f, unsigned priority = PRIORITY_LOW);
+    // to runs after from is done.
+    void add_edge(node_id from, node_id to);
+
+    // Throws std::runtime_error if the edges form a cycle. run() does this
+    // whenever the graph has changed, but it can be called earlier to catch
+    // mistakes right after recording.
+    void validate();
+
+    // Starts a frame, after waiting for the previous one. Don't change the
+    // graph while a frame is running.
+    void run(thread_pool& pool, const Params& params);
+    // Waits for the frame to finish, and rethrows the first exception thrown
+    // by a node. Nodes depending on one that threw are skipped. Like
+    // post_result::wait(), workers of the pool help with the nodes meanwhile,
+    // so nodes can wait for other graphs.
+    void wait();
+
+    size_t size() const;
+
+private:
+    struct node
+    {
+        node(std::function<bool(const Params&)>&& function, unsigned priority);
+
+        std::function<bool(const Params&)> function;
+        unsigned priority;
+        std::vector<node_id> successors;
+        unsigned dependency_count;
+
+        // Reset every frame.
+        std::atomic_uint unfinished_dependencies;
+        std::atomic_bool skipped;
+    };
+
+    // Called once all dependencies of the node are done.
+    void start_node(node_id id);
+    void run_node(node_id id);
+    void finish_node(node_id id, bool skip_successors);
+
+    // Nodes are never moved, since they hold atomics.
+    std::vector<std::unique_ptr<node>> nodes;
+    std::vector<node_id> roots;
+    bool validated;
+
+    thread_pool* pool;
+    Params params;
+    std::atomic_size_t unfinished_nodes;
+
+    // Set once the last node is done.
+    thread_pool::promise<> frame_promise;
+    thread_pool::post_result<> frame_result;
+
+    // Protects exception.
+    std::mutex frame_mutex;
+    std::exception_ptr exception;
+};
+
+#include "task_graph.tcc"
+#endif
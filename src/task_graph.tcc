@@ -0,0 +1,204 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "task_graph.hh"
+#include <stdexcept>
+#include <utility>
+
+template<typename Params>
+task_graph<Params>::task_graph()
+: validated(true), pool(nullptr), unfinished_nodes(0) {}
+
+template<typename Params>
+task_graph<Params>::~task_graph()
+{
+    if(frame_result.valid()) frame_result.wait();
+}
+
+template<typename Params>
+template<typename F>
+typename task_graph<Params>::node_id task_graph<Params>::add_node(
+    F&& f,
+    unsigned priority
+){
+    return add_condition(
+        [f = std::forward<F>(f)](const Params& params) mutable
+        {
+            f(params);
+            return true;
+        },
+        priority
+    );
+}
+
+template<typename Params>
+template<typename F>
+typename task_graph<Params>::node_id task_graph<Params>::add_condition(
+    F&& f,
+    unsigned priority
+){
+    nodes.emplace_back(new node(std::forward<F>(f), priority));
+    validated = false;
+    return nodes.size() - 1;
+}
+
+template<typename Params>
+void task_graph<Params>::add_edge(node_id from, node_id to)
+{
+    if(from >= nodes.size() || to >= nodes.size())
+    {
+        throw std::out_of_range("task_graph: No such node");
+    }
+    nodes[from]->successors.push_back(to);
+    nodes[to]->dependency_count++;
+    validated = false;
+}
+
+template<typename Params>
+void task_graph<Params>::validate()
+{
+    if(validated) return;
+
+    // Kahn's algorithm, whatever can't be ordered is part of a cycle.
+    std::vector<unsigned> counts(nodes.size());
+    std::vector<node_id> ready;
+    for(node_id i = 0; i < nodes.size(); ++i)
+    {
+        counts[i] = nodes[i]->dependency_count;
+        if(counts[i] == 0) ready.push_back(i);
+    }
+    roots = ready;
+
+    size_t ordered = 0;
+    while(!ready.empty())
+    {
+        node_id id = ready.back();
+        ready.pop_back();
+        ordered++;
+        for(node_id s: nodes[id]->successors)
+        {
+            if(--counts[s] == 0) ready.push_back(s);
+        }
+    }
+    if(ordered != nodes.size())
+    {
+        throw std::runtime_error("task_graph: The graph has a cycle");
+    }
+    validated = true;
+}
+
+template<typename Params>
+void task_graph<Params>::run(thread_pool& pool, const Params& params)
+{
+    wait();
+    validate();
+    if(nodes.empty()) return;
+
+    this->pool = &pool;
+    this->params = params;
+    for(std::unique_ptr<node>& n: nodes)
+    {
+        n->unfinished_dependencies = n->dependency_count;
+        n->skipped = false;
+    }
+    unfinished_nodes = nodes.size();
+    {
+        std::lock_guard<std::mutex> lk(frame_mutex);
+        exception = nullptr;
+    }
+    frame_promise = pool.make_promise<>();
+    frame_result = frame_promise.get_result();
+
+    for(node_id id: roots) start_node(id);
+}
+
+template<typename Params>
+void task_graph<Params>::wait()
+{
+    if(frame_result.valid()) frame_result.wait();
+    std::lock_guard<std::mutex> lk(frame_mutex);
+    if(exception)
+    {
+        std::exception_ptr e = exception;
+        exception = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+template<typename Params>
+size_t task_graph<Params>::size() const
+{
+    return nodes.size();
+}
+
+template<typename Params>
+void task_graph<Params>::start_node(node_id id)
+{
+    node& n = *nodes[id];
+    // Skipped nodes have nothing to run, so they're passed right through.
+    if(n.skipped) finish_node(id, true);
+    else pool->postf({}, n.priority, [this, id](){ run_node(id); });
+}
+
+template<typename Params>
+void task_graph<Params>::run_node(node_id id)
+{
+    bool proceed = false;
+    try
+    {
+        proceed = nodes[id]->function(params);
+    }
+    catch(...)
+    {
+        std::lock_guard<std::mutex> lk(frame_mutex);
+        if(!exception) exception = std::current_exception();
+    }
+    finish_node(id, !proceed);
+}
+
+template<typename Params>
+void task_graph<Params>::finish_node(node_id id, bool skip_successors)
+{
+    for(node_id s: nodes[id]->successors)
+    {
+        node& succ = *nodes[s];
+        // Set before the count drops, so that whoever starts it sees it.
+        if(skip_successors) succ.skipped = true;
+        if(--succ.unfinished_dependencies == 0) start_node(s);
+    }
+
+    if(--unfinished_nodes == 0)
+    {
+        // Moved out first, since the graph may be gone as soon as waiters
+        // see it done.
+        thread_pool::promise<> done = std::move(frame_promise);
+        done.set_value();
+    }
+}
+
+template<typename Params>
+task_graph<Params>::node::node(
+    std::function<bool(const Params&)>&& function,
+    unsigned priority
+): function(std::move(function)), priority(priority), dependency_count(0),
+   unfinished_dependencies(0), skipped(false) {}
@@ -25,94 +25,194 @@ SOFTWARE.
 #include <cstdlib>
 #include <iostream>
 #include <algorithm>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <tuple>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+#ifdef THREAD_POOL_TRACING
+#include <iomanip>
+#include <cmath>
+#endif
+
+thread_local thread_pool::worker* thread_pool::current_worker = nullptr;
+
+constexpr unsigned thread_pool::TASK_BLOCK_BITS;
+constexpr unsigned thread_pool::TASK_BLOCK_SIZE;
+constexpr unsigned thread_pool::MAX_TASK_BLOCKS;
+constexpr size_t thread_pool::FREE_TASK_BATCH_SIZE;
+constexpr size_t thread_pool::task::INLINE_FUNCTION_SIZE;
+constexpr size_t thread_pool::task::INLINE_EDGES;
+constexpr size_t thread_pool::task_queue::INITIAL_CAPACITY;
+constexpr size_t thread_pool::MAX_SPLIT_JOBS;
+constexpr size_t thread_pool::MIN_SORT_SPLIT;
+constexpr unsigned thread_pool::HELP_SEARCH_DEPTH;
+constexpr std::chrono::microseconds thread_pool::HELP_POLL_INTERVAL;
+constexpr unsigned thread_pool::DEFAULT_LANE_AGING;
+constexpr std::chrono::microseconds thread_pool::TIMER_TICK;
+constexpr unsigned thread_pool::TIMER_LEVELS;
+constexpr unsigned thread_pool::TIMER_SLOT_BITS;
+constexpr unsigned thread_pool::TIMER_SLOTS;
+constexpr std::chrono::microseconds thread_pool::DEFAULT_IDLE_SPIN;
+constexpr std::chrono::microseconds thread_pool::DEFAULT_IDLE_YIELD;
+constexpr unsigned thread_pool::IDLE_SPIN_BATCH;
+#ifdef THREAD_POOL_TRACING
+constexpr size_t thread_pool::histogram::BUCKETS;
+constexpr size_t thread_pool::TRACE_BUFFER_SIZE;
+std::atomic<uint64_t> thread_pool::trace_serial_counter(0);
+#endif
 
 thread_pool::thread_pool()
 : thread_pool(std::max(std::thread::hardware_concurrency()-1, 0u)) { }
 
-thread_pool::thread_pool(unsigned thread_count)
-: busy_threads(0), id_counter(1) /*0 is reserved*/
+thread_pool::thread_pool(unsigned thread_count, scheduling mode)
+: mode(mode), task_blocks(new std::atomic<task*>[MAX_TASK_BLOCKS]),
+  task_block_count(0), destroying(false), lanes_limited(false),
+  lane_aging(DEFAULT_LANE_AGING), main_thread_id(std::thread::id()),
+  running_inline(false), worker_count(0), retiring(0),
+  place(PLACE_ANYWHERE), busy_threads(0), queued_tasks(0),
+  sleeping_threads(0), schedule_changes(0), timer_epoch(clock::now()),
+  timer_tick(0), next_timer_tick(std::numeric_limits<uint64_t>::max()),
+  timer_count(0), timer_keeper(false), last_timer_id(0),
+  spinning_threads(0), idle_spin_ns(0), idle_yield_ns(0), idle_park(false),
+  autoscale_stop(false), autoscaling(false), max_wait_ns(0)
+#ifdef THREAD_POOL_TRACING
+  , trace_serial(++trace_serial_counter),
+  trace_epoch(std::chrono::steady_clock::now())
+#endif
 {
+    for(unsigned i = 0; i < MAX_TASK_BLOCKS; ++i)
+    {
+        task_blocks[i] = nullptr;
+    }
+    for(auto& level: timer_wheel)
+    {
+        for(timer_entry*& slot: level) slot = nullptr;
+    }
+    if(std::thread::hardware_concurrency() > 1)
+    {
+        set_idle_spin(DEFAULT_IDLE_SPIN, DEFAULT_IDLE_YIELD);
+    }
     resize(thread_count);
 }
 
 thread_pool::~thread_pool()
 {
-    for(size_t i = 0; i < threads.size(); ++i)
+    stop_autoscale();
+    // We don't need you anymore.
+    resize(0);
+
+    // Tasks still waiting for their timers are broken below with the rest.
+    for(auto& level: timer_wheel)
     {
-        post(task(
-            std::packaged_task<void()>(), // No task for you,
-            std::numeric_limits<unsigned>::max(), // just do it now,
-            true // quit.
-        )); // We don't need you anymore.
+        for(timer_entry* e: level)
+        {
+            while(e)
+            {
+                timer_entry* next = e->next;
+                e->periodic.reset();
+                recycler<timer_entry>::release(e);
+                e = next;
+            }
+        }
     }
-    for(std::thread& thread: threads)
+
+    // Tasks that never got to run break their promises here. Their waiters
+    // may be in any block, so all of them are broken before any block is
+    // freed.
+    destroying = true;
+    for(unsigned i = 0; i < task_block_count; ++i)
     {
-        thread.join();
+        task* block = task_blocks[i];
+        for(unsigned j = 0; j < TASK_BLOCK_SIZE; ++j)
+        {
+            release_task_data(&block[j]);
+        }
     }
+    for(unsigned i = 0; i < task_block_count; ++i) delete [] task_blocks[i];
 }
 
-void thread_pool::resize(unsigned thread_count)
+void thread_pool::resize(unsigned thread_count, bool wait)
 {
-    // smaller
-    if(thread_count < threads.size())
-    {
-        std::atomic_uint threads_to_exit(threads.size() - thread_count);
-        std::vector<std::thread::id> exited_thread_ids(threads_to_exit);
+    std::lock_guard<std::mutex> resize_lock(resize_mutex);
+    reap_workers();
 
-        std::mutex finished_mutex;
-        std::unique_lock<std::mutex> finished_lock(finished_mutex);
-        std::condition_variable finished;
+    unsigned current = 0;
+    {
+        std::shared_lock<std::shared_timed_mutex> lk(workers_mutex);
+        current = workers.size() - retiring;
+    }
 
-        unsigned tmp_threads_to_exit = threads_to_exit;
-        for(unsigned i = 0; i < tmp_threads_to_exit; ++i)
+    // smaller
+    if(thread_count < current)
+    {
+        // No task for you, just do it now, quit. Whichever workers get to
+        // these first leave.
+        retiring += current - thread_count;
+        for(unsigned i = thread_count; i < current; ++i)
         {
-            std::thread::id& id = exited_thread_ids[i];
-            post(task(
-                [&id, &threads_to_exit, &finished]()
-                {
-                    id = std::this_thread::get_id();
-                    if(--threads_to_exit == 0)
-                    {
-                        finished.notify_all();
-                    }
-                },
-                std::numeric_limits<unsigned>::max(),
-                true
-            ));
-        }
-
-        finished.wait(
-            finished_lock,
-            [&threads_to_exit]{return threads_to_exit == 0;}
-        );
-
-        for(unsigned i = 0; i < threads.size(); ++i)
+            post(create_task(std::numeric_limits<unsigned>::max(), true));
+        }
+    }
+    // bigger
+    else if(thread_count > current)
+    {
+        std::unique_lock<std::shared_timed_mutex> lk(workers_mutex);
+        unsigned threads_to_add = thread_count - current;
+        while(threads_to_add--)
         {
-            for(std::thread::id id: exited_thread_ids)
+            // Numbers freed by shrinking are reused, so that the CPUs of
+            // removed workers get filled first.
+            std::vector<bool> taken(workers.size() + 1, false);
+            for(const std::unique_ptr<worker>& other: workers)
             {
-                std::thread& thread = threads[i];
-                if(id == thread.get_id())
-                {
-                    thread.join();
-                    threads.erase(threads.begin() + i);
-                    --i;
-                    break;
-                }
+                if(other->number < taken.size()) taken[other->number] = true;
             }
+            unsigned number = std::find(taken.begin(), taken.end(), false) -
+                taken.begin();
+
+            workers.emplace_back(new worker(this));
+            worker* w = workers.back().get();
+            w->number = number;
+            w->cpu = placement_cpus.empty() ? -1 :
+                placement_cpus[number % placement_cpus.size()];
+            w->thread = std::thread(&thread_pool::execute_loop, this, w);
         }
+        worker_count = workers.size();
     }
-    // bigger
-    else if(thread_count > threads.size())
+
+    if(wait)
     {
-        unsigned threads_to_add = thread_count - threads.size();
-        while(threads_to_add--)
-            threads.emplace_back(std::bind(&thread_pool::execute_loop, this));
+        std::unique_lock<std::mutex> lk(retire_mutex);
+        workers_retired.wait(lk, [this]{ return retiring == 0; });
+        lk.unlock();
+        reap_workers();
+    }
+}
+
+void thread_pool::reap_workers()
+{
+    std::vector<std::unique_ptr<worker>> reaped;
+    {
+        std::unique_lock<std::shared_timed_mutex> lk(workers_mutex);
+        reaped.swap(retired_workers);
+    }
+    for(std::unique_ptr<worker>& w: reaped)
+    {
+        w->thread.join();
     }
 }
 
 unsigned thread_pool::size() const
 {
-    return threads.size();
+    return worker_count;
 }
 
 unsigned thread_pool::busy() const
@@ -120,139 +220,1865 @@ unsigned thread_pool::busy() const
     return busy_threads;
 }
 
-thread_pool::task_id thread_pool::post(
-    thread_pool::task&& t,
-    const std::set<task_id>& dependencies
+thread_pool::scheduling thread_pool::get_scheduling() const
+{
+    return mode;
+}
+
+thread_pool::lane thread_pool::get_lane(unsigned priority)
+{
+    if(priority >= PRIORITY_HIGH) return LANE_FRAME;
+    if(priority >= PRIORITY_MEDIUM) return LANE_NORMAL;
+    return LANE_BACKGROUND;
+}
+
+void thread_pool::set_lane_limits(
+    lane l,
+    unsigned reserved,
+    unsigned max_workers
+){
+    max_workers = std::max(max_workers, 1u);
+    lanes[l].max_workers = max_workers;
+    lanes[l].reserved = std::min(reserved, max_workers);
+    lanes_limited = true;
+
+    // Loosened limits may let sleeping workers run something.
+    schedule_changes++;
+    std::lock_guard<std::mutex> lk(sleep_mutex);
+    new_task.notify_all();
+}
+
+void thread_pool::set_lane_aging(unsigned skips)
+{
+    lane_aging = skips;
+}
+
+void thread_pool::set_idle_spin(
+    std::chrono::nanoseconds spin,
+    std::chrono::nanoseconds yield
 ){
-    t.id = id_counter++;
-    all_tasks.insert(t.id);
-    if(dependencies.empty())
+    idle_spin_ns = std::max(spin.count(), (int64_t)0);
+    idle_yield_ns = std::max(yield.count(), (int64_t)0);
+}
+
+void thread_pool::set_idle_park(bool park)
+{
+    idle_park = park;
+}
+
+static std::vector<unsigned> read_cpu_list(const std::string& path)
+{
+    // Lists look like "0-3,8,10-11".
+    std::vector<unsigned> cpus;
+    std::ifstream f(path);
+    std::string range;
+    while(std::getline(f, range, ','))
     {
-        queue_task(std::move(t));
-        return t.id;
+        std::stringstream ss(range);
+        unsigned first = 0, last = 0;
+        char dash = 0;
+        if(!(ss >> first)) continue;
+        if(!(ss >> dash >> last) || dash != '-') last = first;
+        for(unsigned cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
     }
+    return cpus;
+}
 
-    std::lock_guard<std::mutex> lock(pending_tasks_mutex);
-    std::set_intersection(
-        all_tasks.begin(),
-        all_tasks.end(),
-        dependencies.begin(),
-        dependencies.end(),
-        std::inserter(t.dependencies, t.dependencies.end())
-    );
-    if(t.dependencies.empty())
+static unsigned read_number(const std::string& path, unsigned fallback)
+{
+    std::ifstream f(path);
+    unsigned value = 0;
+    return f >> value ? value : fallback;
+}
+
+#ifdef __linux__
+static void set_affinity(pthread_t thread, const std::vector<unsigned>& cpus)
+{
+    if(cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(unsigned cpu: cpus)
     {
-        queue_task(std::move(t));
+        if(cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
     }
-    else
+    // Failing only costs locality, so it's not worth an exception.
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+#endif
+
+std::vector<thread_pool::cpu_info> thread_pool::read_cpu_topology(
+    const std::string& sysfs_root
+){
+    std::vector<cpu_info> cpus;
+    for(unsigned id: read_cpu_list(sysfs_root + "/cpu/online"))
+    {
+        std::string topology =
+            sysfs_root + "/cpu/cpu" + std::to_string(id) + "/topology/";
+        cpus.push_back(cpu_info{
+            id,
+            read_number(topology + "core_id", id),
+            read_number(topology + "physical_package_id", 0),
+            0
+        });
+    }
+
+    // Machines without NUMA may not have the nodes at all.
+    for(unsigned node: read_cpu_list(sysfs_root + "/node/online"))
     {
-        pending_tasks.emplace_back(std::move(t));
+        std::string cpulist =
+            sysfs_root + "/node/node" + std::to_string(node) + "/cpulist";
+        for(unsigned id: read_cpu_list(cpulist))
+        {
+            for(cpu_info& cpu: cpus)
+            {
+                if(cpu.id == id) cpu.node = node;
+            }
+        }
     }
-    return t.id;
+    return cpus;
 }
 
-void thread_pool::execute_loop()
-{
-    bool finished = false;
-    while(!finished)
+std::vector<unsigned> thread_pool::plan_placement(
+    placement p,
+    const std::vector<cpu_info>& cpus
+){
+    std::vector<unsigned> plan;
+    if(p == PLACE_ANYWHERE) return plan;
+
+    // Hardware threads are ranked within their core, so that the first
+    // thread of every core comes before any second ones.
+    std::vector<std::tuple<unsigned, unsigned, unsigned>> order;
+    std::map<std::pair<unsigned, unsigned>, unsigned> core_threads;
+    std::vector<cpu_info> sorted(cpus);
+    std::sort(
+        sorted.begin(),
+        sorted.end(),
+        [](const cpu_info& a, const cpu_info& b){ return a.id < b.id; }
+    );
+    for(const cpu_info& cpu: sorted)
+    {
+        unsigned rank = core_threads[{cpu.package, cpu.core}]++;
+        order.emplace_back(cpu.node, rank, cpu.id);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::map<unsigned, std::vector<unsigned>> nodes;
+    for(const auto& o: order) nodes[std::get<0>(o)].push_back(std::get<2>(o));
+
+    if(p == PLACE_COMPACT)
     {
-        std::unique_lock<std::mutex> lk(tasks_mutex);
-        if(busy_threads == 0 && tasks_queue.empty())
+        for(const auto& node: nodes)
         {
-            no_tasks_running.notify_all();
+            plan.insert(plan.end(), node.second.begin(), node.second.end());
         }
-        while(tasks_queue.empty())
+        return plan;
+    }
+
+    for(size_t i = 0; plan.size() < order.size(); ++i)
+    {
+        for(const auto& node: nodes)
         {
-            new_task.wait(lk);
+            if(i < node.second.size()) plan.push_back(node.second[i]);
         }
-        busy_threads++;
-        task todo(std::move(const_cast<task&>(tasks_queue.top())));
-        tasks_queue.pop();
-        lk.unlock();
+    }
+    return plan;
+}
 
-        finished = todo.finish_thread;
+void thread_pool::set_placement(
+    placement p,
+    const std::vector<cpu_info>& cpus
+){
+    std::unique_lock<std::shared_timed_mutex> lk(workers_mutex);
+    place = p;
+    placement_cpus = plan_placement(p, cpus);
+    allowed_cpus.clear();
+    for(const cpu_info& cpu: cpus) allowed_cpus.push_back(cpu.id);
 
-        try
+    for(std::unique_ptr<worker>& w: workers)
+    {
+        w->cpu = placement_cpus.empty() ? -1 :
+            placement_cpus[w->number % placement_cpus.size()];
+        apply_placement(w->thread.native_handle(), w->cpu);
+    }
+}
+
+thread_pool::placement thread_pool::get_placement() const
+{
+    std::shared_lock<std::shared_timed_mutex> lk(workers_mutex);
+    return place;
+}
+
+void thread_pool::set_autoscale(const autoscale_params& params)
+{
+    stop_autoscale();
+    autoscale = params;
+    autoscale.max_threads = std::max(params.max_threads, params.min_threads);
+    autoscale_stop = false;
+    max_wait_ns = 0;
+    autoscaling = true;
+    autoscale_thread = std::thread(&thread_pool::autoscale_loop, this);
+}
+
+void thread_pool::stop_autoscale()
+{
+    if(!autoscale_thread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lk(autoscale_mutex);
+        autoscale_stop = true;
+        autoscale_wake.notify_all();
+    }
+    autoscale_thread.join();
+    autoscaling = false;
+}
+
+void thread_pool::autoscale_loop()
+{
+    const autoscale_params& params = autoscale;
+    int64_t grow_wait =
+        std::chrono::nanoseconds(params.grow_wait).count();
+    unsigned overloaded_intervals = 0;
+    unsigned quiet_intervals = 0;
+    double busy_sum = 0;
+
+    std::unique_lock<std::mutex> lk(autoscale_mutex);
+    while(!autoscale_wake.wait_for(
+        lk,
+        params.interval,
+        [this]{ return autoscale_stop; }
+    )){
+        reap_workers();
+
+        unsigned current = 0;
         {
-            if(todo.task_func.valid()) todo.task_func();
+            std::shared_lock<std::shared_timed_mutex> workers_lk(
+                workers_mutex
+            );
+            current = workers.size() - retiring;
+        }
 
-            std::lock_guard<std::mutex> lock(pending_tasks_mutex);
-            on_finish_task(todo.id);
+        int64_t wait = max_wait_ns.exchange(0);
+        unsigned queued = queued_tasks;
+        bool overloaded = wait > grow_wait ||
+            queued > params.grow_queued_per_thread * std::max(current, 1u);
+        double busy = current == 0 ? 1.0 :
+            std::min((double)busy_threads / current, 1.0);
+
+        // Either way, the load has to stay put for a while before anything
+        // changes, so that short bursts don't make the pool flap.
+        unsigned target = current;
+        if(overloaded)
+        {
+            quiet_intervals = 0;
+            busy_sum = 0;
+            if(++overloaded_intervals >= params.grow_after)
+            {
+                overloaded_intervals = 0;
+                target++;
+            }
         }
-        catch(std::exception& ex)
+        else
         {
-            std::cerr << ex.what() << std::endl;
+            overloaded_intervals = 0;
+            busy_sum += busy;
+            if(++quiet_intervals >= params.shrink_after)
+            {
+                if(busy_sum / quiet_intervals < params.shrink_busy) target--;
+                quiet_intervals = 0;
+                busy_sum = 0;
+            }
+        }
+        target = std::min(
+            std::max(target, params.min_threads),
+            params.max_threads
+        );
 
-            std::lock_guard<std::mutex> lock(pending_tasks_mutex);
-            on_fail_task(todo.id);
+        if(target != current)
+        {
+            lk.unlock();
+            resize(target, false);
+            lk.lock();
         }
-        --busy_threads;
     }
 }
 
-void thread_pool::queue_task(thread_pool::task&& t)
+void thread_pool::note_wait(task* t)
 {
-    if(threads.size() == 0)
+    if(t->queued_ns == 0) return;
+    int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count() - t->queued_ns;
+
+    int64_t longest = max_wait_ns;
+    while(wait > longest && !max_wait_ns.compare_exchange_weak(longest, wait));
+}
+
+void thread_pool::apply_placement(
+    std::thread::native_handle_type thread,
+    int cpu
+){
+#ifdef __linux__
+    if(cpu >= 0) set_affinity(thread, {(unsigned)cpu});
+    else set_affinity(thread, allowed_cpus);
+#else
+    (void)thread;
+    (void)cpu;
+#endif
+}
+
+thread_pool::task* thread_pool::create_task(
+    unsigned priority,
+    bool finish_thread
+){
+    worker* self = current_worker;
+    if(self && self->pool != this) self = nullptr;
+
+    task* t = nullptr;
+    if(self && !self->free_tasks.empty())
     {
-        t.task_func();
+        t = self->free_tasks.back();
+        self->free_tasks.pop_back();
     }
     else
     {
-        tasks_mutex.lock();
-        tasks_queue.push(std::move(t));
-        tasks_mutex.unlock();
-        new_task.notify_one();
+        std::lock_guard<std::mutex> lock(free_tasks_mutex);
+        if(free_tasks.empty())
+        {
+            if(task_block_count == MAX_TASK_BLOCKS)
+            {
+                throw std::runtime_error(
+                    "thread_pool: Too many tasks in flight"
+                );
+            }
+            // Ids start at generation 1, so that 0 is never a valid id.
+            task* block = new task[TASK_BLOCK_SIZE];
+            task_id base = (task_id)task_block_count << TASK_BLOCK_BITS;
+            for(unsigned i = TASK_BLOCK_SIZE; i > 0; --i)
+            {
+                block[i-1].id = (1ull << 32) | (base + i - 1);
+                block[i-1].pool = this;
+                free_tasks.push_back(&block[i-1]);
+            }
+            task_blocks[task_block_count++] = block;
+        }
+        t = free_tasks.back();
+        free_tasks.pop_back();
+
+        // Workers take a whole batch at once so that they rarely need the
+        // lock.
+        if(self)
+        {
+            size_t count = std::min(free_tasks.size(), FREE_TASK_BATCH_SIZE);
+            self->free_tasks.insert(
+                self->free_tasks.end(),
+                free_tasks.end() - count,
+                free_tasks.end()
+            );
+            free_tasks.resize(free_tasks.size() - count);
+        }
+    }
+
+    t->priority = priority;
+    t->finish_thread = finish_thread;
+    t->unfinished_dependencies = 1;
+    t->failed = false;
+    t->claimed = false;
+    t->keyed = false;
+    t->main_thread = false;
+    t->queued_ns = 0;
+    t->finished = false;
+    t->edge_count = 0;
+    return t;
+}
+
+void thread_pool::reserve_edges(task* t, size_t count)
+{
+    // Edges are reserved up front, since they can't move once linked.
+    size_t extra_needed = count > task::INLINE_EDGES ?
+        count - task::INLINE_EDGES : 0;
+    if(extra_needed > t->extra_edge_count)
+    {
+        t->extra_edges.reset(new edge[extra_needed]);
+        t->extra_edge_count = extra_needed;
+    }
+}
+
+thread_pool::task* thread_pool::find_task(task_id id)
+{
+    uint32_t index = id;
+    if(index >> TASK_BLOCK_BITS >= MAX_TASK_BLOCKS) return nullptr;
+
+    task* block = task_blocks[index >> TASK_BLOCK_BITS];
+    if(!block) return nullptr;
+
+    task* t = &block[index & (TASK_BLOCK_SIZE - 1)];
+    return t->id == id ? t : nullptr;
+}
+
+void thread_pool::release_task_data(task* t)
+{
+    if(t->destroy) t->destroy(t);
+    t->invoke = nullptr;
+    t->destroy = nullptr;
+
+    if(t->result)
+    {
+        t->result->complete();
+        t->result->remove_reference();
+        t->result = nullptr;
     }
 }
 
-void thread_pool::on_finish_task(task_id id)
+void thread_pool::destroy_task(task* t)
 {
-    all_tasks.erase(id);
-    for(size_t i = 0; i < pending_tasks.size(); ++i)
+    release_task_data(t);
+    // Bumping the generation invalidates the old id.
+    t->id += 1ull << 32;
+
+    worker* self = current_worker;
+    if(self && self->pool == this)
+    {
+        self->free_tasks.push_back(t);
+        if(self->free_tasks.size() < 2 * FREE_TASK_BATCH_SIZE) return;
+
+        std::lock_guard<std::mutex> lock(free_tasks_mutex);
+        free_tasks.insert(
+            free_tasks.end(),
+            self->free_tasks.end() - FREE_TASK_BATCH_SIZE,
+            self->free_tasks.end()
+        );
+        self->free_tasks.resize(self->free_tasks.size() - FREE_TASK_BATCH_SIZE);
+    }
+    else
+    {
+        std::lock_guard<std::mutex> lock(free_tasks_mutex);
+        free_tasks.push_back(t);
+    }
+}
+
+thread_pool::task_id thread_pool::post(
+    task* t,
+    dependency_list dependencies
+){
+    task_id id = t->id;
+#ifdef THREAD_POOL_TRACING
+    t->posted_time = trace_time();
+#endif
+    reserve_edges(t, dependencies.size());
+
+    size_t edge_count = 0;
+    for(task_id dep_id: dependencies)
+    {
+        task* dep = find_task(dep_id);
+        if(!dep) continue;
+
+        // The slot may have been recycled since find_task, so check the id
+        // again while holding the lock.
+        std::lock_guard<std::mutex> lock(dep->successors_mutex);
+        if(dep->id == dep_id && !dep->finished)
+        {
+            edge& e = t->edge_at(edge_count++);
+            e.successor = t;
+            e.dependency = dep_id;
+            e.next = dep->successors;
+            dep->successors = &e;
+            t->unfinished_dependencies++;
+        }
+    }
+
+    t->edge_count = edge_count;
+
+    // Drop the reference held while posting, the task may be queued by a
+    // finishing dependency from here on.
+    release_task(t);
+    return id;
+}
+
+thread_pool::task_id thread_pool::post_when(
+    task* t,
+    basic_result_state* const* states,
+    size_t count
+){
+    task_id id = t->id;
+#ifdef THREAD_POOL_TRACING
+    t->posted_time = trace_time();
+#endif
+    reserve_edges(t, count);
+
+    for(size_t i = 0; i < count; ++i)
     {
-        task& t = pending_tasks[i];
-        t.dependencies.erase(id);
-        if(t.dependencies.empty())
+        edge& e = t->edge_at(i);
+        e.successor = t;
+        e.dependency = 0;
+        // Counted first, since the state may complete right after linking.
+        t->unfinished_dependencies++;
+        if(!states[i]->add_waiter(e))
         {
-            queue_task(std::move(t));
-            pending_tasks.erase(pending_tasks.begin()+i);
-            --i;
+            t->unfinished_dependencies--;
         }
     }
+
+    release_task(t);
+    return id;
 }
 
-bool thread_pool::on_fail_task(task_id id)
+void thread_pool::execute_loop(worker* self)
 {
-    all_tasks.erase(id);
-    bool had_children = false;
-    for(size_t i = 0; i < pending_tasks.size(); ++i)
+    current_worker = self;
+#ifdef __linux__
+    // Names are limited to 15 characters.
+    std::string name = "worker " + std::to_string(self->number);
+    pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    {
+        // Before anything is allocated, so that it's allocated on the right
+        // NUMA node.
+        std::shared_lock<std::shared_timed_mutex> lk(workers_mutex);
+        if(self->cpu >= 0) apply_placement(pthread_self(), self->cpu);
+    }
+#endif
+
+    bool finished = false;
+    while(!finished)
     {
-        task& t = pending_tasks[i];
-        if(t.dependencies.count(id))
+        poll_timers();
+
+        // Read before looking for tasks, so that nothing that changes after
+        // the search can be slept through.
+        unsigned changes = schedule_changes;
+        // Running tasks aren't counted at all until some lane has limits.
+        bool limited = lanes_limited;
+        task* todo = nullptr;
+        if(!pop_task(self, todo, limited))
         {
-            had_children = true;
-            task_id child_id = t.id;
-            pending_tasks.erase(pending_tasks.begin()+i);
-            if(on_fail_task(child_id))
+            if(idle_spin(changes)) continue;
+
+            std::unique_lock<std::mutex> lk(sleep_mutex);
+            sleeping_threads++;
+            // One sleeper wakes up for the next timer, the rest only for
+            // tasks.
+            bool keeper = timer_count != 0 && !timer_keeper.exchange(true);
+            while(schedule_changes == changes)
             {
-                i = 0;
+                uint64_t tick = next_timer_tick;
+                if(!keeper || tick == std::numeric_limits<uint64_t>::max())
+                {
+                    new_task.wait(lk);
+                }
+                else if(
+                    new_task.wait_until(lk, from_tick(tick)) ==
+                    std::cv_status::timeout
+                ) break;
             }
+            if(keeper) timer_keeper = false;
+            sleeping_threads--;
+            continue;
+        }
+
+        // Whoever posted this may have left the sleepers alone because we
+        // were spinning, so pass the rest on.
+        if(
+            queued_tasks != 0 && sleeping_threads != 0 &&
+            spinning_threads == 0
+        ){
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            new_task.notify_one();
+        }
+
+        if(autoscaling) note_wait(todo);
+
+        lane l = get_lane(todo->priority);
+        finished = todo->finish_thread;
+        run_task(todo);
+
+        if(limited && !finished) release_lane(l);
+        release_busy();
+    }
+
+    // Hand whatever is left in our own queues over to the others.
+    for(unsigned l = 0; l < LANE_COUNT; ++l)
+    {
+        task* left = nullptr;
+        while(self->queues[l].pop(left))
+        {
+            lanes[l].shared_queue.push(left);
         }
     }
-    return had_children;
+    if(sleeping_threads != 0)
+    {
+        std::lock_guard<std::mutex> lk(sleep_mutex);
+        new_task.notify_all();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(free_tasks_mutex);
+        free_tasks.insert(
+            free_tasks.end(),
+            self->free_tasks.begin(),
+            self->free_tasks.end()
+        );
+        self->free_tasks.clear();
+    }
+
+    // Whoever resizes next joins the thread.
+    {
+        std::unique_lock<std::shared_timed_mutex> lk(workers_mutex);
+        for(auto it = workers.begin(); it != workers.end(); ++it)
+        {
+            if(it->get() != self) continue;
+            retired_workers.push_back(std::move(*it));
+            workers.erase(it);
+            break;
+        }
+        worker_count = workers.size();
+        retiring--;
+    }
+    {
+        std::lock_guard<std::mutex> lk(retire_mutex);
+        workers_retired.notify_all();
+    }
+
+    current_worker = nullptr;
 }
 
-void thread_pool::finish()
+void thread_pool::queue_task(task* t)
 {
-    std::unique_lock<std::mutex> lk(tasks_mutex);
-    if(busy_threads == 0 && tasks_queue.empty()) return;
-    no_tasks_running.wait(
-        lk,
-        [this]{return busy_threads == 0 && tasks_queue.empty();}
+    t->queued_ns = autoscaling ?
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()
+        ).count() : 0;
+#ifdef THREAD_POOL_TRACING
+    t->queued_time = trace_time();
+    trace_buffer* trace = local_trace_buffer();
+    trace_buffer::add(trace->queue_depth, queued_tasks);
+    trace_buffer::add(
+        trace->dependency_wait,
+        t->queued_time - t->posted_time
     );
+#endif
+
+    if(t->main_thread)
+    {
+        // Waits for run_main(), nobody needs to be woken up.
+        main_queue.push(t);
+        return;
+    }
+
+    worker* self = current_worker;
+    if(t->finish_thread)
+    {
+        // Kept out of the lanes, so that their limits can't hold up resizing.
+        exit_queue.push(t);
+    }
+    else
+    {
+        lane l = get_lane(t->priority);
+        if(mode == SCHEDULE_WORK_STEALING && self && self->pool == this)
+        {
+            self->queues[l].push(t);
+        }
+        else lanes[l].shared_queue.push(t);
+        lanes[l].queued++;
+    }
+    queued_tasks++;
+    // Must be incremented before sleeping_threads is read, see execute_loop.
+    schedule_changes++;
+
+    if(worker_count == 0)
+    {
+        run_inline();
+    }
+    else if(sleeping_threads != 0 && spinning_threads == 0)
+    {
+        std::lock_guard<std::mutex> lk(sleep_mutex);
+        new_task.notify_one();
+    }
+}
+
+void thread_pool::run_task(task* t)
+{
+    // Cancelled tasks are dropped like failed ones.
+    bool failed = t->claimed.exchange(true) || t->failed;
+#ifdef THREAD_POOL_TRACING
+    uint64_t start_time = trace_time();
+#endif
+    if(!failed && t->invoke)
+    {
+        try
+        {
+            t->invoke(t);
+        }
+        catch(...)
+        {
+            failed = true;
+            if(t->result)
+            {
+                t->result->exception = std::current_exception();
+            }
+            else
+            {
+                // Nobody would ever see this otherwise.
+                try { throw; }
+                catch(std::exception& ex)
+                {
+                    std::cerr << ex.what() << std::endl;
+                }
+                catch(...)
+                {
+                    std::cerr << "thread_pool: Unknown exception" << std::endl;
+                }
+            }
+        }
+    }
+
+#ifdef THREAD_POOL_TRACING
+    // Exit tasks aren't interesting.
+    if(!t->finish_thread)
+    {
+        trace_event e;
+        e.id = t->id;
+        e.priority = t->priority;
+        e.posted_time = t->posted_time;
+        e.queued_time = t->queued_time;
+        e.start_time = start_time;
+        e.end_time = trace_time();
+        local_trace_buffer()->push(e);
+    }
+#endif
+    finish_task(t, failed);
+}
+
+void thread_pool::run_inline()
+{
+    // Tasks queued by the ones run here are picked up by the same loop instead
+    // of recursing, so long dependency chains don't blow the stack.
+    while(queued_tasks != 0 && !running_inline.exchange(true))
+    {
+        task* t = nullptr;
+        while(pop_shared(t))
+        {
+            unqueue(t);
+            run_task(t);
+        }
+        running_inline = false;
+    }
+}
+
+void thread_pool::unqueue(task* t)
+{
+    if(t->main_thread) return;
+    if(!t->finish_thread) lanes[get_lane(t->priority)].queued--;
+    queued_tasks--;
+}
+
+size_t thread_pool::run_main(std::chrono::nanoseconds budget)
+{
+    main_thread_id = std::this_thread::get_id();
+    poll_timers();
+
+    auto start = std::chrono::steady_clock::now();
+    size_t count = 0;
+    task* t = nullptr;
+    while(main_queue.size != 0 && main_queue.pop(t))
+    {
+        run_task(t);
+        count++;
+        if(std::chrono::steady_clock::now() - start >= budget) break;
+    }
+    return count;
+}
+
+bool thread_pool::pop_shared(task*& t)
+{
+    for(lane_state& ls: lanes)
+    {
+        if(ls.shared_queue.size != 0 && ls.shared_queue.pop(t)) return true;
+    }
+    return false;
+}
+
+bool thread_pool::pop_task(worker* self, task*& t, bool limited)
+{
+    if(exit_queue.size != 0)
+    {
+        busy_threads++;
+        if(exit_queue.pop(t))
+        {
+            unqueue(t);
+            return true;
+        }
+        release_busy();
+    }
+
+    // Lanes are served in order, except for one that has been passed over for
+    // too long.
+    unsigned order[LANE_COUNT];
+    unsigned first = 0;
+    unsigned aging = lane_aging;
+    for(unsigned l = 1; l < LANE_COUNT; ++l)
+    {
+        if(lanes[l].skipped >= aging)
+        {
+            first = l;
+            break;
+        }
+    }
+    order[0] = first;
+    for(unsigned l = 0, i = 1; l < LANE_COUNT; ++l)
+    {
+        if(l != first) order[i++] = l;
+    }
+
+    for(unsigned l: order)
+    {
+        lane_state& ls = lanes[l];
+        if(ls.queued == 0) continue;
+        if(limited && !acquire_lane((lane)l)) continue;
+
+        if(pop_lane(self, (lane)l, t))
+        {
+            if(ls.skipped != 0) ls.skipped = 0;
+            for(unsigned later = l + 1; later < LANE_COUNT; ++later)
+            {
+                if(lanes[later].queued != 0) lanes[later].skipped++;
+            }
+            return true;
+        }
+        if(limited) release_lane((lane)l);
+    }
+    return false;
+}
+
+bool thread_pool::pop_lane(worker* self, lane l, task*& t)
+{
+    // Our own queue comes first, unless the shared queue has something more
+    // urgent.
+    task_queue& own = self->queues[l];
+    task_queue& shared = lanes[l].shared_queue;
+    if(
+        own.size != 0 &&
+        (shared.size == 0 || shared.top_priority <= own.top_priority)
+    ){
+        busy_threads++;
+        if(own.pop(t))
+        {
+            unqueue(t);
+            return true;
+        }
+        release_busy();
+    }
+    if(shared.size != 0)
+    {
+        busy_threads++;
+        if(shared.pop(t))
+        {
+            unqueue(t);
+            return true;
+        }
+        release_busy();
+    }
+    return steal_task(self, l, t);
+}
+
+bool thread_pool::steal_task(worker* self, lane l, task*& t)
+{
+    if(lanes[l].queued == 0) return false;
+
+    std::shared_lock<std::shared_timed_mutex> lk(workers_mutex);
+    size_t count = workers.size();
+    size_t start = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(workers[i].get() == self)
+        {
+            start = i;
+            break;
+        }
+    }
+
+    // busy_threads is incremented before popping so that finish() never sees
+    // the task as neither queued nor running.
+    for(size_t i = 0; i < count; ++i)
+    {
+        task_queue& victim = workers[(start + i) % count]->queues[l];
+        if(victim.size == 0) continue;
+
+        busy_threads++;
+        if(victim.pop(t))
+        {
+            unqueue(t);
+            return true;
+        }
+        release_busy();
+    }
+    return false;
+}
+
+static void cpu_pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
+#endif
+}
+
+bool thread_pool::idle_spin(unsigned changes)
+{
+    if(idle_park) return false;
+    int64_t spin = idle_spin_ns;
+    int64_t total = spin + idle_yield_ns;
+    if(total == 0) return false;
+
+    // A spinner must stop being counted before it goes to sleep, see
+    // queue_task.
+    spinning_threads++;
+    bool changed = false;
+    auto start = std::chrono::steady_clock::now();
+    while(!idle_park)
+    {
+        int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+        if(elapsed >= total) break;
+
+        if(elapsed < spin)
+        {
+            for(unsigned i = 0; i < IDLE_SPIN_BATCH; ++i)
+            {
+                if(schedule_changes != changes) break;
+                cpu_pause();
+            }
+        }
+        else std::this_thread::yield();
+
+        if(schedule_changes != changes || timers_due())
+        {
+            changed = true;
+            break;
+        }
+    }
+    spinning_threads--;
+    return changed;
+}
+
+bool thread_pool::acquire_lane(lane l)
+{
+    lane_state& ls = lanes[l];
+    unsigned running = ls.running;
+    do
+    {
+        if(running >= ls.max_workers) return false;
+        if(running >= ls.reserved && !has_spare_worker(l)) return false;
+    }
+    while(!ls.running.compare_exchange_weak(running, running + 1));
+    return true;
+}
+
+void thread_pool::release_lane(lane l)
+{
+    lanes[l].running--;
+
+    // A worker may be sleeping on a task that was held back by the limits.
+    if(queued_tasks != 0)
+    {
+        schedule_changes++;
+        if(sleeping_threads != 0)
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            new_task.notify_one();
+        }
+    }
+}
+
+bool thread_pool::has_spare_worker(lane l) const
+{
+    unsigned running = 0, owed = 0;
+    for(unsigned i = 0; i < LANE_COUNT; ++i)
+    {
+        unsigned lane_running = lanes[i].running;
+        unsigned reserved = lanes[i].reserved;
+        running += lane_running;
+        if(i != l && lane_running < reserved) owed += reserved - lane_running;
+    }
+    if(owed == 0) return true;
+
+    // The calling worker is one of the idle ones.
+    unsigned count = worker_count;
+    return running < count && count - running > owed;
+}
+
+void thread_pool::release_busy()
+{
+    if(--busy_threads == 0 && queued_tasks == 0)
+    {
+        std::lock_guard<std::mutex> lk(sleep_mutex);
+        no_tasks_running.notify_all();
+    }
+}
+
+bool thread_pool::claim_task(task_id id, unsigned depth, task*& t)
+{
+    task* c = find_task(id);
+    if(!c) return false;
+
+    // Only run_main() may run these. Checked before claiming, since putting
+    // it back would leave a second entry in main_queue.
+    if(c->main_thread) return false;
+
+    task_id expected = id;
+    if(c->queued_id.compare_exchange_strong(expected, 0))
+    {
+        // Wasn't marked yet when checked above.
+        if(c->main_thread)
+        {
+            main_queue.push(c);
+            return false;
+        }
+        t = c;
+        return true;
+    }
+    if(depth == 0) return false;
+
+    // Only the inline edges are looked at, extra ones may be reallocated if
+    // the task is recycled meanwhile.
+    task_id deps[task::INLINE_EDGES];
+    size_t count = std::min(c->edge_count.load(), task::INLINE_EDGES);
+    for(size_t i = 0; i < count; ++i)
+    {
+        deps[i] = c->edges[i].dependency;
+    }
+    // If the task was recycled while reading, the ids mean nothing.
+    if(c->id != id) return false;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(deps[i] && claim_task(deps[i], depth - 1, t)) return true;
+    }
+    return false;
+}
+
+bool thread_pool::help_one(worker* self, task_id awaited)
+{
+    task* t = nullptr;
+    if(awaited && claim_task(awaited, HELP_SEARCH_DEPTH, t))
+    {
+        busy_threads++;
+        unqueue(t);
+    }
+    else if(self)
+    {
+        if(!pop_task(self, t, false)) return false;
+    }
+    else
+    {
+        // Running inline, there are no workers to steal from.
+        if(!pop_shared(t)) return false;
+        busy_threads++;
+        unqueue(t);
+    }
+
+    if(t->finish_thread)
+    {
+        // Threads can only quit from execute_loop, so give it back.
+        queue_task(t);
+        release_busy();
+        return false;
+    }
+
+    run_task(t);
+    release_busy();
+    return true;
+}
+
+void thread_pool::wait_for_result(basic_result_state* state, task_id awaited)
+{
+    worker* self = current_worker;
+    if(self && self->pool != this) self = nullptr;
+
+    // The thread running main thread tasks has to keep doing so, or it may
+    // wait for one of them forever.
+    bool main_thread = !self &&
+        main_thread_id.load() == std::this_thread::get_id();
+
+    // Other threads can just sleep, unless they're the ones running tasks
+    // inline.
+    if(!self && !main_thread && worker_count != 0)
+    {
+        state->wait();
+        return;
+    }
+
+    while(!state->is_ready())
+    {
+        poll_timers();
+        if(main_thread && run_main(std::chrono::nanoseconds(0)) != 0)
+        {
+            continue;
+        }
+        if((self || worker_count == 0) && help_one(self, awaited))
+        {
+            continue;
+        }
+        // The awaited task is running elsewhere, or waiting for something
+        // that is.
+        state->wait_for(HELP_POLL_INTERVAL);
+    }
+}
+
+bool thread_pool::cancel_timer(timer_id id)
+{
+    std::lock_guard<std::mutex> lock(timer_mutex);
+    auto it = periodic_timers.find(id);
+    if(it == periodic_timers.end()) return false;
+
+    // The entry in the wheel is dropped when it comes up next.
+    it->second->cancelled = true;
+    periodic_timers.erase(it);
+    return true;
+}
+
+uint64_t thread_pool::to_tick(clock::time_point time, bool round_up) const
+{
+    int64_t since = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        time - timer_epoch
+    ).count();
+    if(since <= 0) return 0;
+
+    int64_t tick = std::chrono::nanoseconds(TIMER_TICK).count();
+    return round_up ? (since + tick - 1) / tick : since / tick;
+}
+
+thread_pool::clock::time_point thread_pool::from_tick(uint64_t tick) const
+{
+    return timer_epoch + TIMER_TICK * (int64_t)tick;
+}
+
+void thread_pool::add_timer(timer_entry* e)
+{
+    bool earliest = false;
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        // The slot for timer_tick has already been handled.
+        e->deadline = std::max(e->deadline, timer_tick + 1);
+        insert_timer(e);
+        timer_count++;
+        if(e->deadline < next_timer_tick)
+        {
+            next_timer_tick = e->deadline;
+            earliest = true;
+        }
+    }
+
+    // Whoever sleeps until the next timer would sleep through this one.
+    if(earliest)
+    {
+        schedule_changes++;
+        if(sleeping_threads != 0)
+        {
+            std::lock_guard<std::mutex> lk(sleep_mutex);
+            new_task.notify_all();
+        }
+    }
+}
+
+void thread_pool::insert_timer(timer_entry* e)
+{
+    uint64_t delta = e->deadline - timer_tick;
+    unsigned level = 0;
+    while(
+        level + 1 < TIMER_LEVELS &&
+        delta >> (TIMER_SLOT_BITS * (level + 1)) != 0
+    ) level++;
+
+    // Anything beyond the top level waits in its last slot and is put back
+    // when that comes up.
+    uint64_t slot_tick = e->deadline;
+    uint64_t span = 1ull << (TIMER_SLOT_BITS * TIMER_LEVELS);
+    if(delta >= span) slot_tick = timer_tick + span - 1;
+
+    timer_entry*& slot = timer_wheel[level][
+        (slot_tick >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)
+    ];
+    e->next = slot;
+    slot = e;
+}
+
+uint64_t thread_pool::next_timer_event() const
+{
+    // Slots of higher levels are looked at when the levels below them wrap
+    // around. A slot can be a full turn ahead of the current one, so that is
+    // checked too.
+    uint64_t next = std::numeric_limits<uint64_t>::max();
+    for(unsigned level = 0; level < TIMER_LEVELS; ++level)
+    {
+        unsigned shift = TIMER_SLOT_BITS * level;
+        uint64_t index = timer_tick >> shift;
+        for(uint64_t i = index + 1; i <= index + TIMER_SLOTS; ++i)
+        {
+            if(timer_wheel[level][i & (TIMER_SLOTS - 1)])
+            {
+                next = std::min(next, i << shift);
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+bool thread_pool::timers_due() const
+{
+    return timer_count != 0 &&
+        to_tick(clock::now(), false) >= next_timer_tick;
+}
+
+void thread_pool::poll_timers()
+{
+    if(!timers_due()) return;
+    std::unique_lock<std::mutex> lock(timer_mutex, std::try_to_lock);
+    if(!lock.owns_lock()) return;
+
+    uint64_t now = to_tick(clock::now(), false);
+    // Kept in the order they came due.
+    timer_entry* expired = nullptr;
+    timer_entry** expired_end = &expired;
+    for(;;)
+    {
+        // Empty stretches of the wheel are skipped over entirely.
+        uint64_t tick = next_timer_event();
+        if(tick > now)
+        {
+            next_timer_tick = tick;
+            break;
+        }
+        timer_tick = tick;
+
+        // Higher levels first, since they may refill the slots below.
+        for(unsigned level = TIMER_LEVELS - 1; level > 0; --level)
+        {
+            unsigned shift = TIMER_SLOT_BITS * level;
+            if(tick & ((1ull << shift) - 1)) continue;
+
+            timer_entry*& slot =
+                timer_wheel[level][(tick >> shift) & (TIMER_SLOTS - 1)];
+            timer_entry* e = slot;
+            slot = nullptr;
+            while(e)
+            {
+                timer_entry* next = e->next;
+                insert_timer(e);
+                e = next;
+            }
+        }
+
+        timer_entry*& slot = timer_wheel[0][tick & (TIMER_SLOTS - 1)];
+        *expired_end = slot;
+        while(*expired_end) expired_end = &(*expired_end)->next;
+        slot = nullptr;
+    }
+    timer_tick = std::max(timer_tick, now);
+    lock.unlock();
+
+    // Posting may run tasks inline, and those may add timers.
+    while(expired)
+    {
+        timer_entry* next = expired->next;
+        fire_timer(expired);
+        expired = next;
+    }
+}
+
+void thread_pool::fire_timer(timer_entry* e)
+{
+    timer_count--;
+    if(e->t)
+    {
+        task* t = e->t;
+        recycler<timer_entry>::release(e);
+        post(t);
+        return;
+    }
+
+    std::shared_ptr<periodic_timer> p = e->periodic;
+    if(p->cancelled)
+    {
+        e->periodic.reset();
+        recycler<timer_entry>::release(e);
+        return;
+    }
+
+    postf({}, p->priority, [p](){ p->function(); });
+    // Rounds that were missed are skipped rather than caught up with.
+    e->deadline = std::max(
+        e->deadline + p->period,
+        to_tick(clock::now(), false) + 1
+    );
+    add_timer(e);
+}
+
+void thread_pool::finish_task(task* t, bool failed)
+{
+    if(t->keyed)
+    {
+        std::lock_guard<std::mutex> lock(coalescing_mutex);
+        auto it = coalescing_tasks.find(t->key);
+        if(it != coalescing_tasks.end() && it->second == t->id)
+        {
+            coalescing_tasks.erase(it);
+        }
+    }
+
+    edge* successors = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(t->successors_mutex);
+        t->finished = true;
+        successors = t->successors;
+        t->successors = nullptr;
+    }
+
+    destroy_task(t);
+
+    while(successors)
+    {
+        // The edge belongs to the successor, which may be gone as soon as it
+        // has been released.
+        edge* next = successors->next;
+        task* s = successors->successor;
+        if(failed) s->failed = true;
+        release_task(s);
+        successors = next;
+    }
+}
+
+void thread_pool::release_task(task* t)
+{
+    if(--t->unfinished_dependencies == 0 && !destroying)
+    {
+        queue_task(t);
+    }
+}
+
+bool thread_pool::should_split() const
+{
+    if(worker_count == 0) return false;
+
+    // Only split when the last piece has already been taken, so that there's
+    // never more than one piece per thread waiting in the queue.
+    // Pieces are posted with PRIORITY_LOW.
+    lane l = get_lane(PRIORITY_LOW);
+    worker* self = current_worker;
+    if(mode == SCHEDULE_WORK_STEALING && self && self->pool == this)
+    {
+        return self->queues[l].size == 0;
+    }
+    return lanes[l].shared_queue.size == 0;
+}
+
+size_t thread_pool::default_grain(size_t size) const
+{
+    // A few pieces per thread, so that uneven pieces still balance out.
+    return std::max(size / (8 * (worker_count + 1)), (size_t)1);
+}
+
+thread_pool::split_job* thread_pool::fork_job(
+    void (*run)(split_job* job),
+    void* context,
+    void* output,
+    size_t begin,
+    size_t end
+){
+    split_job* job = recycler<split_job>::acquire();
+    // One reference for the task, one for the thread joining it.
+    job->references = 2;
+    job->state = split_job::JOB_PENDING;
+    job->run = run;
+    job->context = context;
+    job->output = output;
+    job->begin = begin;
+    job->end = end;
+
+    try
+    {
+        postf({}, PRIORITY_LOW, [job](){
+            if(job->claim())
+            {
+                job->run(job);
+                job->state = split_job::JOB_DONE;
+            }
+            job->remove_reference();
+        });
+    }
+    catch(...)
+    {
+        recycler<split_job>::release(job);
+        throw;
+    }
+    return job;
+}
+
+void thread_pool::join_job(split_job* job)
+{
+    if(job->claim())
+    {
+        job->run(job);
+        job->state = split_job::JOB_DONE;
+    }
+    else
+    {
+        // Someone is already running it, so this won't take long.
+        while(job->state != split_job::JOB_DONE)
+        {
+            std::this_thread::yield();
+        }
+    }
+    job->remove_reference();
+}
+
+thread_pool::schedule_awaiter thread_pool::schedule(unsigned priority)
+{
+    return schedule_awaiter(this, priority);
+}
+
+bool thread_pool::cancel(task_id id)
+{
+    task* t = find_task(id);
+    if(!t) return false;
+
+    {
+        // The task can't finish and be recycled while this is held.
+        std::lock_guard<std::mutex> lock(t->successors_mutex);
+        if(t->id != id || t->finished || t->claimed.exchange(true))
+        {
+            return false;
+        }
+    }
+
+    // If it's queued, drop it right away. Otherwise it's either waiting for
+    // its dependencies or just being popped, and gets dropped when run.
+    task_id expected = id;
+    if(t->queued_id.compare_exchange_strong(expected, 0))
+    {
+        busy_threads++;
+        unqueue(t);
+        finish_task(t, true);
+        release_busy();
+    }
+    return true;
+}
+
+void thread_pool::finish()
+{
+    std::unique_lock<std::mutex> lk(sleep_mutex);
+    no_tasks_running.wait(
+        lk,
+        [this]{return busy_threads == 0 && queued_tasks == 0;}
+    );
+}
+
+thread_pool::autoscale_params::autoscale_params()
+: min_threads(1),
+  max_threads(std::max(std::thread::hardware_concurrency(), 1u)),
+  interval(10), grow_wait(2000), grow_queued_per_thread(4), grow_after(2),
+  shrink_busy(0.25), shrink_after(100) {}
+
+thread_pool::periodic_timer::periodic_timer()
+: priority(0), period(1), cancelled(false) {}
+
+thread_pool::task::task()
+: pool(nullptr), invoke(nullptr), destroy(nullptr), result(nullptr), id(0),
+  queued_id(0), priority(0), finish_thread(false), unfinished_dependencies(0),
+  failed(false), claimed(false), keyed(false), key(0), main_thread(false),
+  queued_ns(0),
+  successors(nullptr), finished(false), extra_edge_count(0), edge_count(0) {}
+
+thread_pool::edge& thread_pool::task::edge_at(size_t index)
+{
+    return index < INLINE_EDGES ?
+        edges[index] : extra_edges[index - INLINE_EDGES];
+}
+
+bool thread_pool::task_compare::operator()(
+    const queue_entry& a,
+    const queue_entry& b
+) const
+{
+    if(a.priority != b.priority) return a.priority < b.priority;
+    return a.sequence > b.sequence;
+}
+
+thread_pool::task_queue::task_queue()
+: size(0), top_priority(0), pushed(0)
+{
+    std::vector<queue_entry> storage;
+    storage.reserve(INITIAL_CAPACITY);
+    tasks = decltype(tasks)(task_compare(), std::move(storage));
+}
+
+void thread_pool::task_queue::push(task* t)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    task_id id = t->id;
+    t->queued_id = id;
+    tasks.push(queue_entry{t, id, t->priority, pushed++});
+    top_priority = tasks.top().priority;
+    size++;
+}
+
+bool thread_pool::task_queue::pop(task*& t)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    while(!tasks.empty())
+    {
+        queue_entry e = tasks.top();
+        tasks.pop();
+        top_priority = tasks.empty() ? 0 : tasks.top().priority;
+        size--;
+
+        task_id expected = e.id;
+        if(e.t->queued_id.compare_exchange_strong(expected, 0))
+        {
+            t = e.t;
+            return true;
+        }
+    }
+    return false;
+}
+
+thread_pool::lane_state::lane_state()
+: queued(0), running(0), reserved(0),
+  max_workers(std::numeric_limits<unsigned>::max()), skipped(0) {}
+
+thread_pool::worker::worker(thread_pool* pool)
+: pool(pool), number(0), cpu(-1)
+{
+    free_tasks.reserve(2 * FREE_TASK_BATCH_SIZE);
+}
+
+thread_pool::basic_result_state::basic_result_state()
+: references(0), ready(false), has_value(false), priority(PRIORITY_LOW),
+  waiters(nullptr) {}
+
+thread_pool::basic_result_state::~basic_result_state() {}
+
+void thread_pool::basic_result_state::add_reference()
+{
+    references++;
+}
+
+void thread_pool::basic_result_state::remove_reference()
+{
+    if(--references == 0) recycle();
+}
+
+bool thread_pool::basic_result_state::is_ready() const
+{
+    return ready;
+}
+
+void thread_pool::basic_result_state::wait()
+{
+    if(ready) return;
+    std::unique_lock<std::mutex> lk(ready_mutex);
+    ready_cv.wait(lk, [this]{ return ready.load(); });
+}
+
+bool thread_pool::basic_result_state::add_waiter(edge& e)
+{
+    std::lock_guard<std::mutex> lk(ready_mutex);
+    if(ready) return false;
+    e.next = waiters;
+    waiters = &e;
+    return true;
+}
+
+void thread_pool::basic_result_state::complete()
+{
+    if(!has_value && !exception)
+    {
+        exception = std::make_exception_ptr(
+            std::future_error(std::future_errc::broken_promise)
+        );
+    }
+
+    edge* e = nullptr;
+    {
+        std::lock_guard<std::mutex> lk(ready_mutex);
+        ready = true;
+        e = waiters;
+        waiters = nullptr;
+        ready_cv.notify_all();
+    }
+
+    while(e)
+    {
+        edge* next = e->next;
+        task* t = e->successor;
+        t->pool->release_task(t);
+        e = next;
+    }
+}
+
+void thread_pool::basic_result_state::rethrow() const
+{
+    if(exception) std::rethrow_exception(exception);
+}
+
+#ifdef THREAD_POOL_TRACING
+thread_pool::trace_stats thread_pool::get_trace_stats() const
+{
+    trace_stats stats;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    for(const std::unique_ptr<trace_buffer>& b: trace_buffers)
+    {
+        for(size_t i = 0; i < histogram::BUCKETS; ++i)
+        {
+            stats.queue_depth.counts[i] += b->queue_depth[i];
+            stats.dependency_wait.counts[i] += b->dependency_wait[i];
+            stats.queue_latency.counts[i] += b->queue_latency[i];
+            stats.run_time.counts[i] += b->run_time[i];
+        }
+    }
+    return stats;
+}
+
+void thread_pool::write_trace(std::ostream& os) const
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    std::ios_base::fmtflags flags = os.flags();
+    os << std::fixed << std::setprecision(3);
+    os << "{\"traceEvents\":[";
+
+    bool first = true;
+    std::vector<trace_event> events;
+    for(const std::unique_ptr<trace_buffer>& b: trace_buffers)
+    {
+        os << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\","
+           << "\"pid\":1,\"tid\":" << b->thread << ",\"args\":{\"name\":\""
+           << (b->worker ? "Worker " : "Thread ") << b->thread << "\"}}";
+        first = false;
+
+        uint64_t written = b->written;
+        uint64_t begin = written > TRACE_BUFFER_SIZE ?
+            written - TRACE_BUFFER_SIZE : 0;
+        events.clear();
+        for(uint64_t i = begin; i < written; ++i)
+        {
+            events.push_back(b->events[i % TRACE_BUFFER_SIZE].load());
+        }
+
+        // Anything the thread may have written over while copying, including
+        // the slot it's writing right now, is dropped. Copying part of a new
+        // event makes this see the count the thread had when writing it,
+        // see trace_slot.
+        uint64_t valid_from = b->written + 1;
+        valid_from = valid_from > TRACE_BUFFER_SIZE ?
+            valid_from - TRACE_BUFFER_SIZE : 0;
+        size_t skip = valid_from > begin ?
+            std::min((size_t)(valid_from - begin), events.size()) : 0;
+
+        for(size_t i = skip; i < events.size(); ++i)
+        {
+            const trace_event& e = events[i];
+            os << ",\n{\"name\":\"Task " << (uint32_t)e.id << "\","
+               << "\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,"
+               << "\"tid\":" << b->thread << ","
+               << "\"ts\":" << e.start_time / 1000.0 << ","
+               << "\"dur\":" << (e.end_time - e.start_time) / 1000.0 << ","
+               << "\"args\":{\"id\":" << e.id << ","
+               << "\"priority\":" << e.priority << ","
+               << "\"dependency_wait_us\":"
+               << (e.queued_time - e.posted_time) / 1000.0 << ","
+               << "\"queue_latency_us\":"
+               << (e.start_time - e.queued_time) / 1000.0 << "}}";
+        }
+    }
+    os << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    os.flags(flags);
+}
+
+uint64_t thread_pool::trace_time() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_epoch
+    ).count();
+}
+
+thread_pool::trace_buffer* thread_pool::local_trace_buffer()
+{
+    // By the serial of the pool, since a thread can post to several. The
+    // last one used is checked first. Serials are never reused, so entries
+    // of destroyed pools are just never looked up again.
+    static thread_local uint64_t last_serial = 0;
+    static thread_local trace_buffer* last_buffer = nullptr;
+    static thread_local std::unordered_map<uint64_t, trace_buffer*> buffers;
+    if(last_serial == trace_serial) return last_buffer;
+
+    trace_buffer*& buffer = buffers[trace_serial];
+    if(!buffer)
+    {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+        worker* self = current_worker;
+        trace_buffers.emplace_back(new trace_buffer(
+            trace_buffers.size(),
+            self && self->pool == this
+        ));
+        buffer = trace_buffers.back().get();
+    }
+    last_serial = trace_serial;
+    last_buffer = buffer;
+    return buffer;
+}
+
+thread_pool::histogram::histogram()
+{
+    for(uint64_t& c: counts) c = 0;
+}
+
+uint64_t thread_pool::histogram::total() const
+{
+    uint64_t sum = 0;
+    for(uint64_t c: counts) sum += c;
+    return sum;
+}
+
+uint64_t thread_pool::histogram::percentile(double fraction) const
+{
+    uint64_t count = total();
+    if(count == 0) return 0;
+
+    uint64_t limit = std::ceil(count * fraction);
+    limit = std::max(limit, (uint64_t)1);
+    uint64_t sum = 0;
+    for(size_t i = 0; i < BUCKETS; ++i)
+    {
+        sum += counts[i];
+        if(sum >= limit) return i == 0 ? 0 : (1ull << i) - 1;
+    }
+    return std::numeric_limits<uint64_t>::max();
+}
+
+thread_pool::trace_buffer::trace_buffer(unsigned thread, bool worker)
+: thread(thread), worker(worker), written(0)
+{
+    for(size_t i = 0; i < histogram::BUCKETS; ++i)
+    {
+        queue_depth[i] = 0;
+        dependency_wait[i] = 0;
+        queue_latency[i] = 0;
+        run_time[i] = 0;
+    }
+}
+
+void thread_pool::trace_buffer::push(const trace_event& e)
+{
+    uint64_t index = written.load(std::memory_order_relaxed);
+    events[index % TRACE_BUFFER_SIZE].store(e);
+    written.store(index + 1, std::memory_order_release);
+
+    add(queue_latency, e.start_time - e.queued_time);
+    add(run_time, e.end_time - e.start_time);
+}
+
+void thread_pool::trace_slot::store(const trace_event& e)
+{
+    id.store(e.id, std::memory_order_release);
+    priority.store(e.priority, std::memory_order_release);
+    posted_time.store(e.posted_time, std::memory_order_release);
+    queued_time.store(e.queued_time, std::memory_order_release);
+    start_time.store(e.start_time, std::memory_order_release);
+    end_time.store(e.end_time, std::memory_order_release);
+}
+
+thread_pool::trace_event thread_pool::trace_slot::load() const
+{
+    trace_event e;
+    e.id = id.load(std::memory_order_acquire);
+    e.priority = priority.load(std::memory_order_acquire);
+    e.posted_time = posted_time.load(std::memory_order_acquire);
+    e.queued_time = queued_time.load(std::memory_order_acquire);
+    e.start_time = start_time.load(std::memory_order_acquire);
+    e.end_time = end_time.load(std::memory_order_acquire);
+    return e;
+}
+
+void thread_pool::trace_buffer::add(
+    std::atomic<uint64_t>* counts,
+    uint64_t value
+){
+    size_t bucket = 0;
+    while(value != 0 && bucket < histogram::BUCKETS - 1)
+    {
+        value >>= 1;
+        bucket++;
+    }
+    // Only the owning thread writes, so this needn't be an atomic add.
+    counts[bucket].store(
+        counts[bucket].load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed
+    );
+}
+#endif
+
+thread_pool::schedule_awaiter::schedule_awaiter(
+    thread_pool* pool,
+    unsigned priority
+): pool(pool), priority(priority) {}
+
+bool thread_pool::schedule_awaiter::await_ready() const
+{
+    return false;
+}
+
+void thread_pool::schedule_awaiter::await_resume() const {}
+
+thread_pool::split_job::split_job()
+: references(0), state(JOB_PENDING), run(nullptr), context(nullptr),
+  output(nullptr), begin(0), end(0) {}
+
+bool thread_pool::split_job::claim()
+{
+    unsigned expected = JOB_PENDING;
+    return state.compare_exchange_strong(expected, JOB_CLAIMED);
+}
+
+void thread_pool::split_job::remove_reference()
+{
+    if(--references == 0) recycler<split_job>::release(this);
+}
+
+thread_pool::split_error::split_error(): failed(false) {}
+
+void thread_pool::split_error::fail(std::exception_ptr ex)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if(!exception) exception = ex;
+    failed = true;
+}
+
+void thread_pool::split_error::rethrow() const
+{
+    if(exception) std::rethrow_exception(exception);
+}
+
+thread_pool::dependency_list::dependency_list()
+: ids(nullptr), count(0) {}
+
+thread_pool::dependency_list::dependency_list(
+    const task_id* ids,
+    size_t count
+): ids(ids), count(count) {}
+
+const thread_pool::task_id* thread_pool::dependency_list::begin() const
+{
+    return ids;
+}
+
+const thread_pool::task_id* thread_pool::dependency_list::end() const
+{
+    return ids + count;
 }
 
-bool thread_pool::task::operator<(const thread_pool::task& other) const
+size_t thread_pool::dependency_list::size() const
 {
-    return priority < other.priority;
+    return count;
 }
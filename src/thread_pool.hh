@@ -26,14 +26,28 @@ SOFTWARE.
 #include <thread>
 #include <mutex>
 #include <functional>
-#include <set>
-#include <unordered_set>
 #include <queue>
+#include <vector>
 #include <condition_variable>
+#include <shared_mutex>
 #include <atomic>
 #include <limits>
 #include <memory>
 #include <future>
+#include <cstdint>
+#include <initializer_list>
+#include <chrono>
+#include <exception>
+#include <type_traits>
+#include <cstddef>
+#include <utility>
+#include <unordered_map>
+#include <algorithm>
+#include <iterator>
+#include <string>
+#ifdef THREAD_POOL_TRACING
+#include <ostream>
+#endif
 
 constexpr unsigned PRIORITY_LOW = 0;
 constexpr unsigned PRIORITY_MEDIUM = 100;
@@ -44,39 +58,317 @@ class thread_pool
 {
 public:
     //0 is reserved for unassigned post_results
-    using task_id = unsigned;
+    using task_id = uint64_t;
+    // Tasks posted with the same key replace each other, see postk().
+    using coalescing_key = uint64_t;
+
+    enum scheduling
+    {
+        // All tasks go through one shared queue.
+        SCHEDULE_SHARED = 0,
+        // Tasks posted from a worker go to that worker's own queue, and idle
+        // workers steal from the others. Tasks posted from other threads still
+        // go through the shared queue.
+        SCHEDULE_WORK_STEALING
+    };
 
     // Launches as many threads as there are cores on the machine, -1
     thread_pool();
     // 0 threads will cause any given task be run immediately when queuing.
-    thread_pool(unsigned thread_count);
+    thread_pool(
+        unsigned thread_count,
+        scheduling mode = SCHEDULE_WORK_STEALING
+    );
     thread_pool(const thread_pool& other) = delete;
     ~thread_pool();
 
     // If resizing down, may be slow if all threads are being used (removed ones
-    // have to be joined). Do not call this function from several threads
-    // simultaneously.
-    void resize(unsigned thread_count);
+    // have to be joined). Without wait, shrinking returns right away instead,
+    // and the removed workers leave once they're done with their current
+    // task. size() still counts them until then. Do not call this function
+    // from several threads simultaneously. The autoscaler may undo it.
+    void resize(unsigned thread_count, bool wait = true);
 
     unsigned size() const;
     unsigned busy() const;
+    scheduling get_scheduling() const;
+
+    // Tasks are sorted into lanes by priority, so that urgent work can be
+    // kept from waiting behind long running background tasks.
+    enum lane
+    {
+        // PRIORITY_HIGH and above.
+        LANE_FRAME = 0,
+        // PRIORITY_MEDIUM and above.
+        LANE_NORMAL,
+        // Everything else.
+        LANE_BACKGROUND,
+        LANE_COUNT
+    };
+
+    static lane get_lane(unsigned priority);
+
+    // Keeps up to reserved workers free for tasks of the given lane, and
+    // never lets more than max_workers run them at once. max_workers is at
+    // least 1. By default nothing is reserved and there is no maximum.
+    void set_lane_limits(
+        lane l,
+        unsigned reserved,
+        unsigned max_workers = std::numeric_limits<unsigned>::max()
+    );
+    // Once the lanes before a lane with tasks waiting have been served this
+    // many times in a row, it gets served next.
+    void set_lane_aging(unsigned skips);
+
+    // Idle workers spin for up to spin, then yield for up to yield, before
+    // going to sleep. Tasks posted meanwhile are picked up without a wake up,
+    // at the cost of CPU time. Both are off by default on single core
+    // machines, where they would only hold up the thread posting the task.
+    void set_idle_spin(
+        std::chrono::nanoseconds spin,
+        std::chrono::nanoseconds yield
+    );
+    // While set, idle workers go to sleep right away, e.g. to save power
+    // between frames.
+    void set_idle_park(bool park);
+
+    struct cpu_info
+    {
+        unsigned id;
+        // Hardware threads of the same physical core share these.
+        unsigned core;
+        unsigned package;
+        unsigned node;
+    };
+
+    // Reads the online CPUs from sysfs. The root is only worth changing for
+    // testing. Returns nothing if sysfs can't be read.
+    static std::vector<cpu_info> read_cpu_topology(
+        const std::string& sysfs_root = "/sys/devices/system"
+    );
+
+    enum placement
+    {
+        // Workers run wherever the OS puts them.
+        PLACE_ANYWHERE = 0,
+        // Each worker is pinned to a CPU of its own, alternating between NUMA
+        // nodes. Every physical core gets a worker before any of them gets
+        // a second one on another hardware thread.
+        PLACE_SPREAD,
+        // Like PLACE_SPREAD, but each NUMA node is filled before the next.
+        PLACE_COMPACT
+    };
+
+    // The CPUs in the order workers are pinned to them. The worker named
+    // "worker N" gets the Nth one, wrapping around if there are more workers
+    // than CPUs.
+    static std::vector<unsigned> plan_placement(
+        placement p,
+        const std::vector<cpu_info>& cpus
+    );
+
+    // Pins current and future workers, including ones added by resize().
+    // A new worker pins itself before allocating anything, so the task
+    // blocks, queue storage and result states it allocates are first touched
+    // on its own NUMA node and stay there. PLACE_ANYWHERE lets the workers
+    // run on any of the given CPUs again.
+    void set_placement(
+        placement p,
+        const std::vector<cpu_info>& cpus = read_cpu_topology()
+    );
+    placement get_placement() const;
+
+    struct autoscale_params
+    {
+        autoscale_params();
+
+        unsigned min_threads;
+        unsigned max_threads;
+        // How often the load is looked at.
+        std::chrono::milliseconds interval;
+        // A worker is added once one of these has been exceeded for
+        // grow_after intervals in a row.
+        std::chrono::microseconds grow_wait;
+        unsigned grow_queued_per_thread;
+        unsigned grow_after;
+        // A worker is removed once the share of busy workers has averaged
+        // below shrink_busy over shrink_after intervals without overload.
+        double shrink_busy;
+        unsigned shrink_after;
+    };
+
+    // Grows and shrinks the pool between the given sizes by queue depth, how
+    // busy the workers are and how long tasks wait in the queues. The
+    // adjustments are made by a thread of its own, so no caller ever waits
+    // for them.
+    void set_autoscale(const autoscale_params& params);
+    void stop_autoscale();
 
+private:
+    struct basic_result_state;
+    template<typename T>
+    struct result_state;
+
+    // Return type of a continuation taking the value of a post_result<T>.
+    template<typename F, typename T>
+    struct continuation
+    {
+        using type = decltype(std::declval<F&>()(std::declval<T>()));
+    };
+
+    template<typename F>
+    struct continuation<F, void>
+    {
+        using type = decltype(std::declval<F&>()());
+    };
+
+public:
+    // Like std::future, but without allocating and with the id of the task
+    // attached.
     template<typename T = void>
-    class post_result: public std::future<T>
+    class post_result
     {
+    friend class thread_pool;
     public:
         post_result();
         post_result(post_result&& other);
-        post_result(std::future<T>&& f, task_id id);
+        post_result(const post_result& other) = delete;
+        ~post_result();
 
         post_result& operator=(post_result&& other);
 
+        bool valid() const;
+        // On a worker of the pool, runs other tasks while waiting, the
+        // awaited task and its dependencies first. Only sleeps once there's
+        // nothing left to run.
+        void wait() const;
+        template<typename Rep, typename Period>
+        std::future_status wait_for(
+            const std::chrono::duration<Rep, Period>& timeout
+        ) const;
+        // Waits like wait(). Rethrows the exception thrown by the task, or
+        // std::future_error if the task was dropped. Invalidates the result.
+        T get();
+
+        // Runs f on the pool with the value once it's ready, without blocking
+        // anyone. If the task failed, f is skipped and the exception is passed
+        // on instead. Invalidates the result.
+        template<typename F>
+        auto then(F&& f, unsigned priority = PRIORITY_LOW)
+        -> post_result<typename continuation<
+            typename std::decay<F>::type, T
+        >::type>;
+
         void clear();
         task_id get_id() const;
+        // See thread_pool::cancel(). The result stays valid, it just ends up
+        // as a broken promise if the task was cancelled.
+        bool cancel();
+
+        // Lets coroutines co_await the result, see thread_pool_coro.hh. The
+        // coroutine is resumed on the pool, at the priority of the task that
+        // produced the result. Invalidates the result.
+        bool await_ready() const;
+        template<typename Handle>
+        void await_suspend(Handle h);
+        T await_resume();
+
     private:
+        post_result(thread_pool* pool, result_state<T>* state, task_id id);
+
+        thread_pool* pool;
+        result_state<T>* state;
         task_id id;
     };
 
+    template<typename T>
+    using all_result = typename std::conditional<
+        std::is_void<T>::value, void, std::vector<T>
+    >::type;
+
+    // Index of the result that was ready first, along with its value.
+    template<typename T>
+    using any_result = typename std::conditional<
+        std::is_void<T>::value, size_t, std::pair<size_t, T>
+    >::type;
+
+    // Ready once all of the results are, with their values in the same order.
+    // If any of them fails, the first exception in order is passed on.
+    template<typename T>
+    post_result<all_result<T>> when_all(
+        std::vector<post_result<T>>&& results,
+        unsigned priority = PRIORITY_LOW
+    );
+
+    // Ready as soon as one of the results is. Empty input gives a broken
+    // promise.
+    template<typename T>
+    post_result<any_result<T>> when_any(
+        std::vector<post_result<T>>&& results,
+        unsigned priority = PRIORITY_LOW
+    );
+
+    // A result completed by hand instead of by a task, for work done outside
+    // of the pool, like I/O. Any thread may complete it. Destroying it
+    // without a value or exception breaks the promise.
+    template<typename T = void>
+    class promise
+    {
+    friend class thread_pool;
+    public:
+        promise();
+        promise(promise&& other);
+        promise(const promise& other) = delete;
+        ~promise();
+
+        promise& operator=(promise&& other);
+
+        bool valid() const;
+        // Can only be called once.
+        post_result<T> get_result();
+        // Takes the arguments of T's constructor, or nothing for void. These
+        // invalidate the promise.
+        template<typename... Args>
+        void set_value(Args&&... args);
+        void set_exception(std::exception_ptr exception);
+
+    private:
+        promise(thread_pool* pool, result_state<T>* state);
+
+        void set(std::true_type /*void*/);
+        template<typename... Args>
+        void set(std::false_type /*void*/, Args&&... args);
+        void complete();
+
+        thread_pool* pool;
+        result_state<T>* state;
+        bool retrieved;
+    };
+
+    // Coroutines awaiting the result resume at the given priority.
+    template<typename T = void>
+    promise<T> make_promise(unsigned priority = PRIORITY_LOW);
+
+    // A non-owning view of task ids, so that passing dependencies never
+    // allocates. The ids must outlive the postd() call they are given to.
+    class dependency_list
+    {
+    public:
+        dependency_list();
+        dependency_list(const task_id* ids, size_t count);
+        // Any contiguous container, like std::vector or std::array.
+        template<typename C>
+        dependency_list(const C& container);
+
+        const task_id* begin() const;
+        const task_id* end() const;
+        size_t size() const;
+
+    private:
+        const task_id* ids;
+        size_t count;
+    };
+
     template<typename F, typename... Args>
     auto post(F&& f, Args&&... args)
     -> post_result<decltype(f(std::forward<Args>(args)...))>;
@@ -88,56 +380,945 @@ public:
         Args&&... args
     ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
 
+    // Dependencies that have already finished or are unknown are ignored. A
+    // task fails if it throws, and tasks depending on a failed task are
+    // dropped without running.
     template<typename F, typename... Args>
     auto postd(
-        const std::set<task_id>& dependencies,
+        dependency_list dependencies,
         unsigned priority,
         F&& f,
         Args&&... args
     ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
 
+    template<typename F, typename... Args>
+    auto postd(
+        std::initializer_list<task_id> dependencies,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    // Fire-and-forget variants of postd(), these skip the result entirely.
+    // Exceptions thrown by these tasks are only printed.
+    template<typename F, typename... Args>
+    task_id postf(
+        dependency_list dependencies,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    );
+
+    template<typename F, typename... Args>
+    task_id postf(
+        std::initializer_list<task_id> dependencies,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    );
+
+    // Posts like postp(), but cancels the last task posted with the same key
+    // first, if it hasn't started yet.
+    template<typename F, typename... Args>
+    auto postk(
+        coalescing_key key,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    // Posts like postd(), but the task only runs on a thread calling
+    // run_main(), such as the main thread for SDL and presentation calls.
+    template<typename F, typename... Args>
+    auto postm(
+        dependency_list dependencies,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    template<typename F, typename... Args>
+    auto postm(
+        std::initializer_list<task_id> dependencies,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    // Runs tasks posted with postm() until none are left or the budget is
+    // used up, the rest roll over to the next call. At least one task is run
+    // if there are any, so a budget that's too small still makes progress.
+    // Waiting for a result on the same thread also runs these tasks. Returns
+    // the number of tasks run.
+    size_t run_main(
+        std::chrono::nanoseconds budget = std::chrono::nanoseconds::max()
+    );
+
+    using clock = std::chrono::steady_clock;
+    using timer_id = uint64_t;
+
+    // Posts the task once the given time has come. Timers are kept in a wheel
+    // with TIMER_TICK resolution, which the workers advance between tasks. An
+    // idle worker sleeps until the next timer, so no thread is set aside for
+    // them. Without workers, timers only fire from run_main() or while
+    // waiting for a result. Cancel the result to drop the task early.
+    template<typename F, typename... Args>
+    auto post_at(
+        clock::time_point time,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    template<typename Rep, typename Period, typename F, typename... Args>
+    auto post_after(
+        const std::chrono::duration<Rep, Period>& delay,
+        unsigned priority,
+        F&& f,
+        Args&&... args
+    ) -> post_result<decltype(f(std::forward<Args>(args)...))>;
+
+    // Posts f every period from now on, until stopped with cancel_timer().
+    // Exceptions are only printed, like with postf().
+    template<typename Rep, typename Period, typename F>
+    timer_id post_every(
+        const std::chrono::duration<Rep, Period>& period,
+        unsigned priority,
+        F&& f
+    );
+    // Returns false if there's no such timer.
+    bool cancel_timer(timer_id id);
+
+    // Revokes a task that hasn't started yet, whether it's queued or still
+    // waiting for its dependencies. It's then dropped like a failed task:
+    // it never runs, its result is a broken promise and the tasks depending
+    // on it are dropped too. Returns false if the task has already started
+    // or is unknown.
+    bool cancel(task_id id);
+
+    // Data-parallel loops. The range is split lazily: halves are only handed
+    // to the pool when it has room for them, and the calling thread works
+    // through the rest itself, taking back any halves nobody picked up. Only
+    // this loop's own work is waited for. Index can be an integer or a random
+    // access iterator. grain is the smallest piece of the range that is ever
+    // split off, 0 picks one based on the size of the pool. The first
+    // exception thrown by f stops the loop and is rethrown here.
+    template<typename Index, typename F>
+    void parallel_for(Index begin, Index end, F&& f, size_t grain = 0);
+
+    // Returns reduce(...reduce(reduce(identity, f(begin)), f(begin+1))...),
+    // except that the pieces are reduced in parallel, so reduce must be
+    // associative. The order of the elements is kept.
+    template<typename Index, typename T, typename F, typename R>
+    T parallel_reduce(
+        Index begin,
+        Index end,
+        T identity,
+        F&& f,
+        R&& reduce,
+        size_t grain = 0
+    );
+
+    // Quicksort whose partitions are handed to the pool like the halves of
+    // parallel_for(). Not stable.
+    template<typename RandomIt, typename Compare = std::less<>>
+    void parallel_sort(RandomIt first, RandomIt last, Compare comp = Compare());
+
+    // co_await pool.schedule() moves a coroutine onto the pool, see
+    // thread_pool_coro.hh. Doesn't need C++20 itself, the coroutine handle
+    // is a template parameter.
+    class schedule_awaiter
+    {
+    public:
+        schedule_awaiter(thread_pool* pool, unsigned priority);
+
+        bool await_ready() const;
+        template<typename Handle>
+        void await_suspend(Handle h);
+        void await_resume() const;
+
+    private:
+        thread_pool* pool;
+        unsigned priority;
+    };
+
+    schedule_awaiter schedule(unsigned priority = PRIORITY_LOW);
+
     // Block until queue is empty
     void finish();
 
+#ifdef THREAD_POOL_TRACING
+    // Counts of values in power of two buckets. Bucket 0 is for zeros, and
+    // bucket i for values in [2^(i-1), 2^i).
+    struct histogram
+    {
+        static constexpr size_t BUCKETS = 64;
+
+        histogram();
+
+        uint64_t total() const;
+        // Upper bound of the bucket under which the given fraction of the
+        // values fall.
+        uint64_t percentile(double fraction) const;
+
+        uint64_t counts[BUCKETS];
+    };
+
+    // Times are in nanoseconds.
+    struct trace_stats
+    {
+        // Number of queued tasks, sampled whenever a task is queued.
+        histogram queue_depth;
+        // From posting a task until its dependencies are done.
+        histogram dependency_wait;
+        // From queueing a task until it starts.
+        histogram queue_latency;
+        histogram run_time;
+    };
+
+    trace_stats get_trace_stats() const;
+    // Writes the recorded tasks as Chrome trace event JSON, which can be
+    // opened in chrome://tracing or Perfetto. Only the latest
+    // TRACE_BUFFER_SIZE tasks of each thread are kept.
+    void write_trace(std::ostream& os) const;
+#endif
+
 private:
+    struct task;
+    struct edge;
+
+    struct basic_result_state
+    {
+        basic_result_state();
+        virtual ~basic_result_state();
+
+        void add_reference();
+        void remove_reference();
+
+        bool is_ready() const;
+        void wait();
+        template<typename Rep, typename Period>
+        bool wait_for(const std::chrono::duration<Rep, Period>& timeout);
+
+        // Makes the task wait for this state, unless it's already ready.
+        bool add_waiter(edge& e);
+
+        // Marks the state ready and releases the tasks waiting for it. If
+        // nothing set a value or exception, the result becomes a broken
+        // promise.
+        void complete();
+        void rethrow() const;
+
+        // Returns the state to its recycler.
+        virtual void recycle() = 0;
+
+        std::atomic_uint references;
+        std::atomic_bool ready;
+        bool has_value;
+        // Of the task setting the value, coroutines waiting for it are
+        // resumed at this priority.
+        unsigned priority;
+        std::exception_ptr exception;
+
+        std::mutex ready_mutex;
+        std::condition_variable ready_cv;
+        // Tasks waiting for this state, protected by ready_mutex.
+        edge* waiters;
+    };
+
+    template<typename T>
+    struct result_state: public basic_result_state
+    {
+        using value_type = typename std::conditional<
+            std::is_void<T>::value, char, T
+        >::type;
+
+        template<typename F>
+        void set(F& f);
+        T take();
+        void recycle() override;
+
+        template<typename F>
+        void set(F& f, std::true_type /*void*/);
+        template<typename F>
+        void set(F& f, std::false_type /*void*/);
+        void take(std::true_type /*void*/);
+        T take(std::false_type /*void*/);
+
+        typename std::aligned_storage<
+            sizeof(value_type),
+            alignof(value_type)
+        >::type value;
+    };
+
+    // Keeps a result state alive, for continuations.
+    template<typename T>
+    class state_reference
+    {
+    public:
+        explicit state_reference(result_state<T>* state = nullptr);
+        state_reference(state_reference&& other);
+        state_reference(const state_reference& other) = delete;
+        ~state_reference();
+
+        result_state<T>* get() const;
+        result_state<T>* operator->() const;
+
+    private:
+        result_state<T>* state;
+    };
+
+    template<typename T>
+    struct when_any_control
+    {
+        when_any_control(result_state<any_result<T>>* combined);
+        // Breaks the promise if none of the inputs ever got to run.
+        ~when_any_control();
+
+        std::atomic_bool done;
+        state_reference<any_result<T>> combined;
+    };
+
+    // Recycles objects of one type. Each thread keeps a few free objects of
+    // its own and trades them with a shared list in batches, so that posting
+    // doesn't touch the allocator once things have warmed up.
+    template<typename T>
+    class recycler
+    {
+    public:
+        static T* acquire();
+        static void release(T* obj);
+
+    private:
+        static constexpr size_t BATCH_SIZE = 32;
+
+        struct shared_list
+        {
+            ~shared_list();
+
+            std::mutex mutex;
+            std::vector<T*> objects;
+        };
+
+        // Fixed size, so that a thread's first use doesn't allocate either.
+        struct local_list
+        {
+            local_list();
+            ~local_list();
+
+            T* objects[2 * BATCH_SIZE];
+            size_t count;
+        };
+
+        static shared_list& shared();
+        static local_list& local();
+    };
+
+    // Links a task to one of its dependencies or to a result state it waits
+    // for. Edges are stored in the waiting task and chained into the list
+    // kept by the dependency.
+    struct edge
+    {
+        task* successor;
+        edge* next;
+        // The task depended on, 0 when waiting for a result state. Only read
+        // when looking for something to help with.
+        std::atomic<task_id> dependency;
+    };
+
     struct task
     {
+        task();
+
         template<typename F>
-        task(F&& func, unsigned priority, bool finish_thread);
+        F& function();
+        edge& edge_at(size_t index);
 
-        std::packaged_task<void()> task_func;
+        thread_pool* pool;
 
-        std::unordered_set<task_id> dependencies;
-        task_id id;
+        // The callable is stored inline if it fits, otherwise on the heap.
+        static constexpr size_t INLINE_FUNCTION_SIZE = 64;
+        typename std::aligned_storage<
+            INLINE_FUNCTION_SIZE,
+            alignof(std::max_align_t)
+        >::type function_storage;
+        // Runs the callable and stores its return value in result, if any.
+        void (*invoke)(task* t);
+        void (*destroy)(task* t);
+        basic_result_state* result;
+
+        // Index in the task blocks and generation of the slot.
+        std::atomic<task_id> id;
+        // Same as id while the task sits in a queue. Whoever swaps it to 0
+        // gets to run the task, so it can be taken out of turn by a waiting
+        // thread and the stale queue entry is skipped later.
+        std::atomic<task_id> queued_id;
 
         unsigned priority;
         bool finish_thread;
 
-        bool operator<(const thread_pool::task& other) const;
+        // Number of dependencies that have not finished yet, plus one while
+        // the task is still being posted.
+        std::atomic_uint unfinished_dependencies;
+        // Set when a dependency fails, the task is then dropped unrun.
+        std::atomic_bool failed;
+        // Set once the task has either started or been cancelled, whichever
+        // came first.
+        std::atomic_bool claimed;
+
+        // Posted through postk() with this key.
+        bool keyed;
+        coalescing_key key;
+        // Posted through postm(). Helpers read it before claiming the task,
+        // which may be recycled meanwhile.
+        std::atomic_bool main_thread;
+        // Set when queued while autoscaling, otherwise 0.
+        int64_t queued_ns;
+
+#ifdef THREAD_POOL_TRACING
+        uint64_t posted_time, queued_time;
+#endif
+
+        // Protects successors and finished.
+        std::mutex successors_mutex;
+        // Edges of tasks that depend on this one.
+        edge* successors;
+        bool finished;
+
+        // Edges to this task's own dependencies. Extra edges are kept around
+        // when the task is recycled.
+        static constexpr size_t INLINE_EDGES = 4;
+        edge edges[INLINE_EDGES];
+        std::unique_ptr<edge[]> extra_edges;
+        size_t extra_edge_count;
+        // Number of edges to other tasks.
+        std::atomic<size_t> edge_count;
+    };
+
+    // A piece of a parallel loop that was offered to the pool. Whoever claims
+    // it first runs it, either a worker through the posted task or the thread
+    // that split it off, when joining. The task may outlive the loop, so the
+    // job is reference counted.
+    struct split_job
+    {
+        enum job_state
+        {
+            JOB_PENDING = 0,
+            JOB_CLAIMED,
+            JOB_DONE
+        };
+
+        split_job();
+
+        bool claim();
+        void remove_reference();
+
+        std::atomic_uint references;
+        std::atomic_uint state;
+        void (*run)(split_job* job);
+        // The loop and the place for the job's own result, only touched by
+        // whoever claims the job.
+        void* context;
+        void* output;
+        size_t begin, end;
+    };
+
+    // Jobs split off by one thread in one piece of a loop. Each split halves
+    // the range, so this many are enough for any size.
+    static constexpr size_t MAX_SPLIT_JOBS = 64;
+
+    // The first exception thrown anywhere in a parallel loop.
+    struct split_error
+    {
+        split_error();
+
+        void fail(std::exception_ptr ex);
+        void rethrow() const;
+
+        std::atomic_bool failed;
+        std::mutex mutex;
+        std::exception_ptr exception;
     };
 
-    task_id post(
-        thread_pool::task&& t,
-        const std::set<task_id>& dependencies = {}
+    template<typename Part, typename Body>
+    struct range_context: public split_error
+    {
+        range_context(
+            thread_pool* pool,
+            Body& body,
+            const Part& identity,
+            size_t grain
+        );
+
+        thread_pool* pool;
+        Body& body;
+        const Part& identity;
+        size_t grain;
+    };
+
+    // Bodies for split_range(). Part is what each piece of the range
+    // produces, merge() combines the part of a piece with the one right after
+    // it.
+    template<typename Index, typename F>
+    struct for_body
+    {
+        using part_type = char;
+
+        void operator()(size_t begin, size_t end, char& part);
+        void merge(char& part, char& next);
+
+        Index first;
+        F& f;
+    };
+
+    template<typename Index, typename T, typename F, typename R>
+    struct reduce_body
+    {
+        using part_type = T;
+
+        void operator()(size_t begin, size_t end, T& part);
+        void merge(T& part, T& next);
+
+        Index first;
+        F& f;
+        R& reduce;
+    };
+
+    template<typename RandomIt, typename Compare>
+    struct sort_context: public split_error
+    {
+        sort_context(thread_pool* pool, RandomIt first, Compare& comp);
+
+        thread_pool* pool;
+        RandomIt first;
+        Compare& comp;
+    };
+
+    // Ranges shorter than this are sorted with std::sort().
+    static constexpr size_t MIN_SORT_SPLIT = 2048;
+
+    template<typename Body>
+    typename Body::part_type split_root(
+        size_t size,
+        size_t grain,
+        Body& body,
+        const typename Body::part_type& identity
+    );
+    template<typename Part, typename Body>
+    void split_range(
+        size_t begin,
+        size_t end,
+        Part& part,
+        range_context<Part, Body>& ctx
+    );
+    template<typename Part, typename Body>
+    static void run_range_job(split_job* job);
+
+    template<typename RandomIt, typename Compare>
+    void sort_range(
+        size_t begin,
+        size_t end,
+        sort_context<RandomIt, Compare>& ctx
+    );
+    template<typename RandomIt, typename Compare>
+    static void run_sort_job(split_job* job);
+
+    // Whether there is anyone to take a split off piece of a loop.
+    bool should_split() const;
+    size_t default_grain(size_t size) const;
+    split_job* fork_job(
+        void (*run)(split_job* job),
+        void* context,
+        void* output,
+        size_t begin,
+        size_t end
+    );
+    // Runs the job here if nobody has claimed it yet, otherwise waits for it.
+    void join_job(split_job* job);
+
+    // The id and priority are copied, since the task may have been taken
+    // and recycled by the time the entry is popped.
+    struct queue_entry
+    {
+        task* t;
+        task_id id;
+        unsigned priority;
+        // Equal priorities pop in the order they were pushed.
+        uint64_t sequence;
+    };
+
+    struct task_compare
+    {
+        bool operator()(const queue_entry& a, const queue_entry& b) const;
+    };
+
+    struct task_queue
+    {
+        // Room for this many tasks is reserved up front.
+        static constexpr size_t INITIAL_CAPACITY = 256;
+
+        task_queue();
+
+        void push(task* t);
+        // Skips entries of tasks that were already taken.
+        bool pop(task*& t);
+
+        std::mutex mutex;
+        std::priority_queue<
+            queue_entry,
+            std::vector<queue_entry>,
+            task_compare
+        > tasks;
+        // These mirror the queue so that it can be peeked without locking.
+        // Stale entries are counted in size until they're popped.
+        std::atomic_uint size, top_priority;
+        // Entries pushed so far, protected by mutex.
+        uint64_t pushed;
+    };
+
+    struct lane_state
+    {
+        lane_state();
+
+        task_queue shared_queue;
+        // Tasks of this lane in all queues.
+        std::atomic_uint queued;
+        // Workers running tasks of this lane, counted from when they're
+        // popped.
+        std::atomic_uint running;
+        std::atomic_uint reserved, max_workers;
+        // Times the lanes before this one were served while it had tasks
+        // waiting.
+        std::atomic_uint skipped;
+    };
+
+    struct worker
+    {
+        worker(thread_pool* pool);
+
+        thread_pool* pool;
+        task_queue queues[LANE_COUNT];
+        std::thread thread;
+        // Names the thread, and picks its CPU from the placement.
+        unsigned number;
+        // -1 if not pinned.
+        int cpu;
+        // Free tasks owned by this worker.
+        std::vector<task*> free_tasks;
+    };
+
+    // Free tasks are moved between a worker and the pool in batches this big.
+    static constexpr size_t FREE_TASK_BATCH_SIZE = 32;
+
+    template<typename R, typename F>
+    static void set_function(task* t, F&& f);
+    template<typename R, typename F>
+    static void invoke_function(task* t);
+    template<typename F>
+    static void destroy_function(task* t);
+
+    task* create_task(unsigned priority, bool finish_thread);
+    task* find_task(task_id id);
+    void reserve_edges(task* t, size_t count);
+    void release_task_data(task* t);
+    void destroy_task(task* t);
+
+    task_id post(task* t, dependency_list dependencies = {});
+    // Posts a task that waits for result states instead of other tasks.
+    task_id post_when(
+        task* t,
+        basic_result_state* const* states,
+        size_t count
+    );
+
+    template<typename R, typename F>
+    post_result<R> post_when(
+        basic_result_state* const* states,
+        size_t count,
+        unsigned priority,
+        F&& f
+    );
+
+    template<typename F, typename T>
+    static auto call_with(F& f, result_state<T>* state, std::false_type)
+    -> decltype(f(state->take()));
+    template<typename F, typename T>
+    static auto call_with(F& f, result_state<T>* state, std::true_type)
+    -> decltype(f());
+
+    template<typename T>
+    static any_result<T> take_any(
+        size_t index,
+        result_state<T>* state,
+        std::false_type
+    );
+    template<typename T>
+    static any_result<T> take_any(
+        size_t index,
+        result_state<T>* state,
+        std::true_type
     );
 
-    void execute_loop();
+    // The last parameter only picks the overload for void.
+    template<typename T>
+    static std::vector<T> take_all(
+        std::vector<state_reference<T>>& inputs,
+        std::vector<T>*
+    );
+    template<typename T>
+    static void take_all(std::vector<state_reference<T>>& inputs, void*);
+
+    void execute_loop(worker* self);
+    // Joins the workers that have left the pool.
+    void reap_workers();
+    void autoscale_loop();
+    // Keeps track of the longest time a task waited in a queue.
+    void note_wait(task* t);
+    // Pins the thread to the CPU, or to any allowed CPU if it's -1. Needs
+    // workers_mutex.
+    void apply_placement(std::thread::native_handle_type thread, int cpu);
+
+    void queue_task(task* t);
+    void run_task(task* t);
+    void run_inline();
+    // Counts a task that was taken out of a queue.
+    void unqueue(task* t);
+    bool pop_shared(task*& t);
+    // Lane limits are only honored when limited is set, which the worker
+    // loop does. Tasks run while waiting take no extra thread, so they don't
+    // count.
+    bool pop_task(worker* self, task*& t, bool limited);
+    bool pop_lane(worker* self, lane l, task*& t);
+    bool steal_task(worker* self, lane l, task*& t);
+    // Takes a worker slot in the lane if its limits allow it.
+    bool acquire_lane(lane l);
+    void release_lane(lane l);
+    // Whether taking another worker would still leave the ones reserved for
+    // the other lanes free.
+    bool has_spare_worker(lane l) const;
+    // Waits for schedule_changes to move on from the given value without
+    // sleeping, returns false if it didn't in time.
+    bool idle_spin(unsigned changes);
+    void release_busy();
+    // Takes the task with the given id out of its queue, or failing that, one
+    // of its dependencies, up to depth steps away.
+    bool claim_task(task_id id, unsigned depth, task*& t);
+    // Runs one task while waiting for the given one, returns false if there
+    // was nothing to run.
+    bool help_one(worker* self, task_id awaited);
+    void wait_for_result(basic_result_state* state, task_id awaited);
+    void finish_task(task* t, bool failed);
+
+    struct periodic_timer
+    {
+        periodic_timer();
+
+        std::function<void()> function;
+        unsigned priority;
+        // In ticks.
+        uint64_t period;
+        std::atomic_bool cancelled;
+    };
+
+    // Sits in a slot of the timer wheel, for either a task waiting to be
+    // posted or the next round of a periodic timer.
+    struct timer_entry
+    {
+        timer_entry* next;
+        uint64_t deadline;
+        task* t;
+        std::shared_ptr<periodic_timer> periodic;
+    };
+
+    // Rounds up for deadlines, so that timers never fire early.
+    uint64_t to_tick(clock::time_point time, bool round_up) const;
+    clock::time_point from_tick(uint64_t tick) const;
+    void add_timer(timer_entry* e);
+    // These need timer_mutex. The deadline must not be before timer_tick.
+    void insert_timer(timer_entry* e);
+    // The first tick after timer_tick at which a slot needs to be looked at.
+    uint64_t next_timer_event() const;
+    // Advances the wheel to the current time if a timer may be due, and posts
+    // whatever expired. Returns right away if another thread is already at
+    // it.
+    void poll_timers();
+    bool timers_due() const;
+    void fire_timer(timer_entry* e);
+    // Called when something the task waited for is done.
+    void release_task(task* t);
+
+    // The worker running on the calling thread, if any.
+    static thread_local worker* current_worker;
+
+#ifdef THREAD_POOL_TRACING
+    struct trace_event
+    {
+        task_id id;
+        unsigned priority;
+        uint64_t posted_time, queued_time, start_time, end_time;
+    };
 
-    void queue_task(thread_pool::task&& t);
-    void on_finish_task(task_id id);
-    bool on_fail_task(task_id id);
+    static constexpr size_t TRACE_BUFFER_SIZE = 1 << 14;
 
-    // Tasks with unsatisfied dependencies
-    std::vector<task> pending_tasks;
-    std::priority_queue<task> tasks_queue;
-    // Ids of every task currently pending, in queue or running
-    std::unordered_set<task_id> all_tasks;
+    // An event kept in atomics, so that readers can copy it while it's being
+    // overwritten, and then throw the copy away. The fields are released and
+    // acquired, so a reader that sees any of a new event also sees the write
+    // count from before it.
+    struct trace_slot
+    {
+        void store(const trace_event& e);
+        trace_event load() const;
 
-    std::mutex pending_tasks_mutex, tasks_mutex;
+        std::atomic<uint64_t> id, priority;
+        std::atomic<uint64_t> posted_time, queued_time, start_time, end_time;
+    };
+
+    // Written only by its own thread, without locking. Readers check the
+    // write count before and after copying, to skip events that were
+    // overwritten meanwhile.
+    struct trace_buffer
+    {
+        trace_buffer(unsigned thread, bool worker);
+
+        void push(const trace_event& e);
+        static void add(std::atomic<uint64_t>* counts, uint64_t value);
+
+        unsigned thread;
+        bool worker;
+        std::atomic<uint64_t> written;
+        trace_slot events[TRACE_BUFFER_SIZE];
+
+        std::atomic<uint64_t> queue_depth[histogram::BUCKETS];
+        std::atomic<uint64_t> dependency_wait[histogram::BUCKETS];
+        std::atomic<uint64_t> queue_latency[histogram::BUCKETS];
+        std::atomic<uint64_t> run_time[histogram::BUCKETS];
+    };
+
+    uint64_t trace_time() const;
+    trace_buffer* local_trace_buffer();
+#endif
+
+    // How far down the dependencies of an awaited task to look for something
+    // to run.
+    static constexpr unsigned HELP_SEARCH_DEPTH = 3;
+    // How often a waiting worker with nothing to run checks for new tasks.
+    static constexpr std::chrono::microseconds HELP_POLL_INTERVAL{100};
+    static constexpr unsigned DEFAULT_LANE_AGING = 16;
+    static constexpr std::chrono::microseconds TIMER_TICK{250};
+    // Each level of the wheel has TIMER_SLOTS slots, each slot spanning all
+    // of the level below it.
+    static constexpr unsigned TIMER_LEVELS = 4;
+    static constexpr unsigned TIMER_SLOT_BITS = 8;
+    static constexpr unsigned TIMER_SLOTS = 1u << TIMER_SLOT_BITS;
+    static constexpr std::chrono::microseconds DEFAULT_IDLE_SPIN{20};
+    static constexpr std::chrono::microseconds DEFAULT_IDLE_YIELD{50};
+    // Pauses between looks at the clock while spinning.
+    static constexpr unsigned IDLE_SPIN_BATCH = 64;
+
+    scheduling mode;
+
+    // Task storage. Blocks are never freed while the pool is alive, so a task
+    // id can always be checked against its slot.
+    static constexpr unsigned TASK_BLOCK_BITS = 10;
+    static constexpr unsigned TASK_BLOCK_SIZE = 1u << TASK_BLOCK_BITS;
+    static constexpr unsigned MAX_TASK_BLOCKS = 1u << 12;
+    std::unique_ptr<std::atomic<task*>[]> task_blocks;
+    unsigned task_block_count;
+    // Set by the destructor. Tasks released after that aren't queued, so
+    // breaking the promises of unrun tasks doesn't run their continuations.
+    std::atomic_bool destroying;
+    std::mutex free_tasks_mutex;
+    std::vector<task*> free_tasks;
+
+    // The last task posted with each key, entries are removed when the task
+    // finishes.
+    std::mutex coalescing_mutex;
+    std::unordered_map<coalescing_key, task_id> coalescing_tasks;
+
+    lane_state lanes[LANE_COUNT];
+    // Set once any lane has been given limits.
+    std::atomic_bool lanes_limited;
+    std::atomic_uint lane_aging;
+    // Tasks that make a worker quit.
+    task_queue exit_queue;
+    // Tasks for run_main(). They aren't counted in queued_tasks, since no
+    // worker can take them.
+    task_queue main_queue;
+    // The thread that last called run_main().
+    std::atomic<std::thread::id> main_thread_id;
+    // Set while some thread is running tasks inline because there are no
+    // workers.
+    std::atomic_bool running_inline;
+
+    // Thieves only need a shared lock, resize() takes an exclusive one.
+    mutable std::shared_timed_mutex workers_mutex;
+    std::vector<std::unique_ptr<worker>> workers;
+    // Can be read without the lock.
+    std::atomic_uint worker_count;
+    // Workers that have been told to leave but haven't yet. Changed along
+    // with workers.
+    std::atomic_uint retiring;
+    // Left, but not joined yet.
+    std::vector<std::unique_ptr<worker>> retired_workers;
+    std::mutex retire_mutex;
+    std::condition_variable workers_retired;
+    // Keeps resize() calls from the autoscaler apart from the others.
+    std::mutex resize_mutex;
+    // Also protected by workers_mutex.
+    placement place;
+    std::vector<unsigned> placement_cpus;
+    std::vector<unsigned> allowed_cpus;
+
+    // Protects sleeping on new_task and no_tasks_running.
+    std::mutex sleep_mutex;
     std::condition_variable new_task, no_tasks_running;
 
-    std::vector<std::thread> threads;
-    std::atomic_uint busy_threads, id_counter;
+    std::atomic_uint busy_threads;
+    // Total number of tasks in all queues
+    std::atomic_uint queued_tasks;
+    std::atomic_uint sleeping_threads;
+    // Bumped whenever a sleeping worker may have something new to run, which
+    // isn't just when tasks are queued, since lane limits can hold them back.
+    std::atomic_uint schedule_changes;
+    // Protects the wheel, timer_tick and periodic_timers.
+    std::mutex timer_mutex;
+    clock::time_point timer_epoch;
+    timer_entry* timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+    // The wheel has been advanced up to this tick.
+    uint64_t timer_tick;
+    // Nothing is due before this tick.
+    std::atomic<uint64_t> next_timer_tick;
+    std::atomic_uint timer_count;
+    // Set while one of the sleeping workers sleeps until the next timer
+    // only, so that they don't all wake up for it.
+    std::atomic_bool timer_keeper;
+    timer_id last_timer_id;
+    std::unordered_map<timer_id, std::shared_ptr<periodic_timer>>
+        periodic_timers;
+
+    // Spinning workers notice new tasks by themselves, so nobody needs to be
+    // woken up while there are any.
+    std::atomic_uint spinning_threads;
+    std::atomic<int64_t> idle_spin_ns, idle_yield_ns;
+    std::atomic_bool idle_park;
+
+    std::thread autoscale_thread;
+    std::mutex autoscale_mutex;
+    std::condition_variable autoscale_wake;
+    bool autoscale_stop;
+    autoscale_params autoscale;
+    std::atomic_bool autoscaling;
+    std::atomic<int64_t> max_wait_ns;
+
+#ifdef THREAD_POOL_TRACING
+    // Distinguishes pools in the per-thread buffer cache, since a new pool
+    // may get the address of an old one.
+    static std::atomic<uint64_t> trace_serial_counter;
+    uint64_t trace_serial;
+    std::chrono::steady_clock::time_point trace_epoch;
+    mutable std::mutex trace_mutex;
+    std::vector<std::unique_ptr<trace_buffer>> trace_buffers;
+#endif
 };
 
 #include "thread_pool.tcc"
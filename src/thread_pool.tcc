@@ -25,6 +25,7 @@ SOFTWARE.
 #include <utility>
 #include <typeinfo>
 #include <iostream>
+#include <new>
 
 template<typename F, typename... Args>
 auto thread_pool::post(F&& f, Args&&... args)
@@ -40,59 +41,1113 @@ auto thread_pool::postp(
     Args&&... args
 ) -> post_result<decltype(f(std::forward<Args>(args)...))>
 {
-    return postd({}, priority, f, std::forward<Args>(args)...);
+    return postd({}, priority, std::forward<F>(f), std::forward<Args>(args)...);
 }
 
 template<typename F, typename... Args>
 auto thread_pool::postd(
-    const std::set<task_id>& dependencies,
+    dependency_list dependencies,
     unsigned priority,
     F&& f,
     Args&&... args
 ) -> post_result<decltype(f(std::forward<Args>(args)...))>
 {
-    std::packaged_task<decltype(f(std::forward<Args>(args)...))()> task_func(
-        std::bind(f, std::forward<Args>(args)...)
+    using return_type = decltype(f(std::forward<Args>(args)...));
+
+    // One reference for the task, one for the post_result.
+    result_state<return_type>* state =
+        recycler<result_state<return_type>>::acquire();
+    state->references = 2;
+    state->priority = priority;
+
+    task* t = create_task(priority, false);
+    t->result = state;
+    set_function<return_type>(
+        t,
+        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+    return post_result<return_type>(this, state, post(t, dependencies));
+}
+
+template<typename F, typename... Args>
+auto thread_pool::postd(
+    std::initializer_list<task_id> dependencies,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    return postd(
+        dependency_list(dependencies.begin(), dependencies.size()),
+        priority,
+        std::forward<F>(f),
+        std::forward<Args>(args)...
+    );
+}
+
+template<typename F, typename... Args>
+thread_pool::task_id thread_pool::postf(
+    dependency_list dependencies,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+){
+    task* t = create_task(priority, false);
+    set_function<void>(
+        t,
+        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+    return post(t, dependencies);
+}
+
+template<typename F, typename... Args>
+thread_pool::task_id thread_pool::postf(
+    std::initializer_list<task_id> dependencies,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+){
+    return postf(
+        dependency_list(dependencies.begin(), dependencies.size()),
+        priority,
+        std::forward<F>(f),
+        std::forward<Args>(args)...
+    );
+}
+
+template<typename F, typename... Args>
+auto thread_pool::postk(
+    coalescing_key key,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    using return_type = decltype(f(std::forward<Args>(args)...));
+
+    result_state<return_type>* state =
+        recycler<result_state<return_type>>::acquire();
+    state->references = 2;
+    state->priority = priority;
+
+    task* t = create_task(priority, false);
+    t->result = state;
+    t->keyed = true;
+    t->key = key;
+    set_function<return_type>(
+        t,
+        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+
+    task_id replaced = 0;
+    {
+        std::lock_guard<std::mutex> lock(coalescing_mutex);
+        task_id& last = coalescing_tasks[key];
+        replaced = last;
+        last = t->id;
+    }
+    if(replaced) cancel(replaced);
+
+    return post_result<return_type>(this, state, post(t));
+}
+
+template<typename F, typename... Args>
+auto thread_pool::postm(
+    dependency_list dependencies,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    using return_type = decltype(f(std::forward<Args>(args)...));
+
+    result_state<return_type>* state =
+        recycler<result_state<return_type>>::acquire();
+    state->references = 2;
+    state->priority = priority;
+
+    task* t = create_task(priority, false);
+    t->result = state;
+    t->main_thread = true;
+    set_function<return_type>(
+        t,
+        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+    return post_result<return_type>(this, state, post(t, dependencies));
+}
+
+template<typename F, typename... Args>
+auto thread_pool::postm(
+    std::initializer_list<task_id> dependencies,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    return postm(
+        dependency_list(dependencies.begin(), dependencies.size()),
+        priority,
+        std::forward<F>(f),
+        std::forward<Args>(args)...
+    );
+}
+
+template<typename F, typename... Args>
+auto thread_pool::post_at(
+    clock::time_point time,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    using return_type = decltype(f(std::forward<Args>(args)...));
+
+    result_state<return_type>* state =
+        recycler<result_state<return_type>>::acquire();
+    state->references = 2;
+    state->priority = priority;
+
+    task* t = create_task(priority, false);
+    t->result = state;
+    set_function<return_type>(
+        t,
+        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+    );
+    task_id id = t->id;
+
+    // The task is posted when the timer fires.
+    timer_entry* e = recycler<timer_entry>::acquire();
+    e->deadline = to_tick(time, true);
+    e->t = t;
+    add_timer(e);
+    return post_result<return_type>(this, state, id);
+}
+
+template<typename Rep, typename Period, typename F, typename... Args>
+auto thread_pool::post_after(
+    const std::chrono::duration<Rep, Period>& delay,
+    unsigned priority,
+    F&& f,
+    Args&&... args
+) -> post_result<decltype(f(std::forward<Args>(args)...))>
+{
+    return post_at(
+        clock::now() + std::chrono::duration_cast<clock::duration>(delay),
+        priority,
+        std::forward<F>(f),
+        std::forward<Args>(args)...
+    );
+}
+
+template<typename Rep, typename Period, typename F>
+thread_pool::timer_id thread_pool::post_every(
+    const std::chrono::duration<Rep, Period>& period,
+    unsigned priority,
+    F&& f
+){
+    std::shared_ptr<periodic_timer> p(new periodic_timer());
+    p->function = std::forward<F>(f);
+    p->priority = priority;
+    int64_t length =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(period).count();
+    int64_t tick = std::chrono::nanoseconds(TIMER_TICK).count();
+    p->period = std::max((length + tick - 1) / tick, (int64_t)1);
+
+    timer_id id = 0;
+    {
+        std::lock_guard<std::mutex> lock(timer_mutex);
+        id = ++last_timer_id;
+        periodic_timers[id] = p;
+    }
+
+    timer_entry* e = recycler<timer_entry>::acquire();
+    e->deadline = to_tick(clock::now(), true) + p->period;
+    e->t = nullptr;
+    e->periodic = std::move(p);
+    add_timer(e);
+    return id;
+}
+
+template<typename T>
+thread_pool::post_result<thread_pool::all_result<T>> thread_pool::when_all(
+    std::vector<post_result<T>>&& results,
+    unsigned priority
+){
+    std::vector<basic_result_state*> states;
+    std::vector<state_reference<T>> inputs;
+    for(post_result<T>& r: results)
+    {
+        if(!r.state) throw std::future_error(std::future_errc::no_state);
+        states.push_back(r.state);
+        // The reference of the post_result is taken over.
+        inputs.emplace_back(r.state);
+        r.state = nullptr;
+        r.clear();
+    }
+
+    return post_when<all_result<T>>(
+        states.data(),
+        states.size(),
+        priority,
+        [inputs = std::move(inputs)]() mutable {
+            all_result<T>* tag = nullptr;
+            return take_all(inputs, tag);
+        }
+    );
+}
+
+template<typename T>
+thread_pool::post_result<thread_pool::any_result<T>> thread_pool::when_any(
+    std::vector<post_result<T>>&& results,
+    unsigned priority
+){
+    result_state<any_result<T>>* combined =
+        recycler<result_state<any_result<T>>>::acquire();
+    // One reference for the returned post_result, one for the control.
+    combined->references = 2;
+    combined->priority = priority;
+    auto control = std::make_shared<when_any_control<T>>(combined);
+
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        post_result<T>& r = results[i];
+        if(!r.state) throw std::future_error(std::future_errc::no_state);
+
+        basic_result_state* state = r.state;
+        state_reference<T> input(r.state);
+        r.state = nullptr;
+        r.clear();
+
+        task* t = create_task(priority, false);
+        set_function<void>(
+            t,
+            [control, i, input = std::move(input)](){
+                if(control->done.exchange(true)) return;
+
+                result_state<any_result<T>>* c = control->combined.get();
+                try
+                {
+                    auto value = [&](){
+                        return take_any(i, input.get(), std::is_void<T>());
+                    };
+                    c->set(value);
+                }
+                catch(...)
+                {
+                    c->exception = std::current_exception();
+                }
+                c->complete();
+            }
+        );
+        post_when(t, &state, 1);
+    }
+    return post_result<any_result<T>>(this, combined, 0);
+}
+
+template<typename T>
+thread_pool::promise<T> thread_pool::make_promise(unsigned priority)
+{
+    // The promise's reference, get_result() adds the other one.
+    result_state<T>* state = recycler<result_state<T>>::acquire();
+    state->references = 1;
+    state->priority = priority;
+    return promise<T>(this, state);
+}
+
+template<typename R, typename F>
+thread_pool::post_result<R> thread_pool::post_when(
+    basic_result_state* const* states,
+    size_t count,
+    unsigned priority,
+    F&& f
+){
+    // One reference for the task, one for the post_result.
+    result_state<R>* state = recycler<result_state<R>>::acquire();
+    state->references = 2;
+    state->priority = priority;
+
+    task* t = create_task(priority, false);
+    t->result = state;
+    set_function<R>(t, std::forward<F>(f));
+    return post_result<R>(this, state, post_when(t, states, count));
+}
+
+template<typename F, typename T>
+auto thread_pool::call_with(F& f, result_state<T>* state, std::false_type)
+-> decltype(f(state->take()))
+{
+    return f(state->take());
+}
+
+template<typename F, typename T>
+auto thread_pool::call_with(F& f, result_state<T>* state, std::true_type)
+-> decltype(f())
+{
+    state->take();
+    return f();
+}
+
+template<typename T>
+thread_pool::any_result<T> thread_pool::take_any(
+    size_t index,
+    result_state<T>* state,
+    std::false_type
+){
+    return any_result<T>(index, state->take());
+}
+
+template<typename T>
+thread_pool::any_result<T> thread_pool::take_any(
+    size_t index,
+    result_state<T>* state,
+    std::true_type
+){
+    state->take();
+    return index;
+}
+
+template<typename T>
+std::vector<T> thread_pool::take_all(
+    std::vector<state_reference<T>>& inputs,
+    std::vector<T>*
+){
+    std::vector<T> values;
+    values.reserve(inputs.size());
+    for(state_reference<T>& input: inputs)
+    {
+        values.emplace_back(input->take());
+    }
+    return values;
+}
+
+template<typename T>
+void thread_pool::take_all(
+    std::vector<state_reference<T>>& inputs,
+    void*
+){
+    for(state_reference<T>& input: inputs)
+    {
+        input->take();
+    }
+}
+
+template<typename Index, typename F>
+void thread_pool::parallel_for(Index begin, Index end, F&& f, size_t grain)
+{
+    if(!(begin < end)) return;
+    for_body<Index, typename std::remove_reference<F>::type> body{begin, f};
+    split_root(end - begin, grain, body, char(0));
+}
+
+template<typename Index, typename T, typename F, typename R>
+T thread_pool::parallel_reduce(
+    Index begin,
+    Index end,
+    T identity,
+    F&& f,
+    R&& reduce,
+    size_t grain
+){
+    if(!(begin < end)) return identity;
+    reduce_body<
+        Index,
+        T,
+        typename std::remove_reference<F>::type,
+        typename std::remove_reference<R>::type
+    > body{begin, f, reduce};
+    return split_root(end - begin, grain, body, identity);
+}
+
+template<typename RandomIt, typename Compare>
+void thread_pool::parallel_sort(RandomIt first, RandomIt last, Compare comp)
+{
+    if(last - first < 2) return;
+    sort_context<RandomIt, Compare> ctx(this, first, comp);
+    sort_range(0, last - first, ctx);
+    ctx.rethrow();
+}
+
+template<typename Body>
+typename Body::part_type thread_pool::split_root(
+    size_t size,
+    size_t grain,
+    Body& body,
+    const typename Body::part_type& identity
+){
+    using part_type = typename Body::part_type;
+    range_context<part_type, Body> ctx(
+        this, body, identity, grain ? grain : default_grain(size)
     );
+    part_type part(identity);
+    split_range(0, size, part, ctx);
+    ctx.rethrow();
+    return part;
+}
+
+template<typename Part, typename Body>
+void thread_pool::split_range(
+    size_t begin,
+    size_t end,
+    Part& part,
+    range_context<Part, Body>& ctx
+){
+    split_job* jobs[MAX_SPLIT_JOBS];
+    typename std::aligned_storage<sizeof(Part), alignof(Part)>::type
+        parts[MAX_SPLIT_JOBS];
+    size_t count = 0;
+
+    // Exceptions are caught until the split off jobs have been joined, since
+    // they point to this stack frame.
+    try
+    {
+        size_t grain = ctx.grain;
+        while(end - begin > grain && !ctx.failed)
+        {
+            if(
+                end - begin >= 2 * grain && count < MAX_SPLIT_JOBS &&
+                should_split()
+            ){
+                size_t mid = begin + (end - begin) / 2;
+                Part* p = new (&parts[count]) Part(ctx.identity);
+                try
+                {
+                    jobs[count] = fork_job(
+                        run_range_job<Part, Body>, &ctx, p, mid, end
+                    );
+                }
+                catch(...)
+                {
+                    p->~Part();
+                    throw;
+                }
+                count++;
+                end = mid;
+            }
+            else
+            {
+                ctx.body(begin, begin + grain, part);
+                begin += grain;
+            }
+        }
+        if(!ctx.failed) ctx.body(begin, end, part);
+    }
+    catch(...)
+    {
+        ctx.fail(std::current_exception());
+    }
 
-    return post_result<decltype(f(std::forward<Args>(args)...))>(
-        task_func.get_future(),
-        post(task(std::move(task_func), priority, false), dependencies)
+    // The jobs were split off from the end, so the last one comes right
+    // after the part done here.
+    while(count > 0)
+    {
+        count--;
+        join_job(jobs[count]);
+        Part* p = reinterpret_cast<Part*>(&parts[count]);
+        if(!ctx.failed)
+        {
+            try
+            {
+                ctx.body.merge(part, *p);
+            }
+            catch(...)
+            {
+                ctx.fail(std::current_exception());
+            }
+        }
+        p->~Part();
+    }
+}
+
+template<typename Part, typename Body>
+void thread_pool::run_range_job(split_job* job)
+{
+    auto* ctx = static_cast<range_context<Part, Body>*>(job->context);
+    ctx->pool->split_range(
+        job->begin,
+        job->end,
+        *static_cast<Part*>(job->output),
+        *ctx
     );
 }
 
+template<typename RandomIt, typename Compare>
+void thread_pool::sort_range(
+    size_t begin,
+    size_t end,
+    sort_context<RandomIt, Compare>& ctx
+){
+    using value_type = typename std::iterator_traits<RandomIt>::value_type;
+    split_job* jobs[MAX_SPLIT_JOBS];
+    size_t count = 0;
+
+    try
+    {
+        RandomIt first = ctx.first;
+        while(
+            end - begin > MIN_SORT_SPLIT && count < MAX_SPLIT_JOBS &&
+            !ctx.failed && should_split()
+        ){
+            // Median of three, copied out since partitioning moves it.
+            RandomIt a = first + begin;
+            RandomIt b = first + (begin + (end - begin) / 2);
+            RandomIt c = first + (end - 1);
+            if(ctx.comp(*b, *a)) std::iter_swap(a, b);
+            if(ctx.comp(*c, *b)) std::iter_swap(b, c);
+            if(ctx.comp(*b, *a)) std::iter_swap(a, b);
+            value_type pivot(*b);
+
+            // Elements equal to the pivot are left out of both sides, so that
+            // every round makes progress.
+            RandomIt less = std::partition(
+                first + begin,
+                first + end,
+                [&](const value_type& v){ return ctx.comp(v, pivot); }
+            );
+            RandomIt greater = std::partition(
+                less,
+                first + end,
+                [&](const value_type& v){ return !ctx.comp(pivot, v); }
+            );
+
+            jobs[count] = fork_job(
+                run_sort_job<RandomIt, Compare>,
+                &ctx,
+                nullptr,
+                greater - first,
+                end
+            );
+            count++;
+            end = less - first;
+        }
+        if(!ctx.failed)
+        {
+            std::sort(first + begin, first + end, ctx.comp);
+        }
+    }
+    catch(...)
+    {
+        ctx.fail(std::current_exception());
+    }
+
+    while(count > 0) join_job(jobs[--count]);
+}
+
+template<typename RandomIt, typename Compare>
+void thread_pool::run_sort_job(split_job* job)
+{
+    auto* ctx = static_cast<sort_context<RandomIt, Compare>*>(job->context);
+    ctx->pool->sort_range(job->begin, job->end, *ctx);
+}
+
+template<typename Part, typename Body>
+thread_pool::range_context<Part, Body>::range_context(
+    thread_pool* pool,
+    Body& body,
+    const Part& identity,
+    size_t grain
+): pool(pool), body(body), identity(identity), grain(grain) {}
+
+template<typename Index, typename F>
+void thread_pool::for_body<Index, F>::operator()(
+    size_t begin,
+    size_t end,
+    char&
+){
+    for(size_t i = begin; i < end; ++i)
+    {
+        f(static_cast<Index>(first + i));
+    }
+}
+
+template<typename Index, typename F>
+void thread_pool::for_body<Index, F>::merge(char&, char&) {}
+
+template<typename Index, typename T, typename F, typename R>
+void thread_pool::reduce_body<Index, T, F, R>::operator()(
+    size_t begin,
+    size_t end,
+    T& part
+){
+    for(size_t i = begin; i < end; ++i)
+    {
+        part = reduce(std::move(part), f(static_cast<Index>(first + i)));
+    }
+}
+
+template<typename Index, typename T, typename F, typename R>
+void thread_pool::reduce_body<Index, T, F, R>::merge(T& part, T& next)
+{
+    part = reduce(std::move(part), std::move(next));
+}
+
+template<typename RandomIt, typename Compare>
+thread_pool::sort_context<RandomIt, Compare>::sort_context(
+    thread_pool* pool,
+    RandomIt first,
+    Compare& comp
+): pool(pool), first(first), comp(comp) {}
+
+template<typename Handle>
+void thread_pool::schedule_awaiter::await_suspend(Handle h)
+{
+    pool->postf({}, priority, [h]() mutable { h.resume(); });
+}
+
+template<typename C>
+thread_pool::dependency_list::dependency_list(const C& container)
+: ids(container.data()), count(container.size()) {}
+
+template<typename R, typename F>
+void thread_pool::set_function(task* t, F&& f)
+{
+    using function_type = typename std::decay<F>::type;
+    if(
+        sizeof(function_type) <= task::INLINE_FUNCTION_SIZE &&
+        alignof(function_type) <= alignof(std::max_align_t)
+    ){
+        new (&t->function_storage) function_type(std::forward<F>(f));
+    }
+    else
+    {
+        new (&t->function_storage) function_type*(
+            new function_type(std::forward<F>(f))
+        );
+    }
+    t->invoke = invoke_function<R, function_type>;
+    t->destroy = destroy_function<function_type>;
+}
+
+template<typename R, typename F>
+void thread_pool::invoke_function(task* t)
+{
+    F& f = t->function<F>();
+    if(t->result) static_cast<result_state<R>*>(t->result)->set(f);
+    else f();
+}
+
 template<typename F>
-thread_pool::task::task(F&& func, unsigned priority, bool finish_thread)
-: task_func(std::forward<F>(func)), priority(priority),
-  finish_thread(finish_thread)
-{}
+void thread_pool::destroy_function(task* t)
+{
+    if(
+        sizeof(F) <= task::INLINE_FUNCTION_SIZE &&
+        alignof(F) <= alignof(std::max_align_t)
+    ) t->function<F>().~F();
+    else delete &t->function<F>();
+}
+
+template<typename F>
+F& thread_pool::task::function()
+{
+    if(
+        sizeof(F) <= INLINE_FUNCTION_SIZE &&
+        alignof(F) <= alignof(std::max_align_t)
+    ) return *reinterpret_cast<F*>(&function_storage);
+    else return **reinterpret_cast<F**>(&function_storage);
+}
+
+template<typename Rep, typename Period>
+bool thread_pool::basic_result_state::wait_for(
+    const std::chrono::duration<Rep, Period>& timeout
+){
+    if(ready) return true;
+    std::unique_lock<std::mutex> lk(ready_mutex);
+    return ready_cv.wait_for(lk, timeout, [this]{ return ready.load(); });
+}
+
+template<typename T>
+template<typename F>
+void thread_pool::result_state<T>::set(F& f)
+{
+    set(f, std::is_void<T>());
+}
+
+template<typename T>
+template<typename F>
+void thread_pool::result_state<T>::set(F& f, std::true_type)
+{
+    f();
+    has_value = true;
+}
+
+template<typename T>
+template<typename F>
+void thread_pool::result_state<T>::set(F& f, std::false_type)
+{
+    new (&value) T(f());
+    has_value = true;
+}
+
+template<typename T>
+T thread_pool::result_state<T>::take()
+{
+    rethrow();
+    return take(std::is_void<T>());
+}
+
+template<typename T>
+void thread_pool::result_state<T>::take(std::true_type) {}
+
+template<typename T>
+T thread_pool::result_state<T>::take(std::false_type)
+{
+    return std::move(*reinterpret_cast<T*>(&value));
+}
+
+template<typename T>
+void thread_pool::result_state<T>::recycle()
+{
+    if(!std::is_void<T>::value && has_value)
+    {
+        reinterpret_cast<value_type*>(&value)->~value_type();
+    }
+    has_value = false;
+    ready = false;
+    exception = nullptr;
+    waiters = nullptr;
+    recycler<result_state<T>>::release(this);
+}
+
+template<typename T>
+constexpr size_t thread_pool::recycler<T>::BATCH_SIZE;
+
+template<typename T>
+T* thread_pool::recycler<T>::acquire()
+{
+    local_list& l = local();
+    if(l.count == 0)
+    {
+        shared_list& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        while(l.count < BATCH_SIZE && !s.objects.empty())
+        {
+            l.objects[l.count++] = s.objects.back();
+            s.objects.pop_back();
+        }
+    }
+    if(l.count == 0) return new T();
+
+    return l.objects[--l.count];
+}
+
+template<typename T>
+void thread_pool::recycler<T>::release(T* obj)
+{
+    local_list& l = local();
+    if(l.count == 2 * BATCH_SIZE)
+    {
+        shared_list& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        while(l.count > BATCH_SIZE)
+        {
+            s.objects.push_back(l.objects[--l.count]);
+        }
+    }
+    l.objects[l.count++] = obj;
+}
+
+template<typename T>
+thread_pool::recycler<T>::shared_list::~shared_list()
+{
+    for(T* obj: objects) delete obj;
+}
+
+template<typename T>
+thread_pool::recycler<T>::local_list::local_list(): count(0) {}
+
+template<typename T>
+thread_pool::recycler<T>::local_list::~local_list()
+{
+    shared_list& s = shared();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.objects.insert(s.objects.end(), objects, objects + count);
+}
+
+template<typename T>
+typename thread_pool::recycler<T>::shared_list&
+thread_pool::recycler<T>::shared()
+{
+    static shared_list s;
+    return s;
+}
+
+template<typename T>
+typename thread_pool::recycler<T>::local_list&
+thread_pool::recycler<T>::local()
+{
+    static thread_local local_list l;
+    return l;
+}
+
+template<typename T>
+thread_pool::state_reference<T>::state_reference(result_state<T>* state)
+: state(state) {}
+
+template<typename T>
+thread_pool::state_reference<T>::state_reference(state_reference&& other)
+: state(other.state)
+{
+    other.state = nullptr;
+}
 
 template<typename T>
-thread_pool::post_result<T>::post_result(): id(0) {}
+thread_pool::state_reference<T>::~state_reference()
+{
+    if(state) state->remove_reference();
+}
+
+template<typename T>
+thread_pool::result_state<T>* thread_pool::state_reference<T>::get() const
+{
+    return state;
+}
+
+template<typename T>
+thread_pool::result_state<T>*
+thread_pool::state_reference<T>::operator->() const
+{
+    return state;
+}
+
+template<typename T>
+thread_pool::when_any_control<T>::when_any_control(
+    result_state<any_result<T>>* combined
+): done(false), combined(combined) {}
+
+template<typename T>
+thread_pool::when_any_control<T>::~when_any_control()
+{
+    if(!done) combined->complete();
+}
+
+template<typename T>
+thread_pool::promise<T>::promise()
+: pool(nullptr), state(nullptr), retrieved(false) {}
+
+template<typename T>
+thread_pool::promise<T>::promise(promise&& other)
+: pool(other.pool), state(other.state), retrieved(other.retrieved)
+{
+    other.state = nullptr;
+}
+
+template<typename T>
+thread_pool::promise<T>::promise(thread_pool* pool, result_state<T>* state)
+: pool(pool), state(state), retrieved(false) {}
+
+template<typename T>
+thread_pool::promise<T>::~promise()
+{
+    if(state) complete();
+}
+
+template<typename T>
+thread_pool::promise<T>& thread_pool::promise<T>::operator=(promise&& other)
+{
+    if(this != &other)
+    {
+        if(state) complete();
+        pool = other.pool;
+        state = other.state;
+        retrieved = other.retrieved;
+        other.state = nullptr;
+    }
+    return *this;
+}
+
+template<typename T>
+bool thread_pool::promise<T>::valid() const
+{
+    return state != nullptr;
+}
+
+template<typename T>
+thread_pool::post_result<T> thread_pool::promise<T>::get_result()
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    if(retrieved)
+    {
+        throw std::future_error(std::future_errc::future_already_retrieved);
+    }
+    retrieved = true;
+    state->add_reference();
+    return post_result<T>(pool, state, 0);
+}
+
+template<typename T>
+template<typename... Args>
+void thread_pool::promise<T>::set_value(Args&&... args)
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    set(std::is_void<T>(), std::forward<Args>(args)...);
+    complete();
+}
+
+template<typename T>
+void thread_pool::promise<T>::set_exception(std::exception_ptr exception)
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    state->exception = exception;
+    complete();
+}
+
+template<typename T>
+void thread_pool::promise<T>::set(std::true_type)
+{
+    auto f = [](){};
+    state->set(f);
+}
+
+template<typename T>
+template<typename... Args>
+void thread_pool::promise<T>::set(std::false_type, Args&&... args)
+{
+    auto f = [&](){ return T(std::forward<Args>(args)...); };
+    state->set(f);
+}
+
+template<typename T>
+void thread_pool::promise<T>::complete()
+{
+    state->complete();
+    state->remove_reference();
+    state = nullptr;
+}
+
+template<typename T>
+thread_pool::post_result<T>::post_result()
+: pool(nullptr), state(nullptr), id(0) {}
 
 template<typename T>
 thread_pool::post_result<T>::post_result(post_result&& other)
-: std::future<T>(std::move(other)), id(other.id) {}
+: pool(other.pool), state(other.state), id(other.id)
+{
+    other.state = nullptr;
+    other.id = 0;
+}
 
 template<typename T>
-thread_pool::post_result<T>::post_result(std::future<T>&& f, task_id id)
-: std::future<T>(std::move(f)), id(id) {}
+thread_pool::post_result<T>::post_result(
+    thread_pool* pool,
+    result_state<T>* state,
+    task_id id
+): pool(pool), state(state), id(id) {}
+
+template<typename T>
+thread_pool::post_result<T>::~post_result()
+{
+    clear();
+}
 
 template<typename T>
 thread_pool::post_result<T>& thread_pool::post_result<T>::operator=(
     post_result&& other
 ) {
-    id = other.id;
-    std::future<T>::operator=(std::move(other));
-    other.clear();
+    if(this != &other)
+    {
+        clear();
+        pool = other.pool;
+        state = other.state;
+        id = other.id;
+        other.state = nullptr;
+        other.id = 0;
+    }
     return *this;
 }
 
+template<typename T>
+bool thread_pool::post_result<T>::valid() const
+{
+    return state != nullptr;
+}
+
+template<typename T>
+void thread_pool::post_result<T>::wait() const
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    if(pool) pool->wait_for_result(state, id);
+    else state->wait();
+}
+
+template<typename T>
+template<typename Rep, typename Period>
+std::future_status thread_pool::post_result<T>::wait_for(
+    const std::chrono::duration<Rep, Period>& timeout
+) const
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    return state->wait_for(timeout) ?
+        std::future_status::ready : std::future_status::timeout;
+}
+
+template<typename T>
+T thread_pool::post_result<T>::get()
+{
+    wait();
+
+    // The state must be released even if take() throws.
+    struct releaser
+    {
+        ~releaser() { r.clear(); }
+        post_result& r;
+    } release{*this};
+    return state->take();
+}
+
+template<typename T>
+template<typename F>
+auto thread_pool::post_result<T>::then(F&& f, unsigned priority)
+-> post_result<typename continuation<typename std::decay<F>::type, T>::type>
+{
+    using return_type =
+        typename continuation<typename std::decay<F>::type, T>::type;
+    if(!state) throw std::future_error(std::future_errc::no_state);
+
+    // The continuation takes over our reference to the state.
+    basic_result_state* waited = state;
+    state_reference<T> input(state);
+    state = nullptr;
+    thread_pool* p = pool;
+    clear();
+
+    return p->template post_when<return_type>(
+        &waited,
+        1,
+        priority,
+        [f = std::forward<F>(f), input = std::move(input)]() mutable {
+            return call_with(f, input.get(), std::is_void<T>());
+        }
+    );
+}
+
+template<typename T>
+bool thread_pool::post_result<T>::await_ready() const
+{
+    if(!state) throw std::future_error(std::future_errc::no_state);
+    return state->is_ready();
+}
+
+template<typename T>
+template<typename Handle>
+void thread_pool::post_result<T>::await_suspend(Handle h)
+{
+    basic_result_state* waited = state;
+    task* t = pool->create_task(state->priority, false);
+    set_function<void>(t, [h]() mutable { h.resume(); });
+    pool->post_when(t, &waited, 1);
+}
+
+template<typename T>
+T thread_pool::post_result<T>::await_resume()
+{
+    return get();
+}
+
 template<typename T>
 void thread_pool::post_result<T>::clear()
 {
-    id = 0;    
-    std::future<T>::operator=(std::future<T>());
+    if(state) state->remove_reference();
+    state = nullptr;
+    id = 0;
 }
 
 template<typename T>
@@ -101,3 +1156,8 @@ thread_pool::task_id thread_pool::post_result<T>::get_id() const
     return id;
 }
 
+template<typename T>
+bool thread_pool::post_result<T>::cancel()
+{
+    return pool && id && pool->cancel(id);
+}
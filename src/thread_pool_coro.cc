@@ -0,0 +1,206 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "thread_pool_coro.hh"
+#include <new>
+
+constexpr size_t coroutine_frame_allocator::MIN_FRAME_SIZE;
+constexpr size_t coroutine_frame_allocator::SIZE_CLASSES;
+constexpr size_t coroutine_frame_allocator::BATCH_SIZE;
+
+void* coroutine_frame_allocator::allocate(size_t size)
+{
+    size_t c = size_class(size);
+    if(c >= SIZE_CLASSES) return ::operator new(size);
+
+    free_list& l = local().lists[c];
+    if(l.count == 0)
+    {
+        shared_lists& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        l.take(s.lists[c], BATCH_SIZE);
+    }
+    if(l.count == 0) return ::operator new(class_size(c));
+    return l.pop();
+}
+
+void coroutine_frame_allocator::deallocate(void* ptr, size_t size)
+{
+    size_t c = size_class(size);
+    if(c >= SIZE_CLASSES)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+
+    free_list& l = local().lists[c];
+    if(l.count == 2 * BATCH_SIZE)
+    {
+        shared_lists& s = shared();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.lists[c].take(l, BATCH_SIZE);
+    }
+    l.push(static_cast<free_frame*>(ptr));
+}
+
+size_t coroutine_frame_allocator::size_class(size_t size)
+{
+    size_t c = 0;
+    while(class_size(c) < size) ++c;
+    return c;
+}
+
+size_t coroutine_frame_allocator::class_size(size_t size_class)
+{
+    return MIN_FRAME_SIZE << size_class;
+}
+
+coroutine_frame_allocator::shared_lists& coroutine_frame_allocator::shared()
+{
+    static shared_lists s;
+    return s;
+}
+
+coroutine_frame_allocator::local_lists& coroutine_frame_allocator::local()
+{
+    static thread_local local_lists l;
+    return l;
+}
+
+coroutine_frame_allocator::free_list::free_list(): head(nullptr), count(0) {}
+
+void coroutine_frame_allocator::free_list::push(free_frame* frame)
+{
+    frame->next = head;
+    head = frame;
+    count++;
+}
+
+coroutine_frame_allocator::free_frame*
+coroutine_frame_allocator::free_list::pop()
+{
+    free_frame* frame = head;
+    head = frame->next;
+    count--;
+    return frame;
+}
+
+void coroutine_frame_allocator::free_list::take(
+    free_list& other,
+    size_t count
+){
+    while(count-- > 0 && other.count > 0) push(other.pop());
+}
+
+coroutine_frame_allocator::shared_lists::~shared_lists()
+{
+    for(free_list& l: lists)
+    {
+        while(l.count > 0) ::operator delete(l.pop());
+    }
+}
+
+coroutine_frame_allocator::local_lists::~local_lists()
+{
+    shared_lists& s = shared();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for(size_t c = 0; c < SIZE_CLASSES; ++c)
+    {
+        s.lists[c].take(lists[c], lists[c].count);
+    }
+}
+
+sync_waiter::sync_waiter(): done(false) {}
+
+void sync_waiter::notify()
+{
+    // Notified under the lock, since the waiter is gone as soon as wait()
+    // returns.
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    cv.notify_all();
+}
+
+void sync_waiter::wait()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this]{ return done; });
+}
+
+bool basic_task_promise::final_awaiter::await_ready() const noexcept
+{
+    return false;
+}
+
+std::coroutine_handle<> basic_task_promise::final_awaiter::await_suspend(
+    std::coroutine_handle<>
+) noexcept
+{
+    if(promise->continuation) return promise->continuation;
+    // The task may be destroyed right after this, so nothing can be touched
+    // after notifying.
+    if(promise->waiter) promise->waiter->notify();
+    return std::noop_coroutine();
+}
+
+void basic_task_promise::final_awaiter::await_resume() const noexcept {}
+
+basic_task_promise::basic_task_promise()
+: continuation(nullptr), waiter(nullptr) {}
+
+void* basic_task_promise::operator new(size_t size)
+{
+    return coroutine_frame_allocator::allocate(size);
+}
+
+void basic_task_promise::operator delete(void* ptr, size_t size)
+{
+    coroutine_frame_allocator::deallocate(ptr, size);
+}
+
+std::suspend_always basic_task_promise::initial_suspend() const noexcept
+{
+    return {};
+}
+
+basic_task_promise::final_awaiter basic_task_promise::final_suspend() noexcept
+{
+    return final_awaiter{this};
+}
+
+void basic_task_promise::unhandled_exception()
+{
+    exception = std::current_exception();
+}
+
+void basic_task_promise::rethrow() const
+{
+    if(exception) std::rethrow_exception(exception);
+}
+
+void task_promise<void>::return_void() {}
+
+void task_promise<void>::result()
+{
+    rethrow();
+}
@@ -0,0 +1,223 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef PONG_THREAD_POOL_CORO_HH
+#define PONG_THREAD_POOL_CORO_HH
+#include "thread_pool.hh"
+#include <coroutine>
+#include <optional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstddef>
+
+// Coroutines on top of thread_pool. Needs C++20, build with
+// -Dcoroutines=true.
+//
+//     task<int> load(thread_pool& pool)
+//     {
+//         co_await pool.schedule(PRIORITY_HIGH);
+//         int a = co_await pool.post(read_something);
+//         co_return a + co_await load_more(pool);
+//     }
+//
+//     int value = sync_wait(load(pool));
+//
+// Tasks are lazy, they start on the thread that awaits them or gives them to
+// sync_wait(). co_await pool.schedule() moves the coroutine onto a worker, and
+// awaiting a post_result resumes it on a worker once the result is ready.
+
+// Coroutine frames come from here, so that starting and suspending tasks
+// doesn't touch malloc once things have warmed up. Each thread keeps free
+// frames of its own and trades them with a shared list in batches.
+class coroutine_frame_allocator
+{
+public:
+    static void* allocate(size_t size);
+    static void deallocate(void* ptr, size_t size);
+
+private:
+    // Frames are rounded up to powers of two, starting from MIN_FRAME_SIZE.
+    // Larger ones go straight to the allocator.
+    static constexpr size_t MIN_FRAME_SIZE = 64;
+    static constexpr size_t SIZE_CLASSES = 8;
+    static constexpr size_t BATCH_SIZE = 32;
+
+    // Free frames are linked through themselves.
+    struct free_frame
+    {
+        free_frame* next;
+    };
+
+    struct free_list
+    {
+        free_list();
+
+        void push(free_frame* frame);
+        free_frame* pop();
+        // Moves up to count frames over from other.
+        void take(free_list& other, size_t count);
+
+        free_frame* head;
+        size_t count;
+    };
+
+    struct shared_lists
+    {
+        ~shared_lists();
+
+        std::mutex mutex;
+        free_list lists[SIZE_CLASSES];
+    };
+
+    struct local_lists
+    {
+        ~local_lists();
+
+        free_list lists[SIZE_CLASSES];
+    };
+
+    static size_t size_class(size_t size);
+    static size_t class_size(size_t size_class);
+    static shared_lists& shared();
+    static local_lists& local();
+};
+
+// Lets sync_wait() sleep until a task is done.
+class sync_waiter
+{
+public:
+    sync_waiter();
+
+    void notify();
+    void wait();
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done;
+};
+
+class basic_task_promise
+{
+public:
+    // Resumes whoever was waiting for the task.
+    struct final_awaiter
+    {
+        bool await_ready() const noexcept;
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<> h
+        ) noexcept;
+        void await_resume() const noexcept;
+
+        basic_task_promise* promise;
+    };
+
+    basic_task_promise();
+
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr, size_t size);
+
+    std::suspend_always initial_suspend() const noexcept;
+    final_awaiter final_suspend() noexcept;
+    void unhandled_exception();
+
+    // Only one of these is set.
+    std::coroutine_handle<> continuation;
+    sync_waiter* waiter;
+
+protected:
+    void rethrow() const;
+
+    std::exception_ptr exception;
+};
+
+template<typename T>
+class task_promise: public basic_task_promise
+{
+public:
+    template<typename U>
+    void return_value(U&& value);
+    T result();
+
+private:
+    std::optional<T> value;
+};
+
+template<>
+class task_promise<void>: public basic_task_promise
+{
+public:
+    void return_void();
+    void result();
+};
+
+template<typename T = void>
+class task
+{
+public:
+    class promise_type: public task_promise<T>
+    {
+    public:
+        task get_return_object();
+    };
+
+    class awaiter
+    {
+    public:
+        explicit awaiter(std::coroutine_handle<promise_type> h);
+
+        bool await_ready() const;
+        // Starts the task, the awaiting coroutine is resumed once it's done.
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting);
+        T await_resume();
+
+    private:
+        std::coroutine_handle<promise_type> h;
+    };
+
+    task();
+    task(task&& other);
+    task(const task& other) = delete;
+    ~task();
+
+    task& operator=(task&& other);
+
+    bool valid() const;
+    awaiter operator co_await() &&;
+
+private:
+    template<typename U>
+    friend U sync_wait(task<U> t);
+
+    explicit task(std::coroutine_handle<promise_type> h);
+
+    std::coroutine_handle<promise_type> h;
+};
+
+// Runs the task and blocks until it's done. Rethrows anything the task threw.
+template<typename T>
+T sync_wait(task<T> t);
+
+#include "thread_pool_coro.tcc"
+#endif
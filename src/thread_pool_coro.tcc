@@ -0,0 +1,125 @@
+/*
+MIT License
+
+Copyright (c) 2017 Julius Ikkala
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "thread_pool_coro.hh"
+#include <utility>
+#include <future>
+
+template<typename T>
+template<typename U>
+void task_promise<T>::return_value(U&& value)
+{
+    this->value.emplace(std::forward<U>(value));
+}
+
+template<typename T>
+T task_promise<T>::result()
+{
+    rethrow();
+    return std::move(*value);
+}
+
+template<typename T>
+task<T> task<T>::promise_type::get_return_object()
+{
+    return task(std::coroutine_handle<promise_type>::from_promise(*this));
+}
+
+template<typename T>
+task<T>::awaiter::awaiter(std::coroutine_handle<promise_type> h)
+: h(h) {}
+
+template<typename T>
+bool task<T>::awaiter::await_ready() const
+{
+    return false;
+}
+
+template<typename T>
+std::coroutine_handle<> task<T>::awaiter::await_suspend(
+    std::coroutine_handle<> awaiting
+){
+    h.promise().continuation = awaiting;
+    return h;
+}
+
+template<typename T>
+T task<T>::awaiter::await_resume()
+{
+    return h.promise().result();
+}
+
+template<typename T>
+task<T>::task(): h(nullptr) {}
+
+template<typename T>
+task<T>::task(std::coroutine_handle<promise_type> h): h(h) {}
+
+template<typename T>
+task<T>::task(task&& other): h(other.h)
+{
+    other.h = nullptr;
+}
+
+template<typename T>
+task<T>::~task()
+{
+    if(h) h.destroy();
+}
+
+template<typename T>
+task<T>& task<T>::operator=(task&& other)
+{
+    if(this != &other)
+    {
+        if(h) h.destroy();
+        h = other.h;
+        other.h = nullptr;
+    }
+    return *this;
+}
+
+template<typename T>
+bool task<T>::valid() const
+{
+    return h != nullptr;
+}
+
+template<typename T>
+typename task<T>::awaiter task<T>::operator co_await() &&
+{
+    if(!h) throw std::future_error(std::future_errc::no_state);
+    return awaiter(h);
+}
+
+template<typename T>
+T sync_wait(task<T> t)
+{
+    if(!t.h) throw std::future_error(std::future_errc::no_state);
+
+    sync_waiter waiter;
+    t.h.promise().waiter = &waiter;
+    t.h.resume();
+    waiter.wait();
+    return t.h.promise().result();
+}
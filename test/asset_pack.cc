@@ -0,0 +1,277 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <random>
+#include <map>
+#include <algorithm>
+#include <cstring>
+#include "asset_pack.hh"
+#include "lz4.hh"
+#include "thread_pool.hh"
+
+static std::string temp_path(const std::string& name)
+{
+    return testing::TempDir() + name;
+}
+
+static std::vector<uint8_t> bytes(size_t size, uint8_t first)
+{
+    std::vector<uint8_t> data(size);
+    for(size_t i = 0; i < size; ++i) data[i] = first + i;
+    return data;
+}
+
+static std::vector<uint8_t> contents(asset_view view)
+{
+    return std::vector<uint8_t>(view.data, view.data + view.size);
+}
+
+static bool aligned(asset_view view)
+{
+    return reinterpret_cast<uintptr_t>(view.data) % asset_pack::ALIGNMENT == 0;
+}
+
+// Text-like data that compresses, random data that doesn't.
+static std::vector<uint8_t> compressible(size_t size)
+{
+    static const char* words[] = {"ball ", "paddle ", "score ", "pong "};
+    std::mt19937 rng(size);
+    std::vector<uint8_t> data;
+    while(data.size() < size)
+    {
+        const char* word = words[rng() % 4];
+        data.insert(data.end(), word, word + strlen(word));
+    }
+    data.resize(size);
+    return data;
+}
+
+static std::vector<uint8_t> random_bytes(size_t size)
+{
+    std::mt19937 rng(size);
+    std::vector<uint8_t> data(size);
+    for(uint8_t& byte: data) byte = rng();
+    return data;
+}
+
+TEST(Lz4Test, RoundTripTest)
+{
+    std::vector<std::vector<uint8_t>> inputs = {
+        {}, {1}, bytes(12, 0), bytes(13, 0), std::vector<uint8_t>(1000, 7),
+        compressible(100000), random_bytes(100000)
+    };
+    for(const std::vector<uint8_t>& input: inputs)
+    {
+        std::vector<uint8_t> compressed(lz4_compress_bound(input.size()));
+        size_t size = lz4_compress(
+            input.data(), input.size(), compressed.data(), compressed.size()
+        );
+        ASSERT_GT(size, 0);
+
+        std::vector<uint8_t> output(input.size());
+        ASSERT_TRUE(lz4_decompress(
+            compressed.data(), size, output.data(), output.size()
+        ));
+        ASSERT_EQ(output, input);
+    }
+
+    // Repetitive data shrinks a lot, and too little room fails cleanly.
+    std::vector<uint8_t> input = compressible(100000);
+    std::vector<uint8_t> compressed(lz4_compress_bound(input.size()));
+    size_t size = lz4_compress(
+        input.data(), input.size(), compressed.data(), compressed.size()
+    );
+    ASSERT_LT(size, input.size() / 2);
+    ASSERT_EQ(
+        lz4_compress(input.data(), input.size(), compressed.data(), size - 1),
+        0
+    );
+
+    // Corrupt or cut off data is caught, without going out of bounds.
+    std::vector<uint8_t> output(input.size());
+    ASSERT_FALSE(lz4_decompress(
+        compressed.data(), size / 2, output.data(), output.size()
+    ));
+    ASSERT_FALSE(lz4_decompress(
+        compressed.data(), size, output.data(), output.size() - 1
+    ));
+    std::mt19937 rng(1);
+    compressed.resize(size);
+    for(unsigned i = 0; i < 200; ++i)
+    {
+        std::vector<uint8_t> corrupt = compressed;
+        corrupt[rng() % size] ^= 1 << (rng() % 8);
+        lz4_decompress(corrupt.data(), size, output.data(), output.size());
+    }
+}
+
+TEST(AssetPackTest, RoundTripTest)
+{
+    std::string path = temp_path("round_trip.pack");
+    asset_pack_writer writer;
+    writer.add("shaders/vertex.spv", bytes(1000, 1));
+    writer.add("empty", {});
+    writer.add("a", bytes(3, 7));
+    writer.add("a", bytes(5, 9));
+    writer.write(path);
+
+    asset_pack pack(path);
+    ASSERT_EQ(pack.size(), 3);
+    // The table of contents is sorted.
+    ASSERT_EQ(pack.name(0), "a");
+    ASSERT_EQ(pack.name(1), "empty");
+    ASSERT_EQ(pack.name(2), "shaders/vertex.spv");
+
+    asset_view view = pack.get("shaders/vertex.spv");
+    ASSERT_EQ(contents(view), bytes(1000, 1));
+    ASSERT_TRUE(aligned(view));
+
+    // Adding a name again replaces the asset.
+    view = pack.get("a");
+    ASSERT_EQ(contents(view), bytes(5, 9));
+    ASSERT_TRUE(aligned(view));
+    ASSERT_EQ(pack.get("empty").size, 0);
+
+    ASSERT_FALSE(pack.find("shaders", view));
+    ASSERT_FALSE(pack.find("b", view));
+    ASSERT_THROW(pack.get("missing"), std::out_of_range);
+    std::remove(path.c_str());
+}
+
+TEST(AssetPackTest, LookupTest)
+{
+    std::string path = temp_path("lookup.pack");
+    asset_pack_writer writer;
+    for(unsigned i = 0; i < 1000; ++i)
+    {
+        writer.add("asset" + std::to_string(i), bytes(i % 100, i));
+    }
+    writer.write(path);
+
+    asset_pack pack(path);
+    for(unsigned i = 0; i < 1000; ++i)
+    {
+        ASSERT_EQ(
+            contents(pack.get("asset" + std::to_string(i))),
+            bytes(i % 100, i)
+        );
+    }
+    std::remove(path.c_str());
+}
+
+TEST(AssetPackTest, CompressedTest)
+{
+    std::string path = temp_path("compressed.pack");
+    asset_pack_writer writer(4096);
+    std::vector<uint8_t> text = compressible(100000);
+    std::vector<uint8_t> noise = random_bytes(50000);
+    // Only the first half of this one is worth compressing.
+    std::vector<uint8_t> mixed = compressible(20000);
+    mixed.insert(mixed.end(), noise.begin(), noise.begin() + 20000);
+    writer.add("text", text, true);
+    writer.add("noise", noise, true);
+    writer.add("mixed", mixed, true);
+    writer.add("plain", text);
+    writer.write(path);
+
+    asset_pack pack(path);
+    ASSERT_TRUE(pack.is_compressed("text"));
+    ASSERT_TRUE(pack.is_compressed("mixed"));
+    // Nothing was saved, so it's stored as is and can be viewed.
+    ASSERT_FALSE(pack.is_compressed("noise"));
+    ASSERT_EQ(contents(pack.get("noise")), noise);
+    ASSERT_THROW(pack.get("text"), std::runtime_error);
+
+    thread_pool pool(4);
+    for(thread_pool* p: {(thread_pool*)nullptr, &pool})
+    {
+        for(auto& pair: std::map<std::string, std::vector<uint8_t>>{
+            {"text", text}, {"noise", noise}, {"mixed", mixed}, {"plain", text}
+        }){
+            ASSERT_EQ(pack.size_of(pair.first), pair.second.size());
+            std::vector<uint8_t> output(pack.size_of(pair.first));
+            pack.read(pair.first, output.data(), p);
+            ASSERT_EQ(output, pair.second);
+        }
+    }
+    ASSERT_THROW(pack.size_of("missing"), std::out_of_range);
+    std::remove(path.c_str());
+}
+
+TEST(AssetPackTest, ExtentTest)
+{
+    std::string path = temp_path("extent.pack");
+    asset_pack_writer writer(4096);
+    std::vector<uint8_t> text = compressible(100000);
+    writer.add("text", text, true);
+    writer.add("plain", bytes(1000, 3));
+    writer.add("empty", {});
+    writer.write(path);
+
+    asset_pack pack(path);
+    size_t offset, size;
+    pack.extent_of("plain", offset, size);
+    ASSERT_EQ(offset % asset_pack::ALIGNMENT, 0u);
+    ASSERT_EQ(size, 1000u);
+    pack.extent_of("empty", offset, size);
+    ASSERT_EQ(size, 0u);
+    // The chunk table and the chunks, which are smaller than the text.
+    pack.extent_of("text", offset, size);
+    ASSERT_GT(size, 0u);
+    ASSERT_LT(size, text.size());
+    ASSERT_THROW(pack.extent_of("missing", offset, size), std::out_of_range);
+
+    // No two assets overlap.
+    std::vector<std::pair<size_t, size_t>> extents;
+    for(const char* name: {"text", "plain", "empty"})
+    {
+        pack.extent_of(name, offset, size);
+        extents.emplace_back(offset, offset + size);
+        // Only a hint, so it changes nothing that can be seen.
+        pack.prefetch(offset, size);
+    }
+    std::sort(extents.begin(), extents.end());
+    for(size_t i = 1; i < extents.size(); ++i)
+    {
+        ASSERT_LE(extents[i - 1].second, extents[i].first);
+    }
+    // Ranges past the end are ignored.
+    pack.prefetch(offset, SIZE_MAX);
+    pack.prefetch(SIZE_MAX, 1);
+
+    std::vector<uint8_t> output(pack.size_of("text"));
+    pack.read("text", output.data());
+    ASSERT_EQ(output, text);
+    std::remove(path.c_str());
+}
+
+TEST(AssetPackTest, InvalidTest)
+{
+    ASSERT_THROW(
+        asset_pack(temp_path("does_not_exist.pack")),
+        std::runtime_error
+    );
+
+    std::string path = temp_path("invalid.pack");
+    {
+        std::ofstream file(path, std::ios::binary);
+        file<<"definitely not an asset pack";
+    }
+    ASSERT_THROW(asset_pack pack(path), std::runtime_error);
+
+    // A pack whose data got cut off is caught when it's opened.
+    asset_pack_writer writer;
+    writer.add("a", bytes(1000, 0));
+    writer.write(path);
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), {});
+        file.close();
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size() - 100);
+    }
+    ASSERT_THROW(asset_pack pack(path), std::runtime_error);
+    std::remove(path.c_str());
+}
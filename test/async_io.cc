@@ -0,0 +1,115 @@
+#include <gtest/gtest.h>
+#include <fstream>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "async_io.hh"
+#ifdef __unix__
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+static std::string write_file(const std::string& name, size_t size)
+{
+    std::string path = testing::TempDir() + name;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    for(size_t i = 0; i < size; ++i) file.put(i % 251);
+    return path;
+}
+
+static async_io::buffer expected(uint64_t offset, size_t size)
+{
+    async_io::buffer data;
+    for(size_t i = 0; i < size; ++i) data.push_back((offset + i) % 251);
+    return data;
+}
+
+// Both backends behave the same, whichever one this system ends up with.
+class AsyncIOTest: public ::testing::TestWithParam<bool>
+{
+protected:
+    // A small queue, so that batches have to wait for room.
+    AsyncIOTest(): pool(2), io(pool, GetParam(), 2, 16) {}
+
+    thread_pool pool;
+    async_io io;
+};
+
+TEST_P(AsyncIOTest, ReadTest)
+{
+    if(!GetParam())
+    {
+        ASSERT_EQ(io.get_backend(), async_io::BACKEND_THREADS);
+    }
+
+    std::string path = write_file("async_io_read", 100000);
+    ASSERT_EQ(io.read(path).get(), expected(0, 100000));
+    ASSERT_EQ(io.read({path, 1000, 500}).get(), expected(1000, 500));
+    // Reads are cut short at the end of the file.
+    ASSERT_EQ(io.read({path, 99990, 500}).get(), expected(99990, 10));
+    ASSERT_EQ(io.read({path, 200000}).get().size(), 0);
+
+    // The result works like any other.
+    ASSERT_EQ(
+        io.read(path).then([](async_io::buffer data){
+            return data.size();
+        }).get(),
+        100000
+    );
+
+    ASSERT_THROW(
+        io.read(testing::TempDir() + "async_io_missing").get(),
+        std::runtime_error
+    );
+    std::remove(path.c_str());
+}
+
+TEST_P(AsyncIOTest, BatchTest)
+{
+    std::vector<std::string> paths;
+    std::vector<async_io::read_request> requests;
+    for(unsigned i = 0; i < 600; ++i)
+    {
+        paths.push_back(write_file("async_io_" + std::to_string(i), i * 7));
+        requests.emplace_back(paths.back());
+    }
+    requests.emplace_back(testing::TempDir() + "async_io_missing");
+
+    std::vector<async_io::read_result> results = io.read(requests);
+    ASSERT_EQ(results.size(), 601);
+    for(unsigned i = 0; i < 600; ++i)
+    {
+        ASSERT_EQ(results[i].get(), expected(0, i * 7));
+    }
+    ASSERT_THROW(results.back().get(), std::runtime_error);
+
+    for(const std::string& path: paths) std::remove(path.c_str());
+}
+
+#ifdef __unix__
+TEST_P(AsyncIOTest, NonBlockingTest)
+{
+    // A blocking open of a FIFO waits until something opens the other end,
+    // which read() must not do. Neither should it wait for room in the
+    // queue.
+    std::string path = testing::TempDir() + "async_io_fifo";
+    std::remove(path.c_str());
+    ASSERT_EQ(mkfifo(path.c_str(), 0600), 0);
+    std::vector<async_io::read_request> requests(100, path);
+    std::vector<async_io::read_result> results = io.read(requests);
+
+    // Opened both ways, so that this doesn't wait for a reader either.
+    int writer = open(path.c_str(), O_RDWR);
+    ASSERT_GE(writer, 0);
+    for(async_io::read_result& result: results) result.get();
+    close(writer);
+    std::remove(path.c_str());
+}
+#endif
+
+INSTANTIATE_TEST_SUITE_P(
+    Backends,
+    AsyncIOTest,
+    ::testing::Values(true, false)
+);
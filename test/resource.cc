@@ -1,6 +1,773 @@
 #include <iostream>
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <chrono>
+#include <random>
 #include "resource.hh"
+#include "resource_watcher.hh"
+
+struct handle_system_data
+{
+    handle_system_data(unsigned i): i(i), loads(0) {}
+    void load() { loads++; }
+    void unload() {}
+
+    unsigned i;
+    std::atomic_uint loads;
+};
+
+struct handle_device_data
+{
+    template<typename S>
+    handle_device_data(device_id, S&) {}
+    void load() {}
+    void unload() {}
+};
+
+struct handle_resource
+{
+    using system_data_type = handle_system_data;
+    using device_data_type = handle_device_data;
+};
+
+struct other_system_data
+{
+    void load() {}
+    void unload() {}
+};
+
+struct other_resource
+{
+    using system_data_type = other_system_data;
+    using device_data_type = handle_device_data;
+};
+
+struct load_counts
+{
+    load_counts(): loads(0), unloads(0) {}
+    std::atomic_uint loads, unloads;
+};
+
+// Counts outside of the data, since reading the data would load it.
+struct sized_system_data
+{
+    sized_system_data(size_t size, load_counts& counts)
+    : size(size), counts(counts) {}
+    void load() { counts.loads++; }
+    void unload() { counts.unloads++; }
+    size_t memory_usage() const { return size; }
+
+    size_t size;
+    load_counts& counts;
+};
+
+struct sized_resource
+{
+    using system_data_type = sized_system_data;
+    using device_data_type = handle_device_data;
+};
+
+// Loads straight from a mounted asset pack.
+struct asset_system_data
+{
+    asset_system_data(asset_view view): view(view), sum(0) {}
+    void load()
+    {
+        for(size_t i = 0; i < view.size; ++i) sum += view.data[i];
+    }
+    void unload() { sum = 0; }
+
+    asset_view view;
+    unsigned sum;
+};
+
+struct asset_resource
+{
+    using system_data_type = asset_system_data;
+    using device_data_type = handle_device_data;
+};
+
+struct load_log
+{
+    std::mutex mutex;
+    std::vector<std::string> names;
+};
+
+// Says which asset it loads from, so prefetch() can order it.
+struct logged_system_data
+{
+    logged_system_data(const std::string& asset, load_log& log)
+    : asset(asset), log(log) {}
+    void load()
+    {
+        std::lock_guard<std::mutex> lock(log.mutex);
+        log.names.push_back(asset);
+    }
+    void unload() {}
+    std::string asset_name() const { return asset; }
+
+    std::string asset;
+    load_log& log;
+};
+
+struct logged_resource
+{
+    using system_data_type = logged_system_data;
+    using device_data_type = handle_device_data;
+};
+
+// Reads a whole file, so that reloads pick changes up.
+struct file_system_data
+{
+    file_system_data(const std::string& path, load_counts& counts)
+    : path(path), counts(counts) {}
+    void load()
+    {
+        std::ifstream file(path);
+        text.assign(std::istreambuf_iterator<char>(file), {});
+        counts.loads++;
+        if(text == "bad") throw std::runtime_error("Bad file");
+    }
+    void unload() { text.clear(); counts.unloads++; }
+
+    std::string path;
+    load_counts& counts;
+    std::string text;
+};
+
+struct file_device_data
+{
+    file_device_data(device_id, const file_system_data& system)
+    : system(system) {}
+    void load() { text = system.text; }
+    void unload() { text.clear(); }
+
+    const file_system_data& system;
+    std::string text;
+};
+
+struct file_resource
+{
+    using system_data_type = file_system_data;
+    using device_data_type = file_device_data;
+};
+
+struct device_counts
+{
+    device_counts(): loads(0), unloads(0), errors(0) {}
+    std::atomic_uint loads, unloads, errors;
+};
+
+struct stress_system_data
+{
+    stress_system_data(device_counts& counts): counts(counts) {}
+    void load() {}
+    void unload() {}
+
+    device_counts& counts;
+};
+
+// Counts loading twice or unloading without loading as errors.
+struct stress_device_data
+{
+    stress_device_data(device_id, const stress_system_data& system)
+    : counts(system.counts), loaded(false) {}
+    void load()
+    {
+        if(loaded.exchange(true)) counts.errors++;
+        counts.loads++;
+    }
+    void unload()
+    {
+        if(!loaded.exchange(false)) counts.errors++;
+        counts.unloads++;
+    }
+
+    device_counts& counts;
+    std::atomic_bool loaded;
+};
+
+struct stress_resource
+{
+    using system_data_type = stress_system_data;
+    using device_data_type = stress_device_data;
+};
+
+// Fails slowly, so that device loads are waiting for it by then.
+struct failing_system_data
+{
+    failing_system_data(device_counts& counts): counts(counts) {}
+    void load()
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        throw std::runtime_error("No system data");
+    }
+    void unload() {}
+
+    device_counts& counts;
+};
+
+struct failing_device_data
+{
+    failing_device_data(device_id, const failing_system_data& system)
+    : counts(system.counts) {}
+    void load() { counts.loads++; }
+    void unload() { counts.unloads++; }
+
+    device_counts& counts;
+};
+
+struct failing_resource
+{
+    using system_data_type = failing_system_data;
+    using device_data_type = failing_device_data;
+};
+
+static void write_file(const std::string& path, const std::string& text)
+{
+    std::ofstream(path) << text;
+}
+
+using handle_container = resource_container<
+    handle_system_data,
+    handle_device_data
+>;
+
+TEST(ResourceHandleTest, LookupTest)
+{
+    thread_pool pool(2);
+    resource_manager manager(pool);
+
+    auto a = manager.create<handle_resource>("a", 1u);
+    auto b = manager.create<other_resource>("b");
+    ASSERT_TRUE(a.valid());
+    ASSERT_NE(a, b);
+    ASSERT_EQ((manager.find<handle_system_data, handle_device_data>("a")), a);
+    ASSERT_EQ(
+        &manager.get(a),
+        (&manager.get<handle_system_data, handle_device_data>("a"))
+    );
+    ASSERT_EQ(manager.get(a).system().i, 1);
+
+    ASSERT_THROW(
+        (manager.find<other_system_data, handle_device_data>("a")),
+        std::runtime_error
+    );
+    ASSERT_THROW(
+        (manager.get<other_system_data, handle_device_data>("a")),
+        std::runtime_error
+    );
+    ASSERT_THROW(
+        (manager.find<handle_system_data, handle_device_data>("missing")),
+        std::out_of_range
+    );
+    resource_handle<handle_system_data, handle_device_data> invalid;
+    ASSERT_FALSE(invalid.valid());
+    ASSERT_THROW(manager.get(invalid), std::out_of_range);
+
+    // Replacing a resource keeps its handle, unless the type changes.
+    ASSERT_EQ(manager.create<handle_resource>("a", 2u), a);
+    ASSERT_EQ(manager.get(a).system().i, 2);
+    manager.create<other_resource>("a");
+    ASSERT_THROW(manager.get(a), std::runtime_error);
+}
+
+TEST(ResourceHandleTest, ConcurrentTest)
+{
+    thread_pool pool(2);
+    resource_manager manager(pool);
+
+    // Readers keep resolving while enough resources are added to need more
+    // blocks.
+    auto first = manager.create<handle_resource>("first", 0u);
+    const handle_container* expected = &manager.get(first);
+    std::atomic_bool done(false), mismatch(false);
+    std::vector<std::thread> readers;
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        readers.emplace_back([&](){
+            while(!done)
+            {
+                if(&manager.get(first) != expected) mismatch = true;
+            }
+        });
+    }
+
+    std::vector<resource_handle<handle_system_data, handle_device_data>>
+        handles;
+    for(unsigned i = 0; i < 3000; ++i)
+    {
+        handles.push_back(
+            manager.create<handle_resource>("r" + std::to_string(i), i)
+        );
+    }
+    done = true;
+    for(std::thread& t: readers) t.join();
+    ASSERT_FALSE(mismatch);
+
+    for(unsigned i = 0; i < handles.size(); ++i)
+    {
+        ASSERT_EQ(manager.get(handles[i]).system().i, i);
+    }
+
+    // Pinning through a handle loads the resource once.
+    manager.pin(first);
+    manager.pin(first);
+    pool.finish();
+    ASSERT_EQ(manager.get(first).system().loads, 1);
+    manager.unpin(first);
+    manager.unpin(first);
+    pool.finish();
+}
+
+TEST(ResourceResidencyTest, BudgetTest)
+{
+    thread_pool pool(2);
+    resource_manager manager(pool);
+
+    load_counts a_counts, b_counts, c_counts;
+    auto a = manager.create<sized_resource>("a", 100, a_counts);
+    auto b = manager.create<sized_resource>("b", 100, b_counts);
+    auto c = manager.create<sized_resource>("c", 100, c_counts);
+    auto use = [&](resource_handle<sized_system_data, handle_device_data> h){
+        manager.pin(h);
+        pool.finish();
+        manager.unpin(h);
+        pool.finish();
+    };
+    manager.set_system_budget(250);
+
+    // Unpinned data stays loaded while it fits, and pinning it again is a
+    // hit.
+    use(a);
+    ASSERT_EQ(a_counts.unloads, 0);
+    resource_manager::residency_stats stats = manager.get_system_stats();
+    ASSERT_EQ(stats.usage, 100);
+    ASSERT_EQ(stats.cached, 1);
+    use(a);
+    ASSERT_EQ(a_counts.loads, 1);
+
+    // Going over the budget evicts the least recently used.
+    use(b);
+    use(c);
+    ASSERT_EQ(a_counts.unloads, 1);
+    ASSERT_EQ(b_counts.unloads, 0);
+    ASSERT_EQ(c_counts.unloads, 0);
+    stats = manager.get_system_stats();
+    ASSERT_EQ(stats.hits, 1);
+    ASSERT_EQ(stats.misses, 3);
+    ASSERT_EQ(stats.evictions, 1);
+    ASSERT_EQ(stats.usage, 200);
+    ASSERT_EQ(stats.cached, 2);
+
+    // Without a budget, unpinning unloads right away.
+    manager.set_system_budget(0);
+    pool.finish();
+    ASSERT_EQ(manager.get_system_stats().usage, 0);
+    use(a);
+    ASSERT_EQ(a_counts.loads, 2);
+    ASSERT_EQ(a_counts.unloads, 2);
+    ASSERT_EQ(manager.get_system_stats().cached, 0);
+}
+
+TEST(ResourceAssetTest, MountTest)
+{
+    std::string first_path = testing::TempDir() + "first.pack";
+    std::string second_path = testing::TempDir() + "second.pack";
+    asset_pack_writer first, second;
+    first.add("a", {1, 2, 3});
+    first.add("b", {4});
+    second.add("a", {10, 20});
+    second.add("c", std::vector<uint8_t>(4096, 7), true);
+    first.write(first_path);
+    second.write(second_path);
+
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    ASSERT_THROW(manager.find_asset("a"), std::out_of_range);
+    manager.mount(first_path);
+    manager.mount(second_path);
+    ASSERT_THROW(
+        manager.mount(testing::TempDir() + "missing.pack"),
+        std::runtime_error
+    );
+
+    // The later pack wins.
+    auto a = manager.create<asset_resource>("a", manager.find_asset("a"));
+    auto b = manager.create<asset_resource>("b", manager.find_asset("b"));
+    manager.pin(a);
+    manager.pin(b);
+    ASSERT_EQ(manager.get(a).system().sum, 30);
+    ASSERT_EQ(manager.get(b).system().sum, 4);
+
+    // Compressed assets can only be read out.
+    ASSERT_THROW(manager.find_asset("c"), std::runtime_error);
+    ASSERT_EQ(manager.asset_size("c"), 4096u);
+    std::vector<uint8_t> c(manager.asset_size("c"));
+    manager.read_asset("c", c.data());
+    ASSERT_EQ(c, std::vector<uint8_t>(4096, 7));
+    manager.unpin(a);
+    manager.unpin(b);
+    pool.finish();
+    std::remove(first_path.c_str());
+    std::remove(second_path.c_str());
+}
+
+TEST(ResourceAssetTest, PrefetchTest)
+{
+    std::string first_path = testing::TempDir() + "prefetch_first.pack";
+    std::string second_path = testing::TempDir() + "prefetch_second.pack";
+    asset_pack_writer first, second;
+    for(const char* name: {"a", "b", "c", "d"}) first.add(name, {1, 2, 3});
+    second.add("a", {4, 5});
+    first.write(first_path);
+    second.write(second_path);
+
+    // Without threads, the loads run in the order prefetch() starts them.
+    thread_pool inline_pool(0);
+    resource_manager manager(inline_pool);
+    manager.mount(first_path);
+    manager.mount(second_path);
+    load_log log;
+    std::vector<basic_resource_handle> handles;
+    for(const char* name: {"missing", "d", "a", "c", "b"})
+    {
+        handles.push_back(manager.create<logged_resource>(name, name, log));
+    }
+    handles.push_back(manager.create<handle_resource>("plain", 0));
+
+    auto group = manager.prefetch(handles);
+    group.result.wait();
+    ASSERT_EQ(group.size(), 6u);
+    ASSERT_EQ(group.loaded(), 6u);
+    ASSERT_EQ(group.progress(), 1.0f);
+    // By pack and offset, then those that aren't in a pack. "a" is in the
+    // later pack, which hides the one in the first.
+    ASSERT_EQ(
+        log.names,
+        std::vector<std::string>({"b", "c", "d", "a", "missing"})
+    );
+
+    // With workers, they still start in that order.
+    {
+        thread_pool pool(1);
+        resource_manager ordered(pool);
+        ordered.mount(first_path);
+        ordered.mount(second_path);
+        load_log ordered_log;
+        std::vector<basic_resource_handle> ordered_handles;
+        for(const char* name: {"missing", "d", "a", "c", "b"})
+        {
+            ordered_handles.push_back(
+                ordered.create<logged_resource>(name, name, ordered_log)
+            );
+        }
+        ordered.prefetch(ordered_handles).result.get();
+        ASSERT_EQ(ordered_log.names, log.names);
+        for(basic_resource_handle handle: ordered_handles)
+        {
+            ordered.unpin(handle);
+        }
+        pool.finish();
+    }
+
+    // They're pinned, so nothing loads twice.
+    auto again = manager.prefetch(std::vector<std::string>{"a", "b"});
+    again.result.get();
+    ASSERT_EQ(log.names.size(), 5u);
+    for(basic_resource_handle handle: handles) manager.unpin(handle);
+    manager.unpin("a");
+    manager.unpin("b");
+
+    // Empty groups are done right away.
+    auto empty = manager.prefetch(std::vector<std::string>());
+    empty.result.get();
+    ASSERT_EQ(empty.progress(), 1.0f);
+    ASSERT_THROW(
+        manager.prefetch(std::vector<std::string>{"nope"}),
+        std::out_of_range
+    );
+
+    // With threads, the group is done once all of them are.
+    thread_pool pool(4);
+    resource_manager threaded(pool);
+    threaded.mount(first_path);
+    load_log threaded_log;
+    std::vector<std::string> names;
+    for(unsigned i = 0; i < 100; ++i)
+    {
+        std::string name = "r" + std::to_string(i);
+        std::string asset(1, "abcd"[i % 4]);
+        threaded.create<logged_resource>(name, asset, threaded_log);
+        names.push_back(name);
+    }
+    auto loading = threaded.prefetch(names, PRIORITY_PRONTO);
+    ASSERT_LE(loading.loaded(), loading.size());
+    loading.result.get();
+    ASSERT_EQ(loading.loaded(), 100u);
+    ASSERT_EQ(threaded_log.names.size(), 100u);
+    for(const std::string& name: names) threaded.unpin(name);
+
+    // Failed loads aren't counted, and what they threw is passed on.
+    device_counts counts;
+    threaded.create<failing_resource>("failing", counts);
+    auto failing = threaded.prefetch(
+        std::vector<std::string>{"r0", "failing"},
+        PRIORITY_PRONTO
+    );
+    ASSERT_THROW(failing.result.get(), std::runtime_error);
+    ASSERT_EQ(failing.loaded(), 1u);
+    threaded.unpin("r0");
+    threaded.unpin("failing");
+    pool.finish();
+    std::remove(first_path.c_str());
+    std::remove(second_path.c_str());
+}
+
+TEST(ResourceReloadTest, SwapTest)
+{
+    std::string path = testing::TempDir() + "reload_swap.txt";
+    write_file(path, "one");
+    int device;
+    device_id id = &device;
+
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    load_counts counts;
+    auto a = manager.create<file_resource>("a", path, counts);
+    ASSERT_FALSE(manager.reload(a).valid());
+    manager.pin("a", id);
+    ASSERT_EQ(manager.get(a).system().text, "one");
+    ASSERT_EQ(manager.get(a).device(id).text, "one");
+
+    // Device data is remade from the new system data.
+    write_file(path, "two");
+    ASSERT_TRUE(manager.reload(a).get());
+    ASSERT_EQ(manager.get(a).system().text, "two");
+    ASSERT_EQ(manager.get(a).device(id).text, "two");
+
+    // A failed reload keeps the old data.
+    write_file(path, "bad");
+    ASSERT_FALSE(manager.reload("a").get());
+    ASSERT_EQ(manager.get(a).system().text, "two");
+    ASSERT_EQ(manager.get(a).device(id).text, "two");
+    ASSERT_EQ(counts.loads, 3u);
+    ASSERT_EQ(counts.unloads, 0u);
+
+    // Replaced data is only unloaded by the next reload.
+    write_file(path, "three");
+    ASSERT_TRUE(manager.reload(a).get());
+    ASSERT_EQ(manager.get(a).device(id).text, "three");
+    ASSERT_EQ(counts.unloads, 1u);
+
+    // Unloading frees what the last reload replaced too, and then nothing
+    // is loaded, so there's nothing to reload.
+    manager.unpin("a", id);
+    pool.finish();
+    ASSERT_EQ(counts.unloads, 3u);
+    ASSERT_FALSE(manager.reload(a).valid());
+    pool.finish();
+    std::remove(path.c_str());
+}
+
+// Readers never see half-loaded data, and old data stays valid until the
+// reload after the one that replaced it.
+TEST(ResourceReloadTest, ConcurrentTest)
+{
+    const unsigned reader_count = 4;
+    const unsigned reload_count = 50;
+    std::string path = testing::TempDir() + "reload_concurrent.txt";
+    write_file(path, std::string(256, 'a'));
+
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    load_counts counts;
+    auto a = manager.create<file_resource>("a", path, counts);
+    manager.pin(a);
+
+    std::atomic_bool done(false), failed(false);
+    std::unique_ptr<std::atomic_uint[]> progress(
+        new std::atomic_uint[reader_count]
+    );
+    std::vector<std::thread> readers;
+    for(unsigned i = 0; i < reader_count; ++i)
+    {
+        progress[i] = 0;
+        readers.emplace_back([&, i](){
+            while(!done)
+            {
+                const std::string& text = manager.get(a).system().text;
+                if(
+                    text.size() != 256 ||
+                    text.find_first_not_of(text[0]) != std::string::npos
+                ) failed = true;
+                progress[i]++;
+            }
+        });
+    }
+
+    for(unsigned i = 0; i < reload_count; ++i)
+    {
+        write_file(path, std::string(256, 'a' + i % 26));
+        ASSERT_TRUE(manager.reload(a).get());
+        // Every reader has to finish with what it had before the next
+        // reload frees it.
+        for(unsigned j = 0; j < reader_count; ++j)
+        {
+            unsigned start = progress[j];
+            while(progress[j] < start + 2) std::this_thread::yield();
+        }
+    }
+    done = true;
+    for(std::thread& t: readers) t.join();
+    ASSERT_FALSE(failed);
+    ASSERT_EQ(
+        manager.get(a).system().text,
+        std::string(256, 'a' + (reload_count - 1) % 26)
+    );
+
+    manager.unpin(a);
+    pool.finish();
+    std::remove(path.c_str());
+}
+
+TEST(ResourceWatcherTest, ReloadTest)
+{
+    std::string path = testing::TempDir() + "reload_watched.txt";
+    std::string other_path = testing::TempDir() + "reload_other.txt";
+    write_file(path, "first");
+
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    load_counts counts;
+    auto a = manager.create<file_resource>("a", path, counts);
+    manager.pin(a);
+    ASSERT_EQ(manager.get(a).system().text, "first");
+
+    {
+        resource_watcher watcher(manager, std::chrono::milliseconds(100));
+        watcher.watch(path, "a");
+
+        // A burst of writes only reloads once, and other files are ignored.
+        write_file(other_path, "other");
+        for(unsigned i = 0; i < 5; ++i)
+        {
+            write_file(path, "second" + std::to_string(i));
+        }
+
+        auto deadline = std::chrono::steady_clock::now() +
+            std::chrono::seconds(10);
+        while(
+            manager.get(a).system().text != "second4" &&
+            std::chrono::steady_clock::now() < deadline
+        ) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        ASSERT_EQ(manager.get(a).system().text, "second4");
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        ASSERT_EQ(watcher.get_change_count(), 1u);
+        ASSERT_EQ(counts.loads, 2u);
+    }
+
+    manager.unpin(a);
+    pool.finish();
+    std::remove(path.c_str());
+    std::remove(other_path.c_str());
+}
+
+TEST(ResourceDeviceTest, SlotTest)
+{
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    device_counts counts;
+    auto a = manager.create<stress_resource>("a", counts);
+    auto& container = manager.get(a);
+
+    int devices[basic_resource_container::MAX_DEVICES + 1];
+    for(unsigned i = 0; i < basic_resource_container::MAX_DEVICES; ++i)
+    {
+        container.pin(&devices[i]);
+    }
+    ASSERT_THROW(
+        container.pin(&devices[basic_resource_container::MAX_DEVICES]),
+        std::runtime_error
+    );
+    for(unsigned i = 0; i < basic_resource_container::MAX_DEVICES; ++i)
+    {
+        ASSERT_TRUE(container.device(&devices[i]).loaded);
+        container.unpin(&devices[i]);
+    }
+    pool.finish();
+    ASSERT_EQ(counts.loads, basic_resource_container::MAX_DEVICES);
+    ASSERT_EQ(counts.unloads, basic_resource_container::MAX_DEVICES);
+    ASSERT_EQ(counts.errors, 0u);
+}
+
+// Threads pin, use and unpin random devices, so that loads and unloads keep
+// overlapping with pins.
+TEST(ResourceDeviceTest, StressTest)
+{
+    const unsigned thread_count = 4;
+    const unsigned iterations = 5000;
+    const unsigned device_count = 3;
+
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    device_counts counts;
+    auto a = manager.create<stress_resource>("a", counts);
+    auto& container = manager.get(a);
+
+    int devices[device_count];
+    std::atomic_bool failed(false);
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < thread_count; ++t)
+    {
+        threads.emplace_back([&, t](){
+            std::mt19937 rng(t);
+            for(unsigned i = 0; i < iterations; ++i)
+            {
+                device_id id = &devices[rng() % device_count];
+                container.pin(id);
+                if(!container.device(id).loaded) failed = true;
+                container.unpin(id);
+            }
+        });
+    }
+    for(std::thread& t: threads) t.join();
+    pool.finish();
+
+    ASSERT_FALSE(failed);
+    ASSERT_EQ(counts.errors, 0u);
+    ASSERT_EQ(counts.loads, counts.unloads);
+}
+
+// Device loads waiting for a system load that fails don't run, and waiting
+// for them throws what the system load did instead of waiting forever.
+TEST(ResourceDeviceTest, FailedSystemTest)
+{
+    thread_pool pool(2);
+    resource_manager manager(pool);
+    device_counts counts;
+    auto a = manager.create<failing_resource>("a", counts);
+    auto& container = manager.get(a);
+
+    // The second pin tries again from scratch.
+    int device;
+    for(unsigned i = 0; i < 2; ++i)
+    {
+        container.pin(&device);
+        ASSERT_THROW(container.device(&device), std::runtime_error);
+        ASSERT_THROW(container.system(), std::runtime_error);
+        container.unpin(&device);
+        pool.finish();
+    }
+    ASSERT_EQ(counts.loads, 0u);
+    ASSERT_EQ(counts.unloads, 0u);
+}
+
 //TODO: Fix tests
 
 /*
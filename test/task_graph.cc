@@ -0,0 +1,156 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdexcept>
+#include "task_graph.hh"
+
+struct frame_params
+{
+    unsigned frame;
+    bool physics;
+};
+
+TEST(TaskGraphTest, OrderTest)
+{
+    thread_pool pool(4);
+    task_graph<frame_params> graph;
+
+    // Each node checks that everything before it has already run.
+    std::atomic_uint done[4];
+    std::atomic_bool in_order(true);
+    auto node = [&](unsigned index, std::vector<unsigned> before){
+        return [&, index, before](const frame_params& p){
+            for(unsigned b: before)
+            {
+                if(done[b] != p.frame + 1) in_order = false;
+            }
+            done[index] = p.frame + 1;
+        };
+    };
+    auto input = graph.add_node(node(0, {}));
+    auto physics = graph.add_node(node(1, {0}), PRIORITY_HIGH);
+    auto audio = graph.add_node(node(2, {0}));
+    auto present = graph.add_node(node(3, {0, 1, 2}));
+    graph.add_edge(input, physics);
+    graph.add_edge(input, audio);
+    graph.add_edge(physics, present);
+    graph.add_edge(audio, present);
+    graph.validate();
+    ASSERT_EQ(graph.size(), 4);
+
+    for(unsigned frame = 0; frame < 100; ++frame)
+    {
+        graph.run(pool, {frame, true});
+        graph.wait();
+        for(std::atomic_uint& d: done) ASSERT_EQ(d, frame + 1);
+    }
+    ASSERT_TRUE(in_order);
+
+    // Without workers, the whole frame runs inside run().
+    thread_pool inline_pool(0);
+    graph.run(inline_pool, {100, true});
+    for(std::atomic_uint& d: done) ASSERT_EQ(d, 101);
+    graph.wait();
+    ASSERT_TRUE(in_order);
+}
+
+TEST(TaskGraphTest, CycleTest)
+{
+    task_graph<int> graph;
+    auto a = graph.add_node([](int){});
+    auto b = graph.add_node([](int){});
+    auto c = graph.add_node([](int){});
+    graph.add_edge(a, b);
+    graph.add_edge(b, c);
+    graph.validate();
+    graph.add_edge(c, a);
+    ASSERT_THROW(graph.validate(), std::runtime_error);
+
+    thread_pool pool(1);
+    ASSERT_THROW(graph.run(pool, 0), std::runtime_error);
+    ASSERT_THROW(graph.add_edge(a, 3), std::out_of_range);
+}
+
+TEST(TaskGraphTest, ConditionTest)
+{
+    thread_pool pool(2);
+    task_graph<frame_params> graph;
+
+    std::atomic_uint simulated(0), integrated(0), rendered(0);
+    auto check = graph.add_condition([](const frame_params& p){
+        return p.physics;
+    });
+    auto simulate = graph.add_node([&](const frame_params&){ simulated++; });
+    auto integrate = graph.add_node([&](const frame_params&){ integrated++; });
+    auto render = graph.add_node([&](const frame_params&){ rendered++; });
+    graph.add_edge(check, simulate);
+    graph.add_edge(simulate, integrate);
+    graph.add_edge(check, render);
+    graph.add_edge(integrate, render);
+
+    // Skipping goes all the way down.
+    for(unsigned frame = 0; frame < 10; ++frame)
+    {
+        graph.run(pool, {frame, frame % 2 == 0});
+        graph.wait();
+    }
+    ASSERT_EQ(simulated, 5);
+    ASSERT_EQ(integrated, 5);
+    ASSERT_EQ(rendered, 5);
+}
+
+TEST(TaskGraphTest, ExceptionTest)
+{
+    thread_pool pool(2);
+    task_graph<int> graph;
+
+    std::atomic_uint ran(0);
+    auto a = graph.add_node([](int frame){
+        if(frame == 1) throw std::runtime_error("bad frame");
+    });
+    auto b = graph.add_node([&](int){ ran++; });
+    graph.add_node([&](int){ ran++; });
+    graph.add_edge(a, b);
+
+    graph.run(pool, 0);
+    graph.wait();
+    ASSERT_EQ(ran, 2);
+
+    graph.run(pool, 1);
+    ASSERT_THROW(graph.wait(), std::runtime_error);
+    ASSERT_EQ(ran, 3);
+
+    // The next frame starts over.
+    graph.run(pool, 2);
+    graph.wait();
+    ASSERT_EQ(ran, 5);
+}
+
+TEST(TaskGraphTest, NestedWaitTest)
+{
+    // The only worker runs a node that waits for another graph, whose nodes
+    // need that same worker.
+    thread_pool pool(1);
+    task_graph<int> inner, outer;
+    std::atomic_uint ran(0);
+    for(unsigned i = 0; i < 10; ++i) inner.add_node([&](int){ ran++; });
+    outer.add_node([&](int frame){
+        inner.run(pool, frame);
+        inner.wait();
+    });
+
+    for(int frame = 0; frame < 100; ++frame)
+    {
+        outer.run(pool, frame);
+        outer.wait();
+    }
+    ASSERT_EQ(ran, 1000);
+
+    // Waiting from a task works the same.
+    pool.post([&](){
+        inner.run(pool, 0);
+        inner.wait();
+    }).get();
+    ASSERT_EQ(ran, 1010);
+}
@@ -2,10 +2,46 @@
 #include <gtest/gtest.h>
 #include <thread>
 #include <chrono>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+#include <fstream>
+#include <set>
 #include "thread_pool.hh"
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#endif
 #define POOL_SIZE 8
 using namespace std::chrono_literals;
 
+// GCC can't tell that the replaced operators below belong together.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Counts every allocation in the process, for AllocationTest.
+static std::atomic<size_t> allocation_count(0);
+
+void* operator new(size_t size)
+{
+    allocation_count++;
+    void* ptr = std::malloc(size ? size : 1);
+    if(!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
 TEST(ThreadPoolTest, ConstructorTest)
 {
     {
@@ -39,6 +75,20 @@ TEST(ThreadPoolTest, PostTest)
     }
     pool.finish();
     ASSERT_EQ(u, val);
+
+    // Equal priorities run in the order they were posted.
+    thread_pool single(1);
+    std::atomic_bool blocked(true);
+    single.post([&](){ while(blocked) std::this_thread::yield(); });
+    std::vector<unsigned> order;
+    for(unsigned i = 0; i < 100; ++i)
+    {
+        single.postp(PRIORITY_LOW, [&order, i](){ order.push_back(i); });
+    }
+    blocked = false;
+    single.finish();
+    ASSERT_EQ(order.size(), 100u);
+    for(unsigned i = 0; i < 100; ++i) ASSERT_EQ(order[i], i);
 }
 
 TEST(ThreadPoolTest, SynchronousTest)
@@ -146,3 +196,927 @@ TEST(ThreadPoolTest, BusyTest)
     pool.finish();
     ASSERT_EQ(pool.busy(), 0);
 }
+
+TEST(ThreadPoolTest, WorkStealingTest)
+{
+    for(auto mode: {
+        thread_pool::SCHEDULE_SHARED,
+        thread_pool::SCHEDULE_WORK_STEALING
+    }){
+        thread_pool pool(POOL_SIZE, mode);
+        ASSERT_EQ(pool.get_scheduling(), mode);
+
+        // Tasks posted from workers must get picked up by the others too.
+        std::atomic_uint u(0);
+        unsigned val = 1<<12;
+        pool.post([&](){
+            for(unsigned i = 0; i < val; ++i)
+            {
+                pool.post([&u](){ u++; });
+            }
+        });
+        pool.finish();
+        ASSERT_EQ(u, val);
+    }
+
+    // A worker must still run its own tasks in priority order.
+    thread_pool pool(1, thread_pool::SCHEDULE_WORK_STEALING);
+    std::vector<unsigned> order;
+    pool.post([&](){
+        pool.postp(PRIORITY_LOW, [&](){ order.push_back(PRIORITY_LOW); });
+        pool.postp(PRIORITY_HIGH, [&](){ order.push_back(PRIORITY_HIGH); });
+        pool.postp(PRIORITY_MEDIUM, [&](){ order.push_back(PRIORITY_MEDIUM); });
+    });
+    pool.finish();
+    ASSERT_EQ(
+        order,
+        std::vector<unsigned>({PRIORITY_HIGH, PRIORITY_MEDIUM, PRIORITY_LOW})
+    );
+}
+
+TEST(ThreadPoolTest, DependencyTest)
+{
+    for(unsigned thread_count: {0u, 1u, (unsigned)POOL_SIZE})
+    {
+        thread_pool pool(thread_count);
+
+        // Long chain, every task must run after the previous one.
+        std::atomic_uint counter(0);
+        std::atomic_bool in_order(true);
+        thread_pool::task_id prev = 0;
+        for(unsigned i = 0; i < 1000; ++i)
+        {
+            prev = pool.postd(
+                {prev},
+                PRIORITY_LOW,
+                [&counter, &in_order, i](){
+                    if(counter++ != i) in_order = false;
+                }
+            ).get_id();
+        }
+        pool.finish();
+        ASSERT_EQ(counter, 1000);
+        ASSERT_TRUE(in_order);
+
+        // Diamond with a wide fan-out in the middle.
+        std::atomic_uint top(0), middle(0), bottom(0);
+        thread_pool::task_id top_id = pool.post(
+            [&](){
+                std::this_thread::sleep_for(1ms);
+                top++;
+            }
+        ).get_id();
+        std::vector<thread_pool::task_id> middle_ids;
+        for(unsigned i = 0; i < 100; ++i)
+        {
+            middle_ids.push_back(pool.postd(
+                {top_id},
+                PRIORITY_LOW,
+                [&](){
+                    if(top == 1) middle++;
+                }
+            ).get_id());
+        }
+        auto res = pool.postd(
+            middle_ids,
+            PRIORITY_LOW,
+            [&](){ return middle.load(); }
+        );
+        ASSERT_EQ(res.get(), 100);
+        pool.finish();
+    }
+}
+
+TEST(ThreadPoolTest, AllocationTest)
+{
+    thread_pool pool(POOL_SIZE);
+    std::atomic_uint counter(0);
+    std::vector<thread_pool::post_result<unsigned>> results(100);
+
+    auto work = [&](){
+        for(unsigned i = 0; i < 1000; ++i)
+        {
+            pool.postf({}, PRIORITY_LOW, [&counter](){ counter++; });
+        }
+
+        thread_pool::task_id prev = 0;
+        for(unsigned i = 0; i < results.size(); ++i)
+        {
+            results[i] = pool.postd(
+                {prev},
+                PRIORITY_MEDIUM,
+                [&counter](unsigned i){ counter++; return i; },
+                i
+            );
+            prev = results[i].get_id();
+        }
+        for(unsigned i = 0; i < results.size(); ++i)
+        {
+            if(results[i].get() != i) counter = 0;
+        }
+        pool.finish();
+    };
+
+    // Let the task blocks, queues and free lists warm up first.
+    for(unsigned i = 0; i < 10; ++i) work();
+
+    counter = 0;
+    size_t allocations_before = allocation_count;
+    work();
+    size_t allocations = allocation_count - allocations_before;
+
+    ASSERT_EQ(counter, 1000 + results.size());
+    ASSERT_EQ(allocations, 0);
+}
+
+TEST(ThreadPoolTest, ExceptionTest)
+{
+    thread_pool pool(POOL_SIZE);
+
+    // Held until the dependent is posted, since finished dependencies are
+    // ignored.
+    std::atomic_bool posted(false);
+    auto failing = pool.post([&](){
+        while(!posted) std::this_thread::yield();
+        throw std::runtime_error("Oops");
+        return 0;
+    });
+    std::atomic_bool ran(false);
+    auto dependent = pool.postd({failing.get_id()}, PRIORITY_LOW, [&](){
+        ran = true;
+    });
+    posted = true;
+
+    ASSERT_THROW(failing.get(), std::runtime_error);
+    ASSERT_FALSE(failing.valid());
+    ASSERT_THROW(dependent.get(), std::future_error);
+    ASSERT_FALSE(ran);
+}
+
+TEST(ThreadPoolTest, ContinuationTest)
+{
+    // A single worker would deadlock if a continuation blocked it.
+    for(unsigned thread_count: {1u, (unsigned)POOL_SIZE})
+    {
+        thread_pool pool(thread_count);
+
+        auto chained = pool.post([](){ return 2; })
+            .then([](int i){ return i * 3; })
+            .then([](int i){ return std::to_string(i + 1); });
+        ASSERT_EQ(chained.get(), "7");
+
+        std::atomic_bool ran(false);
+        pool.post([](){}).then([&](){ ran = true; }).wait();
+        ASSERT_TRUE(ran);
+
+        // Exceptions skip the continuations and come out at the end.
+        bool skipped = true;
+        auto failed = pool.post([](){ throw std::runtime_error("Oops"); })
+            .then([&](){ skipped = false; });
+        ASSERT_THROW(failed.get(), std::runtime_error);
+        ASSERT_TRUE(skipped);
+
+        std::vector<thread_pool::post_result<unsigned>> results;
+        for(unsigned i = 0; i < 100; ++i)
+        {
+            results.push_back(pool.post([i](){ return i; }));
+        }
+        auto all = pool.when_all(std::move(results)).then(
+            [](std::vector<unsigned> values){
+                for(unsigned i = 0; i < values.size(); ++i)
+                {
+                    if(values[i] != i) return false;
+                }
+                return values.size() == 100;
+            }
+        );
+        ASSERT_TRUE(all.get());
+
+        std::vector<thread_pool::post_result<>> voids;
+        std::atomic_uint counter(0);
+        for(unsigned i = 0; i < 10; ++i)
+        {
+            voids.push_back(pool.post([&](){ counter++; }));
+        }
+        pool.when_all(std::move(voids)).get();
+        ASSERT_EQ(counter, 10);
+
+        // The slow one only gets to run after the fast one on one worker.
+        std::atomic_bool started(false), release(false);
+        pool.post([&](){ while(!started) std::this_thread::yield(); });
+        std::vector<thread_pool::post_result<unsigned>> racers;
+        racers.push_back(pool.postp(PRIORITY_LOW, [&](){
+            while(!release) std::this_thread::yield();
+            return 0u;
+        }));
+        racers.push_back(pool.postp(PRIORITY_MEDIUM, [](){ return 1u; }));
+        auto any = pool.when_any(std::move(racers), PRIORITY_HIGH);
+        started = true;
+        ASSERT_EQ(any.get(), std::make_pair(size_t(1), 1u));
+        release = true;
+        pool.finish();
+    }
+}
+
+TEST(ThreadPoolTest, DestroyTest)
+{
+    // Breaking the promises of unrun tasks must not run what waits on them,
+    // even once the workers are gone.
+    std::atomic_uint ran(0);
+    {
+        thread_pool pool(1);
+        std::atomic_bool release(false);
+        pool.post([&](){ while(!release) std::this_thread::yield(); });
+        for(unsigned i = 0; i < 3000; ++i)
+        {
+            pool.post([](){ return 1; }).then([&](int i){ ran += i; });
+        }
+        pool.post_after(
+            std::chrono::hours(1), PRIORITY_LOW, [](){ return 1; }
+        ).then([&](int i){ ran += i; });
+        release = true;
+    }
+    ASSERT_LE(ran, 3000u);
+}
+
+TEST(ThreadPoolTest, ParallelTest)
+{
+    // 0 threads runs everything on the calling thread.
+    for(unsigned thread_count: {0u, 1u, (unsigned)POOL_SIZE})
+    {
+        thread_pool pool(thread_count);
+
+        std::vector<std::atomic_uint> visits(10000);
+        for(std::atomic_uint& v: visits) v = 0;
+        pool.parallel_for(0, (int)visits.size(), [&](int i){ visits[i]++; });
+        for(std::atomic_uint& v: visits) ASSERT_EQ(v, 1);
+
+        // Nested loops, from inside a task.
+        std::atomic_uint counter(0);
+        pool.post([&](){
+            pool.parallel_for(0, 100, [&](int){
+                pool.parallel_for(0, 100, [&](int){ counter++; }, 1);
+            }, 1);
+        }).get();
+        ASSERT_EQ(counter, 10000);
+
+        std::vector<unsigned> numbers(100000);
+        for(unsigned i = 0; i < numbers.size(); ++i) numbers[i] = i;
+        uint64_t sum = pool.parallel_reduce(
+            numbers.begin(),
+            numbers.end(),
+            uint64_t(0),
+            [](std::vector<unsigned>::iterator it){ return uint64_t(*it); },
+            [](uint64_t a, uint64_t b){ return a + b; },
+            16
+        );
+        ASSERT_EQ(sum, uint64_t(numbers.size()) * (numbers.size() - 1) / 2);
+
+        // Not commutative, so this checks the order too.
+        std::string digits = pool.parallel_reduce(
+            0,
+            1000,
+            std::string(),
+            [](int i){ return std::string(1, '0' + i % 10); },
+            [](std::string a, const std::string& b){ return a + b; },
+            1
+        );
+        ASSERT_EQ(digits.size(), 1000);
+        for(int i = 0; i < 1000; ++i) ASSERT_EQ(digits[i], '0' + i % 10);
+
+        ASSERT_THROW(
+            pool.parallel_for(0, 1000, [](int i){
+                if(i == 500) throw std::runtime_error("Oops");
+            }, 1),
+            std::runtime_error
+        );
+
+        // Lots of duplicates, to make sure partitioning still makes progress.
+        std::vector<int> values(200000);
+        for(unsigned i = 0; i < values.size(); ++i)
+        {
+            values[i] = (i * 7919u) % 1000;
+        }
+        std::vector<int> expected(values);
+        std::sort(expected.begin(), expected.end());
+        pool.parallel_sort(values.begin(), values.end());
+        ASSERT_EQ(values, expected);
+
+        pool.parallel_sort(
+            values.begin(),
+            values.end(),
+            [](int a, int b){ return a > b; }
+        );
+        ASSERT_TRUE(std::is_sorted(values.rbegin(), values.rend()));
+    }
+}
+
+// Each task waits for the next one, much deeper than there are threads.
+static unsigned wait_chain(thread_pool& pool, unsigned depth)
+{
+    if(depth == 0) return 0;
+    return pool.post(wait_chain, std::ref(pool), depth - 1).get() + 1;
+}
+
+// Each task waits for two children.
+static unsigned wait_tree(thread_pool& pool, unsigned depth)
+{
+    if(depth == 0) return 1;
+    auto left = pool.post(wait_tree, std::ref(pool), depth - 1);
+    auto right = pool.post(wait_tree, std::ref(pool), depth - 1);
+    return left.get() + right.get();
+}
+
+TEST(ThreadPoolTest, NestedWaitTest)
+{
+    for(thread_pool::scheduling mode: {
+        thread_pool::SCHEDULE_SHARED,
+        thread_pool::SCHEDULE_WORK_STEALING
+    }){
+        for(unsigned thread_count: {0u, 1u, 2u, (unsigned)POOL_SIZE})
+        {
+            thread_pool pool(thread_count, mode);
+
+            auto chain = pool.post(wait_chain, std::ref(pool), 200);
+            ASSERT_EQ(chain.get(), 200);
+
+            auto tree = pool.post(wait_tree, std::ref(pool), 10);
+            ASSERT_EQ(tree.get(), 1024);
+
+            // The awaited task comes after lots of others, and depends on
+            // one that comes after them too.
+            std::atomic_uint counter(0);
+            auto waiting = pool.post([&](){
+                auto dep = pool.postp(PRIORITY_LOW, [](){ return 1; });
+                for(unsigned i = 0; i < 100; ++i)
+                {
+                    pool.postp(PRIORITY_HIGH, [&](){ counter++; });
+                }
+                return pool.postd(
+                    {dep.get_id()}, PRIORITY_LOW, [](){ return 2; }
+                ).get() + dep.get();
+            });
+            ASSERT_EQ(waiting.get(), 3);
+
+            // Every worker blocked in a wait at the same time.
+            std::vector<thread_pool::post_result<unsigned>> results;
+            for(unsigned i = 0; i < 2 * POOL_SIZE; ++i)
+            {
+                results.push_back(
+                    pool.post(wait_chain, std::ref(pool), 20)
+                );
+            }
+            for(auto& r: results) ASSERT_EQ(r.get(), 20);
+
+            pool.finish();
+            ASSERT_EQ(counter, 100);
+        }
+    }
+}
+
+TEST(ThreadPoolTest, CancelTest)
+{
+    thread_pool pool(1);
+
+    // Keeps the only worker busy, so everything else stays queued.
+    std::atomic_bool started(false), release(false);
+    auto blocker = pool.post([&](){
+        started = true;
+        while(!release) std::this_thread::yield();
+    });
+    while(!started) std::this_thread::yield();
+    ASSERT_FALSE(blocker.cancel());
+
+    std::atomic_uint ran(0);
+    auto queued = pool.post([&](){ ran++; return 1; });
+    auto dependent = pool.postd({queued.get_id()}, PRIORITY_LOW, [&](){
+        ran++;
+    });
+    auto waiting = pool.postd({blocker.get_id()}, PRIORITY_LOW, [&](){
+        ran++;
+    });
+    ASSERT_TRUE(queued.cancel());
+    ASSERT_FALSE(queued.cancel());
+    ASSERT_TRUE(pool.cancel(waiting.get_id()));
+
+    // Only the newest task with a key gets to run.
+    std::vector<thread_pool::post_result<unsigned>> keyed;
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        keyed.push_back(pool.postk(42, PRIORITY_LOW, [&, i](){
+            ran++;
+            return i;
+        }));
+    }
+    auto other_key = pool.postk(43, PRIORITY_LOW, [](){ return 43u; });
+
+    release = true;
+    ASSERT_THROW(queued.get(), std::future_error);
+    ASSERT_THROW(dependent.get(), std::future_error);
+    ASSERT_THROW(waiting.get(), std::future_error);
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        ASSERT_THROW(keyed[i].get(), std::future_error);
+    }
+    ASSERT_EQ(keyed[4].get(), 4);
+    ASSERT_EQ(other_key.get(), 43);
+    pool.finish();
+    ASSERT_EQ(ran, 1);
+
+    // Finished tasks can't be cancelled, nor can their keys be replaced.
+    auto done = pool.postk(42, PRIORITY_LOW, [](){ return 1; });
+    done.wait();
+    ASSERT_FALSE(done.cancel());
+    ASSERT_EQ(pool.postk(42, PRIORITY_LOW, [](){ return 2; }).get(), 2);
+    ASSERT_EQ(done.get(), 1);
+}
+
+TEST(ThreadPoolTest, LaneTest)
+{
+    ASSERT_EQ(thread_pool::get_lane(PRIORITY_PRONTO), thread_pool::LANE_FRAME);
+    ASSERT_EQ(thread_pool::get_lane(PRIORITY_HIGH), thread_pool::LANE_FRAME);
+    ASSERT_EQ(thread_pool::get_lane(PRIORITY_MEDIUM), thread_pool::LANE_NORMAL);
+    ASSERT_EQ(thread_pool::get_lane(PRIORITY_LOW), thread_pool::LANE_BACKGROUND);
+
+    {
+        // Background tasks can't take the worker reserved for frame tasks.
+        thread_pool pool(2);
+        pool.set_lane_limits(thread_pool::LANE_FRAME, 1);
+        std::atomic_uint started(0);
+        std::atomic_bool release(false);
+        for(unsigned i = 0; i < 4; ++i)
+        {
+            pool.post([&](){
+                started++;
+                while(!release) std::this_thread::yield();
+            });
+        }
+        while(started == 0) std::this_thread::yield();
+        std::this_thread::sleep_for(10ms);
+        ASSERT_EQ(started, 1);
+        ASSERT_EQ(pool.postp(PRIORITY_HIGH, [](){ return 1; }).get(), 1);
+        release = true;
+        pool.finish();
+        ASSERT_EQ(started, 4);
+    }
+
+    {
+        thread_pool pool(4);
+        pool.set_lane_limits(thread_pool::LANE_BACKGROUND, 0, 2);
+        std::atomic_uint running(0), most(0);
+        for(unsigned i = 0; i < 20; ++i)
+        {
+            pool.post([&](){
+                unsigned now = ++running;
+                unsigned prev = most;
+                while(now > prev && !most.compare_exchange_weak(prev, now));
+                std::this_thread::sleep_for(1ms);
+                running--;
+            });
+        }
+        pool.finish();
+        ASSERT_LE(most, 2);
+        ASSERT_GE(most, 1);
+    }
+
+    {
+        // A background task gets its turn after four frame tasks.
+        thread_pool pool(1);
+        pool.set_lane_aging(4);
+        std::atomic_bool started(false), release(false);
+        pool.post([&](){
+            started = true;
+            while(!release) std::this_thread::yield();
+        });
+        while(!started) std::this_thread::yield();
+
+        std::mutex order_mutex;
+        std::vector<unsigned> order;
+        for(unsigned i = 0; i < 10; ++i)
+        {
+            pool.postp(PRIORITY_HIGH, [&](){
+                std::lock_guard<std::mutex> lock(order_mutex);
+                order.push_back(PRIORITY_HIGH);
+            });
+        }
+        for(unsigned i = 0; i < 2; ++i)
+        {
+            pool.post([&](){
+                std::lock_guard<std::mutex> lock(order_mutex);
+                order.push_back(PRIORITY_LOW);
+            });
+        }
+        release = true;
+        pool.finish();
+
+        std::vector<unsigned> expected(12, PRIORITY_HIGH);
+        expected[4] = expected[9] = PRIORITY_LOW;
+        ASSERT_EQ(order, expected);
+    }
+}
+
+TEST(ThreadPoolTest, IdleTest)
+{
+    thread_pool pool(2);
+    pool.set_idle_spin(500us, 500us);
+
+    // Both tasks wait for each other, so they only finish if the second one
+    // gets a worker too, whether the workers were spinning or asleep.
+    for(unsigned i = 0; i < 20; ++i)
+    {
+        std::this_thread::sleep_for(i * 100us);
+        std::atomic_uint arrived(0);
+        auto barrier = [&](){
+            arrived++;
+            auto start = std::chrono::steady_clock::now();
+            while(arrived < 2)
+            {
+                if(std::chrono::steady_clock::now() - start > 5s) return false;
+                std::this_thread::yield();
+            }
+            return true;
+        };
+        auto a = pool.post(barrier);
+        auto b = pool.post(barrier);
+        ASSERT_TRUE(a.get());
+        ASSERT_TRUE(b.get());
+    }
+
+    std::atomic_uint ran(0);
+    for(unsigned i = 0; i < 1000; ++i) pool.post([&](){ ran++; });
+    pool.finish();
+    ASSERT_EQ(ran, 1000);
+
+    pool.set_idle_park(true);
+    std::this_thread::sleep_for(1ms);
+    ASSERT_EQ(pool.post([](){ return 1; }).get(), 1);
+    pool.set_idle_park(false);
+    pool.set_idle_spin(0ns, 0ns);
+    ASSERT_EQ(pool.post([](){ return 2; }).get(), 2);
+}
+
+TEST(ThreadPoolTest, MainThreadTest)
+{
+    thread_pool pool(2);
+    std::thread::id main_id = std::this_thread::get_id();
+
+    // Posted from workers, run only here.
+    std::atomic_uint ran(0);
+    std::atomic_bool elsewhere(false);
+    for(unsigned i = 0; i < 10; ++i)
+    {
+        pool.post([&](){
+            pool.postm({}, PRIORITY_LOW, [&](){
+                if(std::this_thread::get_id() != main_id) elsewhere = true;
+                ran++;
+            });
+        });
+    }
+    pool.finish();
+    std::this_thread::sleep_for(1ms);
+    ASSERT_EQ(ran, 0);
+    ASSERT_EQ(pool.run_main(), 10);
+    ASSERT_EQ(ran, 10);
+    ASSERT_FALSE(elsewhere);
+    ASSERT_EQ(pool.run_main(), 0);
+
+    // Whatever doesn't fit in the budget rolls over.
+    for(unsigned i = 0; i < 5; ++i)
+    {
+        pool.postm({}, PRIORITY_LOW, [](){
+            std::this_thread::sleep_for(10ms);
+        });
+    }
+    ASSERT_EQ(pool.run_main(1ms), 1);
+    ASSERT_EQ(pool.run_main(15ms), 2);
+    ASSERT_EQ(pool.run_main(), 2);
+
+    // Dependencies work both ways, and waiting here runs main thread tasks.
+    auto loaded = pool.post([](){ return 2; });
+    auto shown = pool.postm({loaded.get_id()}, PRIORITY_HIGH, [](){
+        return std::this_thread::get_id();
+    });
+    auto after = pool.postd({shown.get_id()}, PRIORITY_LOW, [](){ return 3; });
+    ASSERT_EQ(after.get(), 3);
+    ASSERT_EQ(shown.get(), main_id);
+    ASSERT_EQ(loaded.get(), 2);
+
+    // Without workers, they still wait for run_main().
+    thread_pool inline_pool(0);
+    auto deferred = inline_pool.postm({}, PRIORITY_LOW, [](){ return 4; });
+    ASSERT_EQ(inline_pool.post([](){ return 5; }).get(), 5);
+    ASSERT_EQ(deferred.wait_for(0s), std::future_status::timeout);
+    ASSERT_EQ(inline_pool.run_main(), 1);
+    ASSERT_EQ(deferred.get(), 4);
+}
+
+TEST(ThreadPoolTest, TimerTest)
+{
+    thread_pool pool(2);
+
+    // Timers never fire early.
+    std::vector<thread_pool::post_result<bool>> results;
+    for(unsigned i: {3u, 1u, 4u, 2u, 0u})
+    {
+        auto deadline = thread_pool::clock::now() + i * 5ms;
+        results.push_back(pool.post_at(deadline, PRIORITY_LOW, [deadline](){
+            return thread_pool::clock::now() >= deadline;
+        }));
+    }
+    auto start = thread_pool::clock::now();
+    auto late = pool.post_after(30ms, PRIORITY_HIGH, [](){
+        return thread_pool::clock::now();
+    });
+    ASSERT_GE(late.get() - start, 30ms);
+    for(auto& r: results) ASSERT_TRUE(r.get());
+
+    // A cancelled timer never runs its task.
+    std::atomic_bool ran(false);
+    auto cancelled = pool.post_after(5ms, PRIORITY_LOW, [&](){ ran = true; });
+    ASSERT_TRUE(cancelled.cancel());
+    ASSERT_THROW(cancelled.get(), std::future_error);
+    std::this_thread::sleep_for(10ms);
+    ASSERT_FALSE(ran);
+
+    // Far away timers wait in the upper levels of the wheel.
+    auto far = pool.post_after(1h, PRIORITY_LOW, [](){});
+    ASSERT_EQ(far.wait_for(10ms), std::future_status::timeout);
+
+    // Periodic timers keep going until cancelled.
+    std::atomic_uint ticks(0);
+    thread_pool::timer_id id = pool.post_every(2ms, PRIORITY_LOW, [&](){
+        ticks++;
+    });
+    while(ticks < 5) std::this_thread::sleep_for(1ms);
+    ASSERT_TRUE(pool.cancel_timer(id));
+    ASSERT_FALSE(pool.cancel_timer(id));
+    // A round may have been in flight already.
+    std::this_thread::sleep_for(5ms);
+    pool.finish();
+    unsigned stopped = ticks;
+    std::this_thread::sleep_for(10ms);
+    ASSERT_EQ(ticks, stopped);
+
+    // Without workers, timers fire while waiting.
+    thread_pool inline_pool(0);
+    auto delayed = inline_pool.post_after(5ms, PRIORITY_LOW, [](){ return 6; });
+    ASSERT_EQ(delayed.get(), 6);
+}
+
+TEST(ThreadPoolTest, AutoscaleTest)
+{
+    // Shrinking without waiting returns while the workers are still busy.
+    thread_pool pool(4);
+    std::atomic_bool release(false);
+    for(unsigned i = 0; i < 4; ++i)
+    {
+        pool.post([&](){ while(!release) std::this_thread::sleep_for(1ms); });
+    }
+    while(pool.busy() < 4) std::this_thread::yield();
+    pool.resize(1, false);
+    ASSERT_EQ(pool.size(), 4);
+    release = true;
+    while(pool.size() > 1) std::this_thread::sleep_for(1ms);
+    pool.resize(2);
+    ASSERT_EQ(pool.size(), 2);
+
+    // Grows under load, never past the maximum, and shrinks back once idle.
+    thread_pool::autoscale_params params;
+    params.min_threads = 1;
+    params.max_threads = 3;
+    params.interval = 1ms;
+    params.grow_after = 2;
+    params.shrink_after = 20;
+    pool.set_autoscale(params);
+
+    unsigned largest = 0;
+    for(unsigned i = 0; i < 200; ++i)
+    {
+        pool.post([](){ std::this_thread::sleep_for(1ms); });
+    }
+    while(pool.busy() != 0 || pool.size() > 1)
+    {
+        largest = std::max(largest, pool.size());
+        std::this_thread::sleep_for(1ms);
+    }
+    ASSERT_EQ(largest, 3);
+    ASSERT_EQ(pool.size(), 1);
+
+    // Sizes outside the limits are brought back within them.
+    pool.stop_autoscale();
+    pool.resize(0);
+    params.min_threads = 2;
+    pool.set_autoscale(params);
+    while(pool.size() < 2) std::this_thread::sleep_for(1ms);
+    ASSERT_EQ(pool.post([](){ return 7; }).get(), 7);
+}
+
+#ifdef __linux__
+static void write_file(const std::string& path, const std::string& content)
+{
+    std::ofstream(path) << content << "\n";
+}
+
+TEST(ThreadPoolTest, PlacementTest)
+{
+    // Two NUMA nodes with two cores each, and two hardware threads per core
+    // numbered like Linux does.
+    char root_template[] = "/tmp/thread_pool_sysfs_XXXXXX";
+    std::string root = mkdtemp(root_template);
+    mkdir((root + "/cpu").c_str(), 0755);
+    mkdir((root + "/node").c_str(), 0755);
+    write_file(root + "/cpu/online", "0-7");
+    for(unsigned i = 0; i < 8; ++i)
+    {
+        std::string cpu = root + "/cpu/cpu" + std::to_string(i);
+        mkdir(cpu.c_str(), 0755);
+        mkdir((cpu + "/topology").c_str(), 0755);
+        write_file(cpu + "/topology/core_id", std::to_string(i % 4));
+        write_file(
+            cpu + "/topology/physical_package_id",
+            std::to_string(i % 4 / 2)
+        );
+    }
+    write_file(root + "/node/online", "0-1");
+    mkdir((root + "/node/node0").c_str(), 0755);
+    mkdir((root + "/node/node1").c_str(), 0755);
+    write_file(root + "/node/node0/cpulist", "0-1,4-5");
+    write_file(root + "/node/node1/cpulist", "2-3,6-7");
+
+    std::vector<thread_pool::cpu_info> cpus =
+        thread_pool::read_cpu_topology(root);
+    ASSERT_EQ(cpus.size(), 8);
+    ASSERT_EQ(cpus[5].id, 5);
+    ASSERT_EQ(cpus[5].core, 1);
+    ASSERT_EQ(cpus[5].package, 0);
+    ASSERT_EQ(cpus[5].node, 0);
+    ASSERT_EQ(cpus[6].node, 1);
+    ASSERT_TRUE(thread_pool::read_cpu_topology(root + "/missing").empty());
+
+    ASSERT_EQ(
+        thread_pool::plan_placement(thread_pool::PLACE_SPREAD, cpus),
+        std::vector<unsigned>({0, 2, 1, 3, 4, 6, 5, 7})
+    );
+    ASSERT_EQ(
+        thread_pool::plan_placement(thread_pool::PLACE_COMPACT, cpus),
+        std::vector<unsigned>({0, 1, 4, 5, 2, 3, 6, 7})
+    );
+    ASSERT_TRUE(
+        thread_pool::plan_placement(thread_pool::PLACE_ANYWHERE, cpus).empty()
+    );
+    std::system(("rm -rf " + root).c_str());
+
+    // On the real machine, every worker ends up pinned to a single CPU, and
+    // new ones get the numbers freed by shrinking.
+    thread_pool pool(3);
+    pool.set_placement(thread_pool::PLACE_SPREAD);
+    pool.resize(1);
+    pool.resize(3);
+    ASSERT_EQ(pool.get_placement(), thread_pool::PLACE_SPREAD);
+
+    std::mutex names_mutex;
+    std::set<std::string> names;
+    std::atomic_uint arrived(0);
+    std::atomic_bool pinned(true);
+    for(unsigned i = 0; i < 3; ++i)
+    {
+        pool.post([&](){
+            char name[16] = {0};
+            pthread_getname_np(pthread_self(), name, sizeof(name));
+            cpu_set_t set;
+            pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+            if(CPU_COUNT(&set) != 1) pinned = false;
+            {
+                std::lock_guard<std::mutex> lock(names_mutex);
+                names.insert(name);
+            }
+            // Keeps this worker from taking another one of these.
+            arrived++;
+            while(arrived < 3) std::this_thread::yield();
+        });
+    }
+    pool.finish();
+    ASSERT_TRUE(pinned);
+    ASSERT_EQ(
+        names,
+        std::set<std::string>({"worker 0", "worker 1", "worker 2"})
+    );
+
+    pool.set_placement(thread_pool::PLACE_ANYWHERE);
+    ASSERT_EQ(pool.get_placement(), thread_pool::PLACE_ANYWHERE);
+    ASSERT_EQ(pool.post([](){ return 1; }).get(), 1);
+}
+#endif
+
+TEST(ThreadPoolTest, PromiseTest)
+{
+    thread_pool pool(2);
+
+    // Completed from a thread outside of the pool.
+    thread_pool::promise<std::string> p = pool.make_promise<std::string>();
+    thread_pool::post_result<size_t> length = p.get_result().then(
+        [](std::string s){ return s.size(); }
+    );
+    ASSERT_THROW(p.get_result(), std::future_error);
+    std::thread t([&](){ p.set_value(3, 'x'); });
+    ASSERT_EQ(length.get(), 3);
+    t.join();
+    ASSERT_FALSE(p.valid());
+
+    // Tasks can wait for it like for any other result.
+    thread_pool::promise<> v = pool.make_promise();
+    std::vector<thread_pool::post_result<>> inputs;
+    inputs.push_back(v.get_result());
+    thread_pool::post_result<> all = pool.when_all(std::move(inputs));
+    ASSERT_EQ(
+        all.wait_for(std::chrono::milliseconds(1)),
+        std::future_status::timeout
+    );
+    v.set_value();
+    all.get();
+
+    thread_pool::promise<int> e = pool.make_promise<int>();
+    thread_pool::post_result<int> failed = e.get_result();
+    e.set_exception(std::make_exception_ptr(std::runtime_error("failed")));
+    ASSERT_THROW(failed.get(), std::runtime_error);
+
+    thread_pool::post_result<int> broken;
+    {
+        thread_pool::promise<int> dropped = pool.make_promise<int>();
+        broken = dropped.get_result();
+    }
+    ASSERT_THROW(broken.get(), std::future_error);
+}
+
+#ifdef THREAD_POOL_TRACING
+TEST(ThreadPoolTest, TraceTest)
+{
+    thread_pool pool(2);
+
+    auto first = pool.post([](){ std::this_thread::sleep_for(1ms); });
+    auto second = pool.postd({first.get_id()}, PRIORITY_HIGH, [](){});
+    second.wait();
+    for(unsigned i = 0; i < 100; ++i) pool.post([](){});
+    pool.finish();
+
+    thread_pool::trace_stats stats = pool.get_trace_stats();
+    ASSERT_EQ(stats.run_time.total(), 102);
+    ASSERT_EQ(stats.queue_latency.total(), 102);
+    ASSERT_EQ(stats.queue_depth.total(), 102);
+    // The dependent task waited for at least the sleep.
+    ASSERT_GE(stats.dependency_wait.percentile(1.0), 1000000);
+    ASSERT_GE(stats.run_time.percentile(1.0), 1000000);
+
+    std::stringstream json;
+    pool.write_trace(json);
+    std::string trace = json.str();
+    ASSERT_EQ(trace.find("{\"traceEvents\":["), 0);
+    size_t tasks = 0;
+    for(
+        size_t pos = trace.find("\"ph\":\"X\"");
+        pos != std::string::npos;
+        pos = trace.find("\"ph\":\"X\"", pos + 1)
+    ) tasks++;
+    ASSERT_EQ(tasks, 102);
+    ASSERT_NE(trace.find("\"priority\":1000"), std::string::npos);
+}
+
+static size_t count_traced_threads(const thread_pool& pool)
+{
+    std::stringstream json;
+    pool.write_trace(json);
+    std::string trace = json.str();
+    size_t threads = 0;
+    for(
+        size_t pos = trace.find("thread_name");
+        pos != std::string::npos;
+        pos = trace.find("thread_name", pos + 1)
+    ) threads++;
+    return threads;
+}
+
+TEST(ThreadPoolTest, TraceBufferTest)
+{
+    // Posting to two pools in turn keeps one buffer per thread in each.
+    thread_pool a(1), b(1);
+    for(unsigned i = 0; i < 1000; ++i)
+    {
+        a.post([](){});
+        b.post([](){});
+    }
+    a.finish();
+    b.finish();
+    ASSERT_LE(count_traced_threads(a), 2u);
+    ASSERT_LE(count_traced_threads(b), 2u);
+
+    // Traces can be written while the buffers wrap around.
+    std::atomic_bool done(false);
+    std::thread writer([&](){
+        while(!done) count_traced_threads(a);
+    });
+    for(unsigned i = 0; i < 50000; ++i) a.post([](){});
+    a.finish();
+    done = true;
+    writer.join();
+}
+#endif
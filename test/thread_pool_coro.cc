@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+#include "thread_pool_coro.hh"
+#define POOL_SIZE 8
+
+// GCC can't tell that the replaced operators below belong together.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+// Counts every allocation in the process, for AllocationTest.
+static std::atomic<size_t> allocation_count(0);
+
+void* operator new(size_t size)
+{
+    allocation_count++;
+    void* ptr = std::malloc(size ? size : 1);
+    if(!ptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static task<int> add(thread_pool& pool, int a, int b)
+{
+    co_await pool.schedule();
+    co_return a + b;
+}
+
+static task<int> sum(thread_pool& pool, int n)
+{
+    if(n == 0) co_return 0;
+    int rest = co_await sum(pool, n - 1);
+    co_return rest + co_await add(pool, n, 0);
+}
+
+TEST(ThreadPoolCoroutineTest, ScheduleTest)
+{
+    thread_pool pool(POOL_SIZE);
+    std::thread::id caller = std::this_thread::get_id();
+
+    auto where = [&]() -> task<std::thread::id> {
+        co_await pool.schedule(PRIORITY_HIGH);
+        co_return std::this_thread::get_id();
+    };
+    ASSERT_NE(sync_wait(where()), caller);
+    ASSERT_EQ(sync_wait(add(pool, 2, 3)), 5);
+    ASSERT_EQ(sync_wait(sum(pool, 100)), 5050);
+}
+
+TEST(ThreadPoolCoroutineTest, PostResultTest)
+{
+    // A single worker would deadlock if awaiting blocked it.
+    for(unsigned thread_count: {0u, 1u, (unsigned)POOL_SIZE})
+    {
+        thread_pool pool(thread_count);
+
+        auto chain = [&]() -> task<int> {
+            co_await pool.schedule();
+            int a = co_await pool.post([](){ return 20; });
+            int b = co_await pool.postp(PRIORITY_PRONTO, [](){ return 22; });
+            co_await pool.post([](){});
+            co_return a + b;
+        };
+        ASSERT_EQ(sync_wait(chain()), 42);
+    }
+}
+
+TEST(ThreadPoolCoroutineTest, ExceptionTest)
+{
+    thread_pool pool(POOL_SIZE);
+
+    auto failing = [&]() -> task<> {
+        co_await pool.schedule();
+        throw std::runtime_error("Oops");
+    };
+    auto awaiting = [&]() -> task<int> {
+        co_await failing();
+        co_return 0;
+    };
+    ASSERT_THROW(sync_wait(awaiting()), std::runtime_error);
+
+    auto post_failing = [&]() -> task<> {
+        co_await pool.post([](){ throw std::runtime_error("Oops"); });
+    };
+    ASSERT_THROW(sync_wait(post_failing()), std::runtime_error);
+}
+
+TEST(ThreadPoolCoroutineTest, AllocationTest)
+{
+    thread_pool pool(POOL_SIZE);
+
+    auto work = [&](){
+        for(int i = 0; i < 100; ++i)
+        {
+            ASSERT_EQ(sync_wait(sum(pool, 10)), 55);
+        }
+    };
+
+    // Let the frame lists and task storage warm up first.
+    for(int i = 0; i < 10; ++i) work();
+
+    size_t allocations_before = allocation_count;
+    work();
+    ASSERT_EQ(allocation_count - allocations_before, 0);
+}